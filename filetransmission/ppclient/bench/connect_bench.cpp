@@ -0,0 +1,134 @@
+// Connect latency of a client: discovery by beacons and the sweep at once, the way autoConnect finds a server, against
+// the sweep alone, the way it did before beacons. A DiscoveryServer of this process beacons and answers probes for a
+// TCP listener of this process, every run times discovery and the TCP connect to the server found. The sweep finds it
+// by its subnet broadcast, the sweep never probes this host.
+// Usage: ppconnect_bench [runs, 5] [sweep deadline in ms, 2000] [discovery port, 60209] [tcp port, 60210]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <ppcommon/discovery.hpp>
+
+#include "discovery_client.hpp"
+#include "discovery_server.hpp"
+
+namespace
+{
+using namespace PingPong;
+using tcp = boost::asio::ip::tcp;
+
+struct Sample
+{
+    std::chrono::milliseconds elapsed;
+    bool found;
+};
+
+// Beacons of other servers on this network are heard too, only the one of this process counts
+std::optional<DiscoveredServer> ours(const std::vector<DiscoveredServer> &servers, const uint16_t tcp_port)
+{
+    auto it = std::find_if(servers.begin(), servers.end(), [tcp_port](const DiscoveredServer &server)
+                           { return server.port == tcp_port; });
+
+    if (it == servers.end())
+        return std::nullopt;
+
+    return *it;
+}
+
+// Discovery by `discover`, then a connect to what it found
+template <class F>
+Sample measure(F &&discover)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    boost::asio::io_context context;
+    std::optional<DiscoveredServer> found = discover(context);
+
+    if (found)
+    {
+        boost::system::error_code ec;
+        tcp::socket socket(context);
+        std::ignore = socket.connect(tcp::endpoint(boost::asio::ip::make_address(found->address), found->port), ec);
+        found = ec ? std::nullopt : found;
+    }
+
+    return Sample{std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start), found.has_value()};
+}
+
+std::chrono::milliseconds median(std::vector<Sample> samples)
+{
+    std::sort(samples.begin(), samples.end(), [](const Sample &lhs, const Sample &rhs)
+              { return lhs.elapsed < rhs.elapsed; });
+
+    return samples[samples.size() / 2].elapsed;
+}
+
+void report(const char *name, const std::vector<Sample> &samples)
+{
+    auto [min, max] = std::minmax_element(samples.begin(), samples.end(), [](const Sample &lhs, const Sample &rhs)
+                                          { return lhs.elapsed < rhs.elapsed; });
+    const auto found = std::count_if(samples.begin(), samples.end(), [](const Sample &sample)
+                                     { return sample.found; });
+
+    std::cout << name << ": median " << median(samples).count() << " ms, min " << min->elapsed.count() << ", max " << max->elapsed.count()
+              << ", connected " << found << " of " << samples.size() << '\n';
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const size_t runs = std::max<size_t>(argc > 1 ? std::stoul(argv[1]) : 5, 1);
+    const std::chrono::milliseconds deadline{argc > 2 ? std::stoul(argv[2]) : 2000};
+    const uint16_t discovery_port = static_cast<uint16_t>(argc > 3 ? std::stoul(argv[3]) : 60209);
+    const uint16_t tcp_port = static_cast<uint16_t>(argc > 4 ? std::stoul(argv[4]) : 60210);
+
+    // The server gets an io thread of its own, as in ppserver. Connects complete in the backlog, nothing accepts them
+    boost::asio::io_context server_context;
+    tcp::acceptor acceptor(server_context, tcp::endpoint(tcp::v4(), tcp_port));
+    DiscoveryServer server(server_context, discovery_port, tcp_port, []()
+                           { return Common::ServerLoad{}; });
+
+    auto work = boost::asio::make_work_guard(server_context);
+    std::thread server_thread([&server_context]()
+                              { server_context.run(); });
+
+    UnicastSweepOptions options;
+    options.deadline = deadline;
+
+    // As autoConnect
+    auto beacons_and_sweep = [&](boost::asio::io_context &context)
+    { return ours(discoverServers(context, discovery_port, options), tcp_port); };
+
+    auto sweep = [&](boost::asio::io_context &context)
+    { return ours(discoverServersByUnicastSweep(context, discovery_port, options), tcp_port); };
+
+    std::vector<Sample> beacons;
+    std::vector<Sample> sweeps;
+
+    // Interleaved, so that both see the same state of the network
+    for (size_t i = 0; i < runs; ++i)
+    {
+        beacons.push_back(measure(beacons_and_sweep));
+        sweeps.push_back(measure(sweep));
+    }
+
+    server_context.stop();
+    server_thread.join();
+
+    std::cout << runs << " runs, sweep deadline " << deadline.count() << " ms\n";
+    report("beacons and sweep", beacons);
+    report("sweep only       ", sweeps);
+
+    const bool connected = std::all_of(beacons.begin(), beacons.end(), [](const Sample &sample)
+                                       { return sample.found; });
+
+    return connected && median(beacons) < median(sweeps) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,13 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <filesystem>
 #include <string>
 
 #include <net_common/net_client.hpp>
 
 #include <logger/logger.hpp>
+#include <ppcommon/discovery.hpp>
 #include <ppcommon/ppcommon.hpp>
 
+#include "discovery_cache.hpp"
 #include "discovery_client.hpp"
 
 namespace PingPong
@@ -21,6 +24,11 @@ class FileClient : public Net::ClientBase<Common::EMessageType>
     {
     }
 
+    explicit FileClient(Net::TSQueue<Net::OwnedMessage<Common::EMessageType>> &messages_in)
+        : Net::ClientBase<Common::EMessageType>(messages_in)
+    {
+    }
+
     ~FileClient() override = default;
 
     void waitForIncomingQueueMessage(const std::chrono::milliseconds &check_period)
@@ -28,21 +36,131 @@ class FileClient : public Net::ClientBase<Common::EMessageType>
         m_connection->waitForIncomingQueueMessage(check_period);
     }
 
-    bool autoConnect(uint16_t discovery_port, std::chrono::milliseconds timeout, std::chrono::milliseconds polling_delay = std::chrono::milliseconds(50))
+    // Connects to the server cached for this network while it still answers, unless the beacons heard meanwhile show a
+    // less loaded one. Otherwise to the least loaded server heard in beacons or answering the sweep, both run at once.
+    // A server is cached once it validated the connection. Discovery runs on a context of its own, apart from the one
+    // of the given up connection
+    bool autoConnect(uint16_t discovery_port, std::chrono::milliseconds timeout)
     {
         DBG_LOG(" discovery_port = ", discovery_port);
-        // std::optional<DiscoveredServer> res = discoverServer(m_context, discovery_port, timeout, polling_delay);
-        std::optional<DiscoveredServer> res = discoverServerByUnicastBruteforce(m_context, discovery_port, timeout, polling_delay);
 
-        if (res)
+        DiscoveryCache cache;
+        boost::asio::io_context discovery_context;
+
+        if (std::optional<DiscoveredServer> cached = cache.load())
         {
-            DBG_LOG("Connecting to ", res->address, ":", res->port);
-            return connect(res->address, res->port);
+            DBG_LOG("Connecting to cached ", cached->address, ":", cached->port);
+
+            // The connect goes on in the background while the beacons are listened to
+            const bool connecting = connectTo(cached->address, cached->port);
+            const std::optional<DiscoveredServer> better = lessLoadedThan(*cached, discoverServersByBeacon(discovery_context, Common::c_beacon_window));
+
+            if (!better && connecting && waitForValidation(c_cached_connect_timeout))
+                return true;
+
+            disconnect();
+
+            if (better)
+            {
+                DBG_LOG("Beacons show a less loaded server than the cached one");
+
+                if (connectAndStore(cache, *better, timeout))
+                    return true;
+            }
+            else
+            {
+                DBG_LOG("Cached server does not answer, discovering...");
+                cache.forget(*cached);
+            }
+        }
+
+        UnicastSweepOptions options;
+        options.deadline = timeout;
+
+        if (std::optional<DiscoveredServer> found = pickLeastLoaded(discoverServers(discovery_context, discovery_port, options)))
+        {
+            if (connectAndStore(cache, *found, timeout))
+                return true;
         }
 
         DBG_LOG("Discovery failed, trying localhost fallback...");
-        return connect("127.0.0.1", 60010);
+        return connectTo("127.0.0.1", 60010);
+    }
+
+    // False when the server has not validated the connection in time
+    bool waitForValidation(const std::chrono::milliseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+        while (!(isConnected() && isValidated()))
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    }
+
+    // Remembers the endpoint, so that stripes can join the same server without discovery
+    bool connectTo(const std::string &address, uint16_t port)
+    {
+        m_address = address;
+        m_port = port;
+        return connect(address, port);
+    }
+
+    const std::string &getAddress() const
+    {
+        return m_address;
+    }
+
+    uint16_t getPort() const
+    {
+        return m_port;
     }
+
+  private:
+    // Caches the server only once it validated the connection
+    bool connectAndStore(DiscoveryCache &cache, const DiscoveredServer &server, const std::chrono::milliseconds timeout)
+    {
+        DBG_LOG("Connecting to ", server.address, ":", server.port);
+
+        if (connectTo(server.address, server.port) && waitForValidation(timeout))
+        {
+            cache.store(server);
+            return true;
+        }
+
+        DBG_LOG(server.address, ":", server.port, " did not validate the connection");
+        disconnect();
+
+        return false;
+    }
+
+    // The least loaded server heard when it is less loaded than the cached one. Without a beacon of the cached server
+    // its load is unknown, it is kept then
+    static std::optional<DiscoveredServer> lessLoadedThan(const DiscoveredServer &cached, const std::vector<DiscoveredServer> &beacons)
+    {
+        auto same = [&cached](const DiscoveredServer &server)
+        { return server.address == cached.address && server.port == cached.port; };
+
+        auto current = std::find_if(beacons.begin(), beacons.end(), same);
+        std::optional<DiscoveredServer> best = pickLeastLoaded(beacons);
+
+        if (current == beacons.end() || !best || same(*best) || !Common::less_loaded(best->load, current->load))
+            return std::nullopt;
+
+        return best;
+    }
+
+  private:
+    // A server on the local network validates well within this
+    static constexpr std::chrono::milliseconds c_cached_connect_timeout{250};
+
+    std::string m_address;
+    uint16_t m_port = 0;
 };
 
 namespace fs = std::filesystem;
@@ -59,5 +177,8 @@ struct Operation
     EOperationType type;
     fs::path filepath;
     std::string receival_code_phrase;
+    uint8_t stripe_count = 1;
+    Common::ECompression compression = Common::ECompression::None;
+    Common::EIntegrity integrity = Common::EIntegrity::Sha256;
 };
 } // namespace PingPong
@@ -0,0 +1,192 @@
+#include "discovery_cache.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+#include <vector>
+
+#include <logger/logger.hpp>
+
+#include "unix_ip_utils.hpp"
+
+namespace PingPong
+{
+namespace
+{
+struct CacheEntry
+{
+    std::string key;
+    DiscoveredServer server;
+    int64_t found_at = 0;
+};
+
+// Keys hold a space, so the key is the first two fields
+std::vector<CacheEntry> readEntries(const std::filesystem::path &file)
+{
+    std::vector<CacheEntry> res;
+    std::ifstream ifs(file);
+    std::string line;
+
+    while (std::getline(ifs, line))
+    {
+        std::istringstream fields(line);
+        std::string ifc;
+        std::string network;
+        CacheEntry entry;
+
+        if (fields >> ifc >> network >> entry.server.address >> entry.server.port >> entry.found_at)
+        {
+            entry.key = ifc + " " + network;
+            res.push_back(std::move(entry));
+        }
+    }
+
+    return res;
+}
+
+void writeEntries(const std::filesystem::path &file, const std::vector<CacheEntry> &entries)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(file.parent_path(), ec);
+
+    // Written aside and renamed, a concurrent run never reads half a file
+    const std::filesystem::path tmp = file.string() + ".tmp";
+
+    {
+        std::ofstream ofs(tmp, std::ios::trunc);
+
+        for (const CacheEntry &entry : entries)
+            ofs << entry.key << ' ' << entry.server.address << ' ' << entry.server.port << ' ' << entry.found_at << '\n';
+
+        if (!ofs)
+        {
+            DBG_LOG("[DISCOVERY] failed to write ", tmp);
+            return;
+        }
+    }
+
+    std::filesystem::rename(tmp, file, ec);
+
+    if (ec)
+        std::filesystem::remove(tmp, ec);
+}
+
+// Host bits of the interface's subnet are zero in its mask
+uint32_t netmask(const LocalInterface &ifc)
+{
+    return ~(ifc.range.network.to_uint() ^ ifc.range.broadcast.to_uint());
+}
+
+std::string networkKeyOf(const LocalInterface &ifc)
+{
+    const size_t prefix = std::bitset<32>(netmask(ifc)).count();
+    return ifc.name + " " + ifc.range.network.to_string() + "/" + std::to_string(prefix);
+}
+
+int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+} // namespace
+
+DiscoveryCache::DiscoveryCache(std::filesystem::path file)
+    : m_file{std::move(file)}
+{
+}
+
+std::filesystem::path DiscoveryCache::defaultPath()
+{
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return std::filesystem::path(xdg) / "pingpong" / "servers";
+
+    if (const char *home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "pingpong" / "servers";
+
+    std::error_code ec;
+    return std::filesystem::temp_directory_path(ec) / "pingpong-servers";
+}
+
+std::string DiscoveryCache::networkKey(const std::string &address)
+{
+    boost::system::error_code ec;
+    const boost::asio::ip::address_v4 server = boost::asio::ip::make_address_v4(address, ec);
+
+    if (ec)
+        return {};
+
+    for (const LocalInterface &ifc : getLocalInterfaces())
+    {
+        if ((server.to_uint() & netmask(ifc)) == ifc.range.network.to_uint())
+            return networkKeyOf(ifc);
+    }
+
+    return {};
+}
+
+std::optional<DiscoveredServer> DiscoveryCache::load() const
+{
+    std::vector<std::string> keys;
+
+    for (const LocalInterface &ifc : getLocalInterfaces())
+        keys.push_back(networkKeyOf(ifc));
+
+    // Most recent first
+    for (const CacheEntry &entry : readEntries(m_file))
+    {
+        if (std::find(keys.begin(), keys.end(), entry.key) == keys.end())
+            continue;
+
+        const int64_t age = now() - entry.found_at;
+
+        if (age < 0 || age > c_ttl.count() || entry.server.port == 0)
+        {
+            DBG_LOG("[DISCOVERY] cached server of ", entry.key, " expired");
+            continue;
+        }
+
+        return entry.server;
+    }
+
+    return std::nullopt;
+}
+
+void DiscoveryCache::store(const DiscoveredServer &server)
+{
+    const std::string key = networkKey(server.address);
+
+    if (key.empty())
+    {
+        DBG_LOG("[DISCOVERY] ", server.address, " is on no local network, not cached");
+        return;
+    }
+
+    std::vector<CacheEntry> entries = readEntries(m_file);
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&key](const CacheEntry &entry)
+                                 { return entry.key == key; }),
+                  entries.end());
+
+    // Most recent first, the oldest networks fall off
+    entries.insert(entries.begin(), CacheEntry{key, server, now()});
+
+    if (entries.size() > c_max_entries)
+        entries.resize(c_max_entries);
+
+    writeEntries(m_file, entries);
+}
+
+void DiscoveryCache::forget(const DiscoveredServer &server)
+{
+    std::vector<CacheEntry> entries = readEntries(m_file);
+    auto it = std::remove_if(entries.begin(), entries.end(), [&server](const CacheEntry &entry)
+                             { return entry.server.address == server.address && entry.server.port == server.port; });
+
+    if (it == entries.end())
+        return;
+
+    entries.erase(it, entries.end());
+    writeEntries(m_file, entries);
+}
+} // namespace PingPong
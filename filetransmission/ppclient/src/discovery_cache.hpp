@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include "discovery_client.hpp"
+
+namespace PingPong
+{
+// Last server found on each local network, so that later runs can connect without discovery.
+// One line per network: "<key> <address> <port> <unix time found>", entries older than the TTL are ignored.
+// An entry is kept under the network of the server's address, any of the local networks discovery sweeps
+class DiscoveryCache
+{
+  public:
+    static constexpr std::chrono::seconds c_ttl{60 * 60};
+    static constexpr size_t c_max_entries = 16;
+
+  public:
+    explicit DiscoveryCache(std::filesystem::path file = defaultPath());
+
+    // $XDG_CACHE_HOME/pingpong/servers, ~/.cache/pingpong/servers without it
+    static std::filesystem::path defaultPath();
+
+    // "<interface> <network>/<prefix>" of the local network `address` is on, empty when it is on none
+    static std::string networkKey(const std::string &address);
+
+    // The server stored last for one of the networks this host is on now
+    std::optional<DiscoveredServer> load() const;
+    void store(const DiscoveredServer &server);
+    void forget(const DiscoveredServer &server);
+
+  private:
+    const std::filesystem::path m_file;
+};
+} // namespace PingPong
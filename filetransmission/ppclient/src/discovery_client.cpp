@@ -1,142 +1,587 @@
 #include "discovery_client.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <optional>
 #include <thread>
 
 #include <boost/asio/ip/address_v4.hpp>
 
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
 #include <logger/logger.hpp>
+#include <ppcommon/discovery.hpp>
 
 #include "unix_ip_utils.hpp"
 
 namespace PingPong
 {
 
-std::string getLocalSubnet()
+namespace
 {
-    using boost::asio::ip::udp;
+using Common::c_discovery_phrase;
 
-    boost::asio::io_context ctx;
-    udp::socket tmp(ctx);
+// Probes due by the rate go out every tick, c_sweep_batch of them per system call
+constexpr std::chrono::milliseconds c_sweep_tick{5};
+constexpr size_t c_sweep_batch = 64;
+// Left of the deadline for the replies to the last probes
+constexpr std::chrono::milliseconds c_sweep_reply_time{250};
 
-    tmp.connect(udp::endpoint(boost::asio::ip::make_address_v4("8.8.8.8"), 80));
+// False when the server is known already, its load is updated then
+bool addServer(std::vector<DiscoveredServer> &servers, DiscoveredServer server)
+{
+    for (DiscoveredServer &known : servers)
+    {
+        if (known.address == server.address && known.port == server.port)
+        {
+            known.load = server.load;
+            return false;
+        }
+    }
 
-    auto endpoint = tmp.local_endpoint();
-    auto ip = endpoint.address().to_v4();
+    DBG_LOG("[DISCOVERY] found server at ", server.address, ":", server.port, ", sessions = ", server.load.sessions,
+            ", queued bytes = ", server.load.queued_bytes, ", io utilization = ", server.load.io_utilization, "/1000");
+    servers.push_back(std::move(server));
 
-    // Example: 192.168.0.108 -> "192.168.0."
-    auto raw = ip.to_string();
-    auto lastDot = raw.rfind('.');
-    return raw.substr(0, lastDot + 1);
+    return true;
 }
 
-std::optional<DiscoveredServer> discoverServerByUnicastBruteforce(
-    boost::asio::io_context &context,
-    uint16_t discovery_port,
-    std::chrono::milliseconds timeout,
-    std::chrono::milliseconds polling_delay)
+// Probes the subnets of all local interfaces from one socket, the kernel routes every probe out of its interface.
+// Each subnet also gets a directed broadcast first, it answers at once where broadcasts pass
+class UnicastSweep
 {
-    using boost::asio::ip::udp;
-    static constexpr char c_discovery_phrase[] = "pingpong_discover_v1";
-    static constexpr char c_response_phrase[] = "pingpong_server_v1";
+  public:
+    UnicastSweep(boost::asio::io_context &context, const std::vector<LocalInterface> &interfaces, const uint16_t port, const UnicastSweepOptions &options)
+        : m_socket{context}, m_pacer{context}, m_deadline{context}, m_options{options}, m_port{port}
+    {
+        for (const LocalInterface &ifc : interfaces)
+        {
+            m_locals.push_back(ifc.address.to_uint());
 
-    std::string ifc;
-    auto local_ip_opt = getLocalIPv4(ifc);
+            // Several addresses of one subnet sweep it once
+            auto same = [&ifc](const Subnet &subnet)
+            { return subnet.broadcast == ifc.range.broadcast.to_uint() && subnet.first == ifc.range.first_host.to_uint(); };
 
-    if (!local_ip_opt)
+            if (ifc.range.host_count > 0 && std::none_of(m_subnets.begin(), m_subnets.end(), same))
+                m_subnets.push_back(Subnet{ifc.range.first_host.to_uint(), ifc.range.first_host.to_uint(), ifc.range.last_host.to_uint(), ifc.range.broadcast.to_uint()});
+        }
+
+        m_rate = sweepRate();
+    }
+
+    bool start()
     {
-        DBG_LOG("[DISCOVERY] failed to get local ip");
-        return std::nullopt;
+        using boost::asio::ip::udp;
+        boost::system::error_code ec;
+
+        std::ignore = m_socket.open(udp::v4(), ec);
+
+        if (!ec)
+            std::ignore = m_socket.bind(udp::endpoint(udp::v4(), 0), ec);
+
+        if (!ec)
+            std::ignore = m_socket.non_blocking(true, ec);
+
+        if (!ec)
+            std::ignore = m_socket.set_option(boost::asio::socket_base::broadcast(true), ec);
+
+        if (ec)
+        {
+            DBG_LOG("[DISCOVERY] socket error : ", ec.message());
+            return false;
+        }
+
+        // Probes to hosts the kernel is still resolving keep their buffer space, a /16 has thousands of them
+        std::ignore = m_socket.set_option(boost::asio::socket_base::send_buffer_size(4 * 1024 * 1024), ec);
+
+        DBG_LOG("[DISCOVERY] ", m_rate, " probes/s");
+
+        m_start = std::chrono::steady_clock::now();
+        endAt(m_start + m_options.deadline);
+
+        receive();
+        sendBroadcasts();
+        sendDue();
+
+        return true;
     }
 
-    DBG_LOG("[DISCOVERY] local ip = ", local_ip_opt->to_string());
+    const std::vector<DiscoveredServer> &servers() const
+    {
+        return m_servers;
+    }
 
-    auto netmask_opt = getNetmaskForIP(*local_ip_opt);
+    // Called once the sweep is over, whether it ended by itself or by finish()
+    void onFinish(std::function<void()> callback)
+    {
+        m_on_finish = std::move(callback);
+    }
 
-    if (!netmask_opt)
+    void finish()
     {
-        DBG_LOG("[DISCOVERY] failed to get netmask");
-        return std::nullopt;
+        if (m_done)
+            return;
+
+        m_done = true;
+
+        if (!swept())
+            DBG_LOG("[DISCOVERY] stopped after sweeping ", m_sent, " hosts");
+
+        boost::system::error_code ec;
+        m_pacer.cancel();
+        m_deadline.cancel();
+        std::ignore = m_socket.close(ec);
+
+        if (m_on_finish)
+            m_on_finish();
     }
 
-    SubnetRange subrange = getSubnetRange(*local_ip_opt, *netmask_opt);
+  private:
+    struct Subnet
+    {
+        uint64_t next; // 64 bits, the last host may be 255.255.255.254
+        uint64_t first;
+        uint64_t last;
+        uint32_t broadcast;
+    };
+
+  private:
+    // Fast enough to probe every host while replies can still come in, a /16 included
+    uint64_t sweepRate() const
+    {
+        uint64_t hosts = 0;
+
+        for (const Subnet &subnet : m_subnets)
+            hosts += subnet.last + 1 - subnet.first;
 
-    DBG_LOG("[DISCOVERY] local_ip   = ", local_ip_opt->to_string());
-    DBG_LOG("[DISCOVERY] netmask    = ", netmask_opt->to_string());
-    DBG_LOG("[DISCOVERY] network    = ", subrange.network.to_string());
-    DBG_LOG("[DISCOVERY] broadcast  = ", subrange.broadcast.to_string());
-    DBG_LOG("[DISCOVERY] first_host = ", subrange.first_host.to_string());
-    DBG_LOG("[DISCOVERY] last_host  = ", subrange.last_host.to_string());
-    DBG_LOG("[DISCOVERY] host_count = ", subrange.host_count);
+        const auto window = std::max(m_options.deadline - c_sweep_reply_time, m_options.deadline / 2);
+        const uint64_t needed = window.count() > 0 ? hosts * 1000 / static_cast<uint64_t>(window.count()) + 1 : hosts;
+        const uint64_t rate = std::max<uint64_t>(m_options.probes_per_second, needed);
 
-    udp::socket sock(context);
-    sock.open(udp::v4());
-    sock.bind(udp::endpoint(udp::v4(), 0));
-    sock.non_blocking(true);
+        if (rate > m_options.max_probes_per_second)
+            DBG_LOG("[DISCOVERY] ", hosts, " hosts are too many to sweep by the deadline");
 
-    const uint32_t net_int = subrange.network.to_uint();
-    const uint32_t first_host_int = subrange.first_host.to_uint();
-    const uint32_t last_host_int = subrange.last_host.to_uint();
+        return std::min<uint64_t>(rate, std::max(m_options.probes_per_second, m_options.max_probes_per_second));
+    }
 
-    for (uint32_t addr_int = first_host_int; addr_int <= last_host_int; ++addr_int)
+    void receive()
     {
-        boost::asio::ip::address_v4 addr(addr_int);
-        if (addr == *local_ip_opt)
-            continue;
+        m_socket.async_receive_from(boost::asio::buffer(m_buffer), m_sender,
+                                    [this](const boost::system::error_code &ec, size_t bytes)
+                                    {
+                                        if (m_done)
+                                            return;
+
+                                        if (ec)
+                                            DBG_LOG("[DISCOVERY] error : ", ec.message());
+                                        else if (auto response = Common::parse_response(std::string_view(m_buffer.data(), bytes)))
+                                            onServer(DiscoveredServer{m_sender.address().to_string(), response->port, response->load});
+
+                                        if (!m_done)
+                                            receive();
+                                    });
+    }
 
-        udp::endpoint endpoint(addr, discovery_port);
-        boost::system::error_code ec;
-        sock.send_to(boost::asio::buffer(c_discovery_phrase, strlen(c_discovery_phrase)), endpoint, 0, ec);
-        std::ignore = ec;
+    void onServer(DiscoveredServer server)
+    {
+        if (addServer(m_servers, std::move(server)) && m_servers.size() == 1 && m_options.gather)
+            endAt(std::min(m_deadline.expiry(), std::chrono::steady_clock::now() + *m_options.gather));
     }
 
-    std::array<char, 1024> buffer;
-    udp::endpoint sender_endpoint;
-    auto start = std::chrono::steady_clock::now();
+    // Moving the end cancels the wait for the former one
+    void endAt(const std::chrono::steady_clock::time_point end)
+    {
+        m_deadline.expires_at(end);
+        m_deadline.async_wait([this](const boost::system::error_code &ec)
+                              {
+                                  if (!ec)
+                                      finish();
+                              });
+    }
 
-    // Wait for response(s)
-    while (true)
+    void sendBroadcasts()
+    {
+        for (const Subnet &subnet : m_subnets)
+        {
+            boost::system::error_code ec;
+            const boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::address_v4(subnet.broadcast), m_port);
+            m_socket.send_to(boost::asio::buffer(c_discovery_phrase, sizeof(c_discovery_phrase) - 1), endpoint, 0, ec);
+
+            if (ec)
+                DBG_LOG("[DISCOVERY] broadcast to ", endpoint.address().to_string(), " failed : ", ec.message());
+        }
+    }
+
+    bool swept() const
     {
+        return std::all_of(m_subnets.begin(), m_subnets.end(), [](const Subnet &subnet)
+                           { return subnet.next > subnet.last; });
+    }
+
+    // Sends the probes the rate allows by now, a batch per subnet in turn, then waits for the next tick
+    void sendDue()
+    {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start);
+        const uint64_t due = m_rate * elapsed.count() / 1000000 + 1;
+
+        while (!swept() && m_sent < due)
+        {
+            m_turn = (m_turn + 1) % m_subnets.size();
+            Subnet &subnet = m_subnets[m_turn];
+
+            if (subnet.next > subnet.last)
+                continue;
+
+            if (sendBatch(subnet, static_cast<size_t>(std::min<uint64_t>(due - m_sent, c_sweep_batch))) == 0)
+                break;
+        }
+
+        if (swept())
+        {
+            DBG_LOG("[DISCOVERY] swept ", m_sent, " hosts of ", m_subnets.size(), " subnets");
+            return;
+        }
+
+        m_pacer.expires_after(c_sweep_tick);
+        m_pacer.async_wait([this](const boost::system::error_code &ec)
+                           {
+                               if (!ec && !m_done)
+                                   sendDue();
+                           });
+    }
+
+    // Number of hosts passed, 0 when the socket buffer is full
+    size_t sendBatch(Subnet &subnet, const size_t count)
+    {
+        std::array<uint32_t, c_sweep_batch> hosts;
+        size_t n = 0;
+
+        for (uint64_t host = subnet.next; n < count && host <= subnet.last; ++host)
+        {
+            if (std::find(m_locals.begin(), m_locals.end(), host) == m_locals.end())
+                hosts[n++] = static_cast<uint32_t>(host);
+        }
+
+        // Only addresses of this host were left
+        if (n == 0)
+        {
+            const uint64_t passed = subnet.last + 1 - subnet.next;
+            subnet.next = subnet.last + 1;
+            m_sent += passed;
+
+            return static_cast<size_t>(passed);
+        }
+
+#if defined(__linux__)
+        std::array<sockaddr_in, c_sweep_batch> addresses{};
+        std::array<mmsghdr, c_sweep_batch> messages{};
+        iovec phrase{const_cast<char *>(c_discovery_phrase), sizeof(c_discovery_phrase) - 1};
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            addresses[i].sin_family = AF_INET;
+            addresses[i].sin_port = htons(m_port);
+            addresses[i].sin_addr.s_addr = htonl(hosts[i]);
+
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            messages[i].msg_hdr.msg_iov = &phrase;
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sent = ::sendmmsg(m_socket.native_handle(), messages.data(), static_cast<unsigned>(n), 0);
+
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                return 0;
+
+            // A host the kernel refuses to reach must not stall the sweep
+            DBG_LOG("[DISCOVERY] probe to ", boost::asio::ip::address_v4(hosts[0]).to_string(), " failed : ", std::strerror(errno));
+            sent = 1;
+        }
+#else
+        size_t sent = 0;
+
+        for (; sent < n; ++sent)
+        {
+            boost::system::error_code ec;
+            const boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::address_v4(hosts[sent]), m_port);
+            m_socket.send_to(boost::asio::buffer(c_discovery_phrase, sizeof(c_discovery_phrase) - 1), endpoint, 0, ec);
+
+            if (ec == boost::asio::error::would_block)
+                break;
+        }
+
+        if (sent == 0)
+            return 0;
+#endif
+
+        const uint64_t passed = hosts[sent - 1] + uint64_t{1} - subnet.next;
+        subnet.next += passed;
+        m_sent += passed;
+
+        return static_cast<size_t>(passed);
+    }
+
+  private:
+    boost::asio::ip::udp::socket m_socket;
+    boost::asio::steady_timer m_pacer;
+    boost::asio::steady_timer m_deadline;
+    const UnicastSweepOptions m_options;
+    const uint16_t m_port;
+    std::vector<Subnet> m_subnets;
+    std::vector<uint32_t> m_locals; // addresses of this host, never probed
+    uint64_t m_rate = 0;            // probes per second
+    size_t m_turn = 0;
+    uint64_t m_sent = 0;
+    bool m_done = false;
+    std::chrono::steady_clock::time_point m_start;
+    std::array<char, 1024> m_buffer;
+    boost::asio::ip::udp::endpoint m_sender;
+    std::vector<DiscoveredServer> m_servers;
+    std::function<void()> m_on_finish;
+};
+} // namespace
+
+std::vector<DiscoveredServer> discoverServersByUnicastSweep(
+    boost::asio::io_context &context,
+    uint16_t discovery_port,
+    const UnicastSweepOptions &options)
+{
+    const std::vector<LocalInterface> interfaces = getLocalInterfaces();
+
+    if (interfaces.empty())
+    {
+        DBG_LOG("[DISCOVERY] no local interfaces to sweep");
+        return {};
+    }
+
+    for ([[maybe_unused]] const LocalInterface &ifc : interfaces)
+        DBG_LOG("[DISCOVERY] ", ifc.name, " ", ifc.address.to_string(), ", hosts ", ifc.range.first_host.to_string(), " - ", ifc.range.last_host.to_string());
+
+    UnicastSweep sweep(context, interfaces, discovery_port, options);
+
+    if (!sweep.start())
+        return {};
+
+    // Returns once the sweep closed its socket and timers
+    context.restart();
+    context.run();
+    context.restart();
+
+    if (sweep.servers().empty())
+        DBG_LOG("[DISCOVERY] no servers found via unicast scan.");
+
+    return sweep.servers();
+}
+
+namespace
+{
+// Collects the beacons on the group until the window is over. Once one is heard, only until it listened for
+// c_beacon_window, every server that beacons has been heard by then
+class BeaconListener
+{
+  public:
+    BeaconListener(boost::asio::io_context &context, const std::chrono::milliseconds window)
+        : m_socket{context}, m_timer{context}, m_window{window}
+    {
+    }
+
+    bool start()
+    {
+        using boost::asio::ip::udp;
+        namespace multicast = boost::asio::ip::multicast;
+
+        const auto group = boost::asio::ip::make_address_v4(Common::c_beacon_group);
         boost::system::error_code ec;
-        size_t bytes = sock.receive_from(boost::asio::buffer(buffer),
-                                         sender_endpoint, 0, ec);
 
-        if (!ec && ec != boost::asio::error::would_block)
-            DBG_LOG("[DISCOVERY] error : ", ec.message());
+        // Other clients on this host listen to the same port
+        std::ignore = m_socket.open(udp::v4(), ec);
 
-        if (!ec && bytes > 0)
+        if (!ec)
+            std::ignore = m_socket.set_option(boost::asio::socket_base::reuse_address(true), ec);
+
+        if (!ec)
+            std::ignore = m_socket.bind(udp::endpoint(udp::v4(), Common::c_beacon_port), ec);
+
+        if (ec)
         {
-            DBG_LOG("[DISCOVERY] response, no error");
-            std::string_view data(buffer.data(), bytes);
+            DBG_LOG("[DISCOVERY] beacon socket error : ", ec.message());
+            return false;
+        }
 
-            if (data.rfind(c_response_phrase, 0) == 0)
-            {
-                auto slash = data.find('/');
-                uint16_t port = 0;
-                if (slash != std::string_view::npos)
-                    port = static_cast<uint16_t>(
-                        std::stoi(std::string(data.substr(slash + 1))));
+        // On every interface, beacons may come from any of the networks
+        size_t joined = 0;
+
+        for (const LocalInterface &ifc : getLocalInterfaces())
+        {
+            std::ignore = m_socket.set_option(multicast::join_group(group, ifc.address), ec);
 
-                DiscoveredServer result;
-                result.address = sender_endpoint.address().to_string();
-                result.port = port;
+            if (!ec)
+                ++joined;
+        }
 
-                DBG_LOG("[DISCOVERY] found server at ", result.address, ":", result.port);
+        if (joined == 0)
+        {
+            std::ignore = m_socket.set_option(multicast::join_group(group), ec);
 
-                return result;
+            if (ec)
+            {
+                DBG_LOG("[DISCOVERY] failed to join the beacon group : ", ec.message());
+                return false;
             }
         }
 
-        if (std::chrono::steady_clock::now() - start > timeout)
-            break;
+        m_start = std::chrono::steady_clock::now();
+        endAt(m_start + m_window);
+        receive();
 
-        std::this_thread::sleep_for(polling_delay);
+        return true;
     }
 
-    DBG_LOG("[DISCOVERY] no servers found via unicast scan.");
-    return std::nullopt;
+    const std::vector<DiscoveredServer> &servers() const
+    {
+        return m_servers;
+    }
+
+    // Called once the listener is over, whether it ended by itself or by finish()
+    void onFinish(std::function<void()> callback)
+    {
+        m_on_finish = std::move(callback);
+    }
+
+    void finish()
+    {
+        if (m_done)
+            return;
+
+        m_done = true;
+
+        boost::system::error_code ec;
+        m_timer.cancel();
+        std::ignore = m_socket.close(ec);
+
+        if (m_on_finish)
+            m_on_finish();
+    }
+
+  private:
+    void receive()
+    {
+        m_socket.async_receive_from(boost::asio::buffer(m_buffer), m_sender,
+                                    [this](const boost::system::error_code &ec, size_t bytes)
+                                    {
+                                        if (m_done)
+                                            return;
+
+                                        if (ec)
+                                        {
+                                            DBG_LOG("[DISCOVERY] beacon error : ", ec.message());
+                                        }
+                                        else if (auto beacon = Common::parse_beacon(std::string_view(m_buffer.data(), bytes)))
+                                        {
+                                            if (addServer(m_servers, DiscoveredServer{m_sender.address().to_string(), beacon->port, beacon->load}) && m_servers.size() == 1)
+                                                endAt(std::min(m_timer.expiry(), std::max(std::chrono::steady_clock::now(), m_start + Common::c_beacon_window)));
+                                        }
+
+                                        receive();
+                                    });
+    }
+
+    void endAt(const std::chrono::steady_clock::time_point end)
+    {
+        m_timer.expires_at(end);
+        m_timer.async_wait([this](const boost::system::error_code &ec)
+                           {
+                               if (!ec)
+                                   finish();
+                           });
+    }
+
+  private:
+    boost::asio::ip::udp::socket m_socket;
+    boost::asio::steady_timer m_timer;
+    const std::chrono::milliseconds m_window;
+    std::chrono::steady_clock::time_point m_start;
+    bool m_done = false;
+    std::array<char, 1024> m_buffer;
+    boost::asio::ip::udp::endpoint m_sender;
+    std::vector<DiscoveredServer> m_servers;
+    std::function<void()> m_on_finish;
+};
+} // namespace
+
+std::vector<DiscoveredServer> discoverServers(boost::asio::io_context &context, uint16_t discovery_port, const UnicastSweepOptions &options)
+{
+    const std::vector<LocalInterface> interfaces = getLocalInterfaces();
+
+    BeaconListener listener(context, options.deadline);
+    UnicastSweep sweep(context, interfaces, discovery_port, options);
+
+    // Each ends early only once it heard of a server, the first one over ends the other
+    listener.onFinish([&sweep]()
+                      { sweep.finish(); });
+    sweep.onFinish([&listener]()
+                   { listener.finish(); });
+
+    const bool listening = listener.start();
+    const bool sweeping = !interfaces.empty() && sweep.start();
+
+    if (!listening && !sweeping)
+        return {};
+
+    context.restart();
+    context.run();
+    context.restart();
+
+    std::vector<DiscoveredServer> servers = listener.servers();
+
+    for (const DiscoveredServer &server : sweep.servers())
+    {
+        auto same = [&server](const DiscoveredServer &known)
+        { return known.address == server.address && known.port == server.port; };
+
+        if (std::none_of(servers.begin(), servers.end(), same))
+            servers.push_back(server);
+    }
+
+    if (servers.empty())
+        DBG_LOG("[DISCOVERY] no servers found by beacons or the sweep.");
+
+    return servers;
+}
+
+std::vector<DiscoveredServer> discoverServersByBeacon(boost::asio::io_context &context, std::chrono::milliseconds window)
+{
+    BeaconListener listener(context, window);
+
+    if (!listener.start())
+        return {};
+
+    context.restart();
+    context.run();
+    context.restart();
+
+    return listener.servers();
+}
+
+std::optional<DiscoveredServer> pickLeastLoaded(const std::vector<DiscoveredServer> &servers)
+{
+    auto it = std::min_element(servers.begin(), servers.end(), [](const DiscoveredServer &lhs, const DiscoveredServer &rhs)
+                               { return Common::less_loaded(lhs.load, rhs.load); });
+
+    if (it == servers.end())
+        return std::nullopt;
+
+    return *it;
 }
 
 std::optional<DiscoveredServer> discoverServerByBroadcast(boost::asio::io_context &context,
@@ -146,9 +591,6 @@ std::optional<DiscoveredServer> discoverServerByBroadcast(boost::asio::io_contex
 {
     using boost::asio::ip::udp;
 
-    static constexpr char c_discovery_phrase[] = "pingpong_discover_v1";
-    static constexpr char c_response_phrase[] = "pingpong_server_v1";
-
     udp::socket socket(context);
     socket.open(udp::v4());
     socket.set_option(boost::asio::socket_base::reuse_address(true));
@@ -176,21 +618,13 @@ std::optional<DiscoveredServer> discoverServerByBroadcast(boost::asio::io_contex
 
         if (!ec && bytes > 0)
         {
-            std::string_view data(buffer.data(), bytes);
-            // Expect "pingpong_server_v1/60010"
-            if (data.rfind(c_response_phrase, 0) == 0)
+            // Expect "pingpong_server_v1/60010/<load>"
+            if (auto response = Common::parse_response(std::string_view(buffer.data(), bytes)))
             {
-                auto separator = data.find('/');
-                uint16_t port = 0;
-
-                if (separator != std::string_view::npos)
-                {
-                    port = static_cast<uint16_t>(std::stoi(std::string(data.substr(separator + 1))));
-                }
-
                 DiscoveredServer res;
                 res.address = sender_endpoint.address().to_string();
-                res.port = port;
+                res.port = response->port;
+                res.load = response->load;
 
                 DBG_LOG("Found DiscoveredServer: address = ", res.address, ", port = ", res.port);
                 return res;
@@ -4,6 +4,9 @@
 
 #include <chrono>
 #include <optional>
+#include <vector>
+
+#include <ppcommon/discovery.hpp>
 
 namespace PingPong
 {
@@ -11,13 +14,39 @@ struct DiscoveredServer
 {
     std::string address;
     uint16_t port;
+    Common::ServerLoad load; // zero for servers that do not report it
+};
+
+struct UnicastSweepOptions
+{
+    std::chrono::milliseconds deadline{2000};
+    // The pace is raised above the minimum so that every subnet is probed before the deadline, up to the maximum
+    uint32_t probes_per_second = 20000;
+    uint32_t max_probes_per_second = 100000;
+    // Replies are collected this long after the first one, or until the deadline without it
+    std::optional<std::chrono::milliseconds> gather = Common::c_discovery_gather_window;
 };
 
-std::optional<DiscoveredServer> discoverServerByUnicastBruteforce(
+// Probes every other host of the local subnet at the given rate, in batches, while listening for replies.
+// Runs `context` until it is done, the context must not have other work and can be run again afterwards
+std::vector<DiscoveredServer> discoverServersByUnicastSweep(
     boost::asio::io_context &context,
     uint16_t discovery_port,
-    std::chrono::milliseconds timeout,
-    std::chrono::milliseconds polling_delay);
+    const UnicastSweepOptions &options);
+
+// Listens for the multicast beacons of servers while the sweep runs, on the same context. Once a beacon is heard,
+// listening ends after c_beacon_window and ends the sweep. A sweep that is over first ends the listening
+std::vector<DiscoveredServer> discoverServers(
+    boost::asio::io_context &context,
+    uint16_t discovery_port,
+    const UnicastSweepOptions &options);
+
+// Listens for the multicast beacons of servers within the window, once one is heard only until c_beacon_window is over
+std::vector<DiscoveredServer> discoverServersByBeacon(
+    boost::asio::io_context &context,
+    std::chrono::milliseconds window);
+
+std::optional<DiscoveredServer> pickLeastLoaded(const std::vector<DiscoveredServer> &servers);
 
 std::optional<DiscoveredServer> discoverServerByBroadcast(
     boost::asio::io_context &context,
@@ -1,5 +1,6 @@
 #include <filesystem>
 #include <iostream>
+#include <string>
 
 #include <boost/program_options.hpp>
 
@@ -21,7 +22,10 @@ Operation readArguments(int argc, char **argv)
     desc.add_options()
         ("help", "Available options:\nsend <filepath>\nreceive <code-phrase>")
         ("send", po::value<fs::path>(), "File to send")
-        ("receive", po::value<std::string>(), "File to send");
+        ("receive", po::value<std::string>(), "File to send")
+        ("stripes", po::value<unsigned>()->default_value(1), "Parallel connections to send a file over")
+        ("compress", po::value<std::string>()->default_value("none"), "Chunk compression: none, zlib")
+        ("integrity", po::value<std::string>()->default_value("sha256"), "Chunk verification: none, crc32c, sha256");
     // clang-format on
 
     po::variables_map vm;
@@ -44,6 +48,37 @@ Operation readArguments(int argc, char **argv)
         {
             throw std::runtime_error("File doesn't exist");
         }
+
+        const unsigned stripes = vm["stripes"].as<unsigned>();
+        if (stripes == 0 || stripes > Common::c_max_stripe_count)
+        {
+            throw std::runtime_error("Number of stripes must be between 1 and " + std::to_string(Common::c_max_stripe_count));
+        }
+        op.stripe_count = static_cast<uint8_t>(stripes);
+
+        const std::string compression = vm["compress"].as<std::string>();
+        if (compression == "zlib")
+        {
+            op.compression = Common::ECompression::Zlib;
+        }
+        else if (compression != "none")
+        {
+            throw std::runtime_error("Unknown compression " + compression);
+        }
+
+        const std::string integrity = vm["integrity"].as<std::string>();
+        if (integrity == "none")
+        {
+            op.integrity = Common::EIntegrity::None;
+        }
+        else if (integrity == "crc32c")
+        {
+            op.integrity = Common::EIntegrity::Crc32c;
+        }
+        else if (integrity != "sha256")
+        {
+            throw std::runtime_error("Unknown integrity mode " + integrity);
+        }
     }
     else if (vm.count("receive"))
     {
@@ -2,6 +2,8 @@
 
 #include "ppcommon/session.hpp"
 
+#include "stripes.hpp"
+
 namespace PingPong
 {
 using namespace Common;
@@ -24,7 +26,34 @@ bool waitForConnection(FileClient &c)
     return true;
 }
 
-bool establishSession(FileClient &c, const Operation &op)
+// A directory payload is followed by its file list
+bool receiveManifest(FileClient &c, const PostMetadata &post, Manifest &out_manifest)
+{
+    if (post.payload_type == EPayloadType::File)
+    {
+        out_manifest = Manifest::forFile(post.file_data.file_size);
+        return true;
+    }
+
+    c.incoming().wait();
+
+    auto msg = c.incoming().pop_front().msg;
+    if (msg.header.id != EMessageType::Manifest)
+    {
+        std::cerr << "Server didn't send the file list\n";
+        return false;
+    }
+
+    if (!out_manifest.decode(decode<EMessageType::Manifest>(msg)) || out_manifest.totalSize() != post.file_data.file_size)
+    {
+        std::cerr << "File list is malformed\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool establishSession(FileClient &c, const Operation &op, PostMetadata &out_post, Manifest &out_manifest)
 {
     {
         PreMetadata pre;
@@ -53,8 +82,15 @@ bool establishSession(FileClient &c, const Operation &op)
         }
         else if (msg.header.id == EMessageType::Accept)
         {
-            PostMetadata response = decode<EMessageType::Accept>(msg);
-            std::cout << "Do you want to accept an incoming file \"" << response.file_data.file_name << "\" of size " << response.file_data.file_size << "? [y/N]\n";
+            out_post = decode<EMessageType::Accept>(msg);
+
+            if (!receiveManifest(c, out_post, out_manifest))
+                return false;
+
+            if (out_post.payload_type == EPayloadType::Directory)
+                std::cout << "Do you want to accept an incoming directory \"" << out_post.file_data.file_name << "\" of " << out_manifest.fileCount() << " files and size " << out_post.file_data.file_size << "? [y/N]\n";
+            else
+                std::cout << "Do you want to accept an incoming file \"" << out_post.file_data.file_name << "\" of size " << out_post.file_data.file_size << "? [y/N]\n";
             break;
         }
     }
@@ -62,23 +98,119 @@ bool establishSession(FileClient &c, const Operation &op)
     return true;
 }
 
-bool startSession(FileClient &c, const Operation &op)
+// A file already at the output that isn't a partial transfer is kept aside as the older copy for delta sync.
+// Returns its signatures and sets resume.basis_size when there is one
+SignatureData signBasis(const std::filesystem::path &outfile, const std::filesystem::path &basis, const ResumeJournal &journal, ResumeData &resume)
+{
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+
+    if (!fs::exists(basis, ec) && !fs::exists(journal.path(), ec) && fs::is_regular_file(outfile, ec))
+        fs::rename(outfile, basis, ec);
+
+    const uint64_t size = fs::is_regular_file(basis, ec) ? fs::file_size(basis, ec) : 0;
+
+    if (ec || size == 0)
+        return SignatureData{};
+
+    const Manifest manifest = Manifest::forFile(size);
+    PayloadReader reader(basis, manifest);
+    SignatureData res;
+
+    try
+    {
+        res = sign_basis(reader, size);
+    }
+    catch (const std::exception &e)
+    {
+        DBG_LOG("Failed to sign the older copy: ", e.what());
+        return SignatureData{};
+    }
+
+    if (res.count > 0)
+    {
+        resume.basis_size = size;
+        std::cout << "Found an older copy of " << size << " bytes, only the differences will be sent\n";
+    }
+
+    return res;
+}
+
+// The server confirms the transfer before any stripe may join it
+bool waitForTransmission(FileClient &c)
+{
+    c.incoming().wait();
+
+    auto msg = c.incoming().pop_front().msg;
+    if (msg.header.id != EMessageType::Accept)
+    {
+        std::cerr << "Server aborted file receival\n";
+        return false;
+    }
+
+    return true;
+}
+
+bool startSession(FileClient &c, const Operation &op, const PostMetadata &post, const Manifest &manifest)
 {
+    if (post.merkle.block_size == 0 || post.merkle.block_size > c_merkle_max_block_size)
     {
-        CodePhrase code_phrase;
-        code_phrase.code = op.receival_code_phrase;
-        code_phrase.code_size = code_phrase.code.size();
+        std::cerr << "Invalid Merkle block size " << post.merkle.block_size << "\n";
+        return false;
+    }
+
+    MerkleVerifier verifier(post.merkle.root, post.merkle.block_size, manifest.totalSize());
+
+    std::filesystem::path outfile{"./out"};
+    const std::filesystem::path basis{outfile.string() + ".ppbasis"};
+    ResumeJournal journal(outfile);
+    PayloadReader partial(outfile, manifest);
+    ResumeData resume;
+
+    {
+        ReceiveRequest request;
+        request.code_phrase.code = op.receival_code_phrase;
+        request.code_phrase.code_size = request.code_phrase.code.size();
+        request.resume = journal.probe(partial);
+
+        if (request.resume.offset > 0)
+            std::cout << "Found a partial file, trying to resume from " << request.resume.offset << " bytes\n";
+
+        SignatureData signatures;
+        if (post.payload_type == EPayloadType::File)
+            signatures = signBasis(outfile, basis, journal, request.resume);
 
-        Message receive_msg = encode<EMessageType::Receive>(code_phrase);
+        resume = request.resume;
+
+        Message receive_msg = encode<EMessageType::Receive>(request);
         DBG_LOG(receive_msg);
         c.send(std::move(receive_msg));
+
+        if (request.resume.basis_size > 0)
+            c.send(encode<EMessageType::Signatures>(signatures));
     }
 
-    std::filesystem::path outfile{"./out"};
+    if (!waitForTransmission(c))
+        return false;
 
-    ClientReceiverSession session(EPayloadType::File,
+    StripeClients stripes;
+
+    if (!connectStripes(c, op.receival_code_phrase, post.stripe_count, EMessageType::ReceiveStripe, stripes))
+        return false;
+
+    ClientReceiverSession session(post.payload_type,
                                   c.incoming(),
                                   outfile,
+                                  manifest,
+                                  journal,
+                                  verifier,
+                                  basis,
+                                  resume.basis_size,
+                                  post.integrity,
+                                  post.compression,
+                                  post.stripe_count,
+                                  post.max_chunk_size,
                                   [&c](Message &&msg)
                                   { c.send(std::move(msg)); });
 
@@ -86,6 +218,8 @@ bool startSession(FileClient &c, const Operation &op)
 
     if (!res)
         std::cerr << "Receiving routine has failed\n";
+    else
+        std::filesystem::remove(basis);
 
     return res;
 }
@@ -100,7 +234,10 @@ bool receiveRoutine(const Operation &op)
     if (!waitForConnection(c))
         return false;
 
-    if (!establishSession(c, op))
+    PostMetadata post;
+    Manifest manifest;
+
+    if (!establishSession(c, op, post, manifest))
         return false;
 
     char ans = 'n';
@@ -110,7 +247,7 @@ bool receiveRoutine(const Operation &op)
     if (!(ans == 'y' || ans == 'Y'))
         return true;
 
-    if (!startSession(c, op))
+    if (!startSession(c, op, post, manifest))
         return false;
 
     // Signal about the successful end of transmission
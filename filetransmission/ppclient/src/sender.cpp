@@ -1,10 +1,17 @@
 #include "sender.hpp"
 
 #include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+
+#include <openssl/rand.h>
 
 #include "ppcommon/session.hpp"
 #include "ppgenerator/phrase_generator.hpp"
 
+#include "stripes.hpp"
+
 namespace PingPong
 {
 
@@ -28,20 +35,56 @@ bool waitForConnection(FileClient &c)
     return true;
 }
 
-bool establishSession(FileClient &c, const Operation &op, uint64_t &out_chunksize)
+bool buildManifest(const Operation &op, Manifest &out_manifest, MerkleTree &out_tree)
 {
     try
     {
+        if (fs::is_directory(op.filepath))
+            out_manifest = Manifest::scanDirectory(op.filepath);
+        else
+            out_manifest = Manifest::forFile(fs::file_size(op.filepath));
+
+        // The whole payload is read once up front, the root goes into the metadata.
+        // Cheaper integrity modes go without a tree
+        if (op.integrity == EIntegrity::Sha256)
+        {
+            PayloadReader reader(op.filepath, out_manifest);
+            out_tree = MerkleTree::build(reader, out_manifest.totalSize(), c_merkle_block_size);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Caught the exception: " << e.what();
+        return false;
+    }
+
+    DBG_LOG("Payload of ", out_manifest.fileCount(), " files, ", out_manifest.totalSize(), " bytes");
+    return true;
+}
+
+bool establishSession(FileClient &c, const Operation &op, const Manifest &manifest, const MerkleTree &tree, PostMetadata &out_post)
+{
+    {
+        const EPayloadType payload_type = manifest.isSingleFile() ? EPayloadType::File : EPayloadType::Directory;
+
         PreMetadata pre;
         {
-            pre.payload_type = EPayloadType::File;
+            pre.payload_type = payload_type;
 
             pre.code_phrase.code = getRandomPhrase();
             pre.code_phrase.code_size = pre.code_phrase.code.size();
 
-            pre.file_data.file_name = op.filepath.filename();
+            // "dir/" has an empty filename
+            fs::path name = op.filepath.filename().empty() ? op.filepath.parent_path().filename() : op.filepath.filename();
+            pre.file_data.file_name = name.string().substr(0, std::numeric_limits<uint8_t>::max());
             pre.file_data.file_name_size = pre.file_data.file_name.size();
-            pre.file_data.file_size = fs::file_size(op.filepath);
+            pre.file_data.file_size = manifest.totalSize();
+
+            pre.stripe_count = op.stripe_count;
+            pre.compression = op.compression;
+            pre.integrity = op.integrity;
+            pre.merkle.root = tree.root();
+            pre.merkle.block_size = tree.blockSize();
         }
         Message send_msg = encode<EMessageType::Send>(pre);
 
@@ -49,11 +92,15 @@ bool establishSession(FileClient &c, const Operation &op, uint64_t &out_chunksiz
 
         if (!c.send(std::move(send_msg)))
             return false;
-    }
-    catch (const fs::filesystem_error &e)
-    {
-        std::cerr << "Caught the exception: " << e.what();
-        return false;
+
+        // The server keeps the file list until a receiver asks for it
+        if (payload_type == EPayloadType::Directory)
+        {
+            Message manifest_msg = encode<EMessageType::Manifest>(manifest.encode());
+
+            if (!c.send(std::move(manifest_msg)))
+                return false;
+        }
     }
 
     c.incoming().wait();
@@ -68,9 +115,8 @@ bool establishSession(FileClient &c, const Operation &op, uint64_t &out_chunksiz
         }
         else if (msg.header.id == EMessageType::Accept)
         {
-            PostMetadata post_metadata = decode<EMessageType::Accept>(msg);
-            out_chunksize = post_metadata.max_chunk_size;
-            DBG_LOG("Server accepted sending a file with max chunksize of ", out_chunksize, " bytes");
+            out_post = decode<EMessageType::Accept>(msg);
+            DBG_LOG("Server accepted sending a file with max chunksize of ", out_post.max_chunk_size, " bytes, resume offset ", out_post.resume.offset);
             break;
         }
     }
@@ -78,22 +124,177 @@ bool establishSession(FileClient &c, const Operation &op, uint64_t &out_chunksiz
     return true;
 }
 
-bool startSession(FileClient &c, const Operation &op, const uint64_t chunksize)
+// A receiver with an older copy of the file follows its request with the copy's signatures
+bool buildDelta(FileClient &c, const Operation &op, const Manifest &manifest, const PostMetadata &post, DeltaPlan &out_delta)
 {
-    ClientSenderSession session(EPayloadType::File, c.incoming(), op.filepath, chunksize, [&c](Message &&msg)
-                                { return c.send(std::move(msg)); });
+    if (post.resume.basis_size == 0)
+        return true;
 
-    bool res = session.mainLoop();
-    if (!res)
+    c.incoming().wait();
+
+    auto msg = c.incoming().pop_front().msg;
+    if (msg.header.id != EMessageType::Signatures)
     {
-        std::cerr << "Sending routine has failed\n";
+        std::cerr << "Server didn't pass the receiver's signatures\n";
+        return false;
+    }
+
+    // Directories are always sent in full
+    if (!manifest.isSingleFile())
+        return true;
+
+    try
+    {
+        PayloadReader reader(op.filepath, manifest);
+        out_delta = DeltaPlan::build(reader, manifest.totalSize(), decode<EMessageType::Signatures>(msg), post.resume.basis_size);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Caught the exception: " << e.what();
+        return false;
+    }
+
+    if (!out_delta.empty())
+        std::cout << "Receiver has an older copy, " << out_delta.copiedSize() << " of " << manifest.totalSize() << " bytes are taken from it\n";
+
+    return true;
+}
+
+// $XDG_CACHE_HOME/pingpong/owner, ~/.cache/pingpong/owner without it
+fs::path cacheOwnerPath()
+{
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return fs::path(xdg) / "pingpong" / "owner";
+
+    if (const char *home = std::getenv("HOME"); home && *home)
+        return fs::path(home) / ".cache" / "pingpong" / "owner";
+
+    return {};
+}
+
+// Secret the server caches this user's blocks under. Made on first use and kept private, without a place to keep
+// it every run has a new one and finds nothing cached
+bool loadCacheOwner(Hash &out_owner)
+{
+    const fs::path file = cacheOwnerPath();
+
+    if (!file.empty())
+    {
+        std::ifstream ifs(file, std::ios::binary);
+
+        if (ifs.read(reinterpret_cast<char *>(out_owner.data()), out_owner.size()))
+            return true;
+    }
+
+    if (RAND_bytes(out_owner.data(), static_cast<int>(out_owner.size())) != 1)
+    {
+        std::cerr << "Failed to make a cache owner secret\n";
         return false;
     }
 
+    if (file.empty())
+        return true;
+
+    std::error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+
+    {
+        std::ofstream ofs(file, std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char *>(out_owner.data()), out_owner.size());
+    }
+
+    fs::permissions(file, fs::perms::owner_read | fs::perms::owner_write, ec);
     return true;
 }
 
-bool waitForConfirmation(FileClient &c)
+// Blocks the server's chunk cache already holds are not uploaded again. Only payloads with a tree have leaves to ask by
+bool queryCache(FileClient &c, const MerkleTree &tree, const PostMetadata &post, std::vector<bool> &out_cached)
+{
+    if (post.integrity != EIntegrity::Sha256)
+        return true;
+
+    Hash owner;
+
+    if (!loadCacheOwner(owner))
+        return false;
+
+    out_cached.assign(tree.blockCount(), false);
+    uint64_t cached = 0;
+
+    for (uint64_t first = 0; first < tree.blockCount(); first += c_cache_query_blocks)
+    {
+        const uint64_t count = std::min(c_cache_query_blocks, tree.blockCount() - first);
+
+        CacheQueryData query;
+        query.first_block = first;
+        query.owner = owner;
+
+        for (uint64_t block = first; block < first + count; ++block)
+            query.leaves.insert(query.leaves.end(), tree.leaf(block).begin(), tree.leaf(block).end());
+
+        if (!c.send(encode<EMessageType::CacheQuery>(query)))
+            return false;
+
+        c.incoming().wait();
+
+        auto msg = c.incoming().pop_front().msg;
+        if (msg.header.id != EMessageType::CacheReply)
+        {
+            std::cerr << "Server didn't answer the cache query\n";
+            return false;
+        }
+
+        CacheReplyData reply = decode<EMessageType::CacheReply>(msg);
+
+        if (reply.first_block != first || reply.block_count != count || reply.bitmap.size() != (count + 7) / 8)
+        {
+            std::cerr << "Server's cache reply doesn't match the query\n";
+            return false;
+        }
+
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            if ((reply.bitmap[i / 8] >> (i % 8)) & 1)
+            {
+                out_cached[first + i] = true;
+                ++cached;
+            }
+        }
+    }
+
+    if (cached > 0)
+        std::cout << "Server has " << cached << " of " << tree.blockCount() << " blocks cached, they are not uploaded again\n";
+
+    return true;
+}
+
+// Every stripe is accepted by the server once the receiver has joined with the same stripe
+bool waitForStripes(FileClient &c, const uint8_t stripe_count)
+{
+    uint8_t accepted = 1;
+
+    while (accepted < stripe_count)
+    {
+        c.incoming().wait();
+
+        auto msg = c.incoming().pop_front().msg;
+        if (msg.header.id == EMessageType::Accept)
+        {
+            ++accepted;
+            DBG_LOG("Stripe accepted. ", static_cast<int>(accepted), "/", static_cast<int>(stripe_count));
+        }
+        else if (msg.header.id == EMessageType::Abort || msg.header.id == EMessageType::Reject)
+        {
+            std::cerr << "Server refused a stripe\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The server may still ask for blocks its cache failed to give
+bool waitForConfirmation(FileClient &c, ClientSenderSession &session)
 {
     DBG_LOG(__PRETTY_FUNCTION__, " waiting for Success message");
 
@@ -117,32 +318,86 @@ bool waitForConfirmation(FileClient &c)
                 DBG_LOG("Server confirmed file receival");
                 return true;
             }
+            else if (msg.header.id == EMessageType::Refill && !session.refill(msg))
+            {
+                std::cerr << "Failed to send cached blocks again\n";
+                return false;
+            }
+        }
+
+        // The server drops the sender of an aborted transfer
+        if (!c.isConnected() && c.incoming().empty())
+        {
+            std::cerr << "Server closed the connection\n";
+            return false;
         }
     }
 
     return false;
 }
 
+bool startSession(FileClient &c, const Operation &op, const Manifest &manifest, const MerkleTree &tree, const DeltaPlan &delta, const std::vector<bool> &cached, const PostMetadata &post)
+{
+    StripeClients stripes;
+
+    if (!connectStripes(c, post.code_phrase.code, post.stripe_count, EMessageType::SendStripe, stripes))
+        return false;
+
+    if (!waitForStripes(c, post.stripe_count))
+        return false;
+
+    ClientSenderSession session(post.payload_type, c.incoming(), op.filepath, manifest, tree, delta, cached, post.max_chunk_size, post.resume, post.stripe_count, post.compression, post.integrity, [&c, &stripes](uint8_t stripe, Message &&msg)
+                                {
+                                    FileClient &client = stripe == 0 ? c : *stripes[stripe - 1];
+                                    return client.send(std::move(msg)); });
+
+    bool res = session.mainLoop();
+    if (!res)
+    {
+        std::cerr << "Sending routine has failed\n";
+        return false;
+    }
+
+    for (auto &stripe : stripes)
+        stripe->flush();
+
+    // Stripes stay open for refills until the receiver confirmed
+    return waitForConfirmation(c, session);
+}
+
 } // namespace
 
 bool sendRoutine(const Operation &op)
 {
     DBG_LOG(__PRETTY_FUNCTION__);
 
+    Manifest manifest;
+    MerkleTree tree;
+
+    if (!buildManifest(op, manifest, tree))
+        return false;
+
     FileClient c;
 
     if (!waitForConnection(c))
         return false;
 
-    uint64_t chunksize;
+    PostMetadata post;
 
-    if (!establishSession(c, op, chunksize))
+    if (!establishSession(c, op, manifest, tree, post))
         return false;
 
-    if (!startSession(c, op, chunksize))
+    DeltaPlan delta;
+
+    if (!buildDelta(c, op, manifest, post, delta))
+        return false;
+
+    std::vector<bool> cached;
+
+    if (!queryCache(c, tree, post, cached))
         return false;
 
-    return waitForConfirmation(c);
+    return startSession(c, op, manifest, tree, delta, cached, post);
 }
 
 } // namespace PingPong
@@ -0,0 +1,48 @@
+#include "stripes.hpp"
+
+#include <chrono>
+
+namespace PingPong
+{
+
+using namespace Common;
+
+namespace
+{
+// Stripes join a server the primary connection already reached
+constexpr std::chrono::seconds c_stripe_connect_timeout{5};
+} // namespace
+
+bool connectStripes(FileClient &primary, const std::string &code, uint8_t stripe_count, EMessageType request_type, StripeClients &out_stripes)
+{
+    DBG_LOG(__PRETTY_FUNCTION__, " stripe_count = ", static_cast<int>(stripe_count));
+
+    for (uint8_t index = 1; index < stripe_count; ++index)
+    {
+        auto stripe = std::make_unique<FileClient>(primary.incoming());
+
+        if (!stripe->connectTo(primary.getAddress(), primary.getPort()) || !stripe->waitForValidation(c_stripe_connect_timeout))
+        {
+            std::cerr << "Failed to open stripe " << static_cast<int>(index) << '\n';
+            return false;
+        }
+
+        StripeRequest request;
+        request.code_phrase.code = code;
+        request.code_phrase.code_size = code.size();
+        request.stripe_index = index;
+
+        Message msg;
+        msg.header.id = request_type;
+        msg << request;
+
+        if (!stripe->send(std::move(msg)))
+            return false;
+
+        out_stripes.push_back(std::move(stripe));
+    }
+
+    return true;
+}
+
+} // namespace PingPong
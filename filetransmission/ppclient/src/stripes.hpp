@@ -0,0 +1,15 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "client.hpp"
+
+namespace PingPong
+{
+using StripeClients = std::vector<std::unique_ptr<FileClient>>;
+
+// Opens stripe_count - 1 extra connections to the server the primary client is connected to.
+// They feed the primary's incoming queue and announce themselves with a request_type message
+bool connectStripes(FileClient &primary, const std::string &code, uint8_t stripe_count, Common::EMessageType request_type, StripeClients &out_stripes);
+} // namespace PingPong
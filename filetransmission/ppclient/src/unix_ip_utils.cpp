@@ -148,6 +148,41 @@ std::optional<boost::asio::ip::address_v4> getNetmaskForIP(const boost::asio::ip
     return res;
 }
 
+std::vector<LocalInterface> getLocalInterfaces()
+{
+    struct ifaddrs *ifaddr = nullptr;
+
+    if (getifaddrs(&ifaddr) == -1)
+        return {};
+
+    std::vector<LocalInterface> res;
+
+    for (auto *ifa = ifaddr; ifa != nullptr; ifa = ifa->ifa_next)
+    {
+        if (!ifa->ifa_addr || !ifa->ifa_netmask || ifa->ifa_addr->sa_family != AF_INET)
+            continue;
+
+        if (!(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK))
+            continue;
+
+        const uint32_t addr_host = ntohl(reinterpret_cast<sockaddr_in *>(ifa->ifa_addr)->sin_addr.s_addr);
+        const uint32_t mask_host = ntohl(reinterpret_cast<sockaddr_in *>(ifa->ifa_netmask)->sin_addr.s_addr);
+
+        if (isLinkLocalIPv4(addr_host))
+            continue;
+
+        LocalInterface ifc;
+        ifc.name = ifa->ifa_name ? ifa->ifa_name : "";
+        ifc.address = address_v4(addr_host);
+        ifc.range = getSubnetRange(ifc.address, address_v4(mask_host));
+
+        res.push_back(std::move(ifc));
+    }
+
+    freeifaddrs(ifaddr);
+    return res;
+}
+
 SubnetRange getSubnetRange(boost::asio::ip::address_v4 ip,
                            boost::asio::ip::address_v4 mask)
 {
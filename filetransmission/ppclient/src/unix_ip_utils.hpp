@@ -3,6 +3,8 @@
 #include <boost/asio/ip/address_v4.hpp>
 
 #include <optional>
+#include <string>
+#include <vector>
 
 namespace PingPong
 {
@@ -15,8 +17,18 @@ struct SubnetRange
     std::uint32_t host_count; // number of usable hosts
 };
 
+struct LocalInterface
+{
+    std::string name;
+    boost::asio::ip::address_v4 address;
+    SubnetRange range;
+};
+
 std::optional<boost::asio::ip::address_v4> getLocalIPv4(std::string &out_ifc_name);
 
+// Every address of an up, non-loopback IPv4 interface except link-local ones, in the order the system lists them
+std::vector<LocalInterface> getLocalInterfaces();
+
 std::optional<boost::asio::ip::address_v4> getNetmaskForIP(const boost::asio::ip::address_v4 &ip);
 
 SubnetRange getSubnetRange(boost::asio::ip::address_v4 ip,
@@ -0,0 +1,105 @@
+// Per-chunk cost of SHA-256: a fresh context for every chunk, the way chunks used to be hashed,
+// against the reused thread-local context of sha256_chunk and the batched kernel.
+// Usage: pphash_bench [chunk size, 512] [chunks, 200000]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <ppcommon/hash.hpp>
+
+namespace
+{
+using namespace PingPong::Common;
+using Hash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+Hash sha256_fresh_context(const void *data, size_t size)
+{
+    Hash hash{};
+    unsigned int out_length = 0;
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+
+    if (!context || EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1 || EVP_DigestUpdate(context, data, size) != 1 ||
+        EVP_DigestFinal_ex(context, hash.data(), &out_length) != 1)
+        throw std::runtime_error("SHA-256 failed");
+
+    EVP_MD_CTX_free(context);
+    return hash;
+}
+
+// Keeps the digests from being optimized out
+volatile uint8_t g_sink = 0;
+
+// Nanoseconds per chunk. `hash_all` hashes every chunk once and folds the digests into its argument
+template <class F>
+double measure(const char *name, const size_t chunks, F &&hash_all)
+{
+    uint8_t sink = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    hash_all(sink);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    g_sink = sink;
+
+    const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / chunks;
+    std::cout << name << ": " << ns << " ns/chunk\n";
+
+    return ns;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const size_t chunk_size = argc > 1 ? std::stoul(argv[1]) : 512;
+    const size_t chunks = argc > 2 ? std::stoul(argv[2]) : 200000;
+
+    // Chunks cycle through a buffer that fits in the cache, only the hashing is measured
+    const size_t distinct = 256;
+    std::vector<uint8_t> data(chunk_size * distinct);
+
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 131 + 7);
+
+    auto chunk = [&](const size_t i)
+    { return data.data() + (i % distinct) * chunk_size; };
+
+    std::cout << chunks << " chunks of " << chunk_size << " bytes\n";
+
+    const double before = measure("context per chunk", chunks, [&](uint8_t &sink)
+                                  {
+                                      for (size_t i = 0; i < chunks; ++i)
+                                          sink ^= sha256_fresh_context(chunk(i), chunk_size)[0];
+                                  });
+
+    const double after = measure("reused context   ", chunks, [&](uint8_t &sink)
+                                 {
+                                     for (size_t i = 0; i < chunks; ++i)
+                                         sink ^= sha256_chunk(chunk(i), chunk_size)[0];
+                                 });
+
+    measure("batched          ", chunks, [&](uint8_t &sink)
+            {
+                std::vector<Sha256Input> inputs(distinct);
+                std::vector<Hash> out(distinct);
+
+                for (size_t i = 0; i < distinct; ++i)
+                    inputs[i] = Sha256Input{chunk(i), chunk_size, std::nullopt};
+
+                for (size_t done = 0; done < chunks; done += distinct)
+                {
+                    const size_t count = std::min(distinct, chunks - done);
+                    sha256_batch(inputs.data(), count, out.data());
+                    sink ^= out[0][0];
+                }
+            });
+
+    std::cout << "reused context saves " << before - after << " ns/chunk\n";
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+// Body copies on the way from a sender session to the socket. A ClientSenderSession sends a file through
+// ClientBase::send to a server of this process, MessageBody::copyCount() tells how often a body was copied.
+// Usage: ppsend_bench [file size in MiB, 64] [chunk size, 16384] [port, 45123]
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <net_common/net_client.hpp>
+#include <net_common/net_server.hpp>
+#include <ppcommon/session.hpp>
+
+namespace
+{
+using namespace PingPong::Common;
+namespace fs = std::filesystem;
+
+using ConnectionPtr = std::shared_ptr<Net::Connection<EMessageType>>;
+
+// Counts what arrives, the session is done once every stripe's FinalChunk is here
+class CountingServer : public Net::ServerBase<EMessageType>
+{
+  public:
+    using Net::ServerBase<EMessageType>::ServerBase;
+
+    uint64_t chunks = 0;
+    uint64_t messages = 0;
+    bool finished = false;
+
+  protected:
+    bool onClientConnect([[maybe_unused]] ConnectionPtr client) override
+    {
+        return true;
+    }
+
+    void onMessage([[maybe_unused]] ConnectionPtr client, Message &&msg) override
+    {
+        ++messages;
+        chunks += msg.header.id == EMessageType::Chunk;
+        finished = finished || msg.header.id == EMessageType::FinalChunk;
+    }
+};
+
+// Neither zeros nor compressible, so every byte travels in a chunk
+fs::path writePayload(const uint64_t size)
+{
+    const fs::path file = fs::temp_directory_path() / "ppsend_bench.bin";
+    std::ofstream ofs(file, std::ios::binary | std::ios::trunc);
+    std::vector<uint8_t> block(1024 * 1024);
+    uint32_t state = 0x9E3779B9;
+
+    for (uint64_t written = 0; written < size; written += block.size())
+    {
+        for (uint8_t &byte : block)
+        {
+            state = state * 1664525 + 1013904223;
+            byte = static_cast<uint8_t>(state >> 24);
+        }
+
+        ofs.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(std::min<uint64_t>(block.size(), size - written)));
+    }
+
+    return file;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    using namespace std::chrono;
+
+    const uint64_t size = (argc > 1 ? std::stoull(argv[1]) : 64) * 1024 * 1024;
+    const uint64_t chunk_size = argc > 2 ? std::stoull(argv[2]) : 16384;
+    const uint16_t port = static_cast<uint16_t>(argc > 3 ? std::stoul(argv[3]) : 45123);
+
+    const fs::path file = writePayload(size);
+    const Manifest manifest = Manifest::forFile(size);
+
+    PayloadReader reader(file, manifest);
+    const MerkleTree tree = MerkleTree::build(reader, size, c_merkle_block_size);
+
+    CountingServer server(port);
+    server.start();
+
+    Net::ClientBase<EMessageType> client;
+
+    if (!client.connect("127.0.0.1", port))
+        return EXIT_FAILURE;
+
+    while (!(client.isConnected() && client.isValidated()))
+        std::this_thread::sleep_for(milliseconds(1));
+
+    // As the sender's session is built in ppclient, with one stripe and without delta or cache
+    const DeltaPlan delta;
+    const std::vector<bool> cached;
+    PingPong::ClientSenderSession session(EPayloadType::File, client.incoming(), file, manifest, tree, delta, cached, chunk_size, ResumeData{}, 1, ECompression::None, EIntegrity::Sha256, [&client](uint8_t, Message &&msg)
+                                          { return client.send(std::move(msg)); });
+
+    const uint64_t copies_before = Net::MessageBody::copyCount();
+    const auto start = steady_clock::now();
+
+    const bool sent = session.mainLoop();
+    client.flush();
+
+    while (sent && !server.finished)
+        server.update(true);
+
+    const double elapsed = duration<double>(steady_clock::now() - start).count();
+    const uint64_t copies = Net::MessageBody::copyCount() - copies_before;
+
+    client.disconnect();
+    server.stop();
+    fs::remove(file);
+
+    std::cout << size / (1024 * 1024) << " MiB in chunks of " << chunk_size << " bytes, " << size / (1024.0 * 1024.0) / elapsed << " MiB/s\n";
+    std::cout << "messages: " << server.messages << ", chunks: " << server.chunks << '\n';
+    std::cout << "body copies: " << copies << ", per chunk: " << (server.chunks ? static_cast<double>(copies) / server.chunks : 0.0) << '\n';
+
+    return sent && server.chunks > 0 && copies == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "compression.hpp"
+#include "logger/logger.hpp"
+#include "merkle.hpp"
+#include "ppcommon.hpp"
+#include "worker_pool.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Leaves a sender asks about in one CacheQuery
+constexpr uint64_t c_cache_query_blocks = 64 * 1024;
+constexpr size_t c_cache_query_header_size = sizeof(uint64_t) + SHA256_DIGEST_LENGTH;
+constexpr size_t c_max_cache_query_size = c_cache_query_header_size + c_cache_query_blocks * SHA256_DIGEST_LENGTH;
+
+// Key of a block in the chunk cache. Without the owner's secret, knowing a block's leaf finds nothing
+inline Hash cache_key(const Hash &owner, const Hash &leaf)
+{
+    std::array<uint8_t, 2 * SHA256_DIGEST_LENGTH> input;
+    std::copy(owner.begin(), owner.end(), input.begin());
+    std::copy(leaf.begin(), leaf.end(), input.begin() + owner.size());
+
+    return sha256_chunk(input.data(), input.size());
+}
+
+// Server side: whole blocks of earlier transfers, keyed by cache_key() of their sender and Merkle leaf. The key is
+// computed by the server from the data, so no sender can put a block under a wrong key.
+// Every entry is a file in the cache directory, the most recently used ones are also kept in memory.
+// Both are bounded and lose their least recently used entries first. Pinned entries stay on disk.
+// A disk limit of zero turns the cache off, it then keeps nothing and does not touch the directory.
+// Safe to use from any thread, files are read and written outside the lock
+class ChunkCache
+{
+  public:
+    ChunkCache(const std::filesystem::path &dir, const uint64_t memory_limit, const uint64_t disk_limit)
+        : m_dir{dir}, m_memory_limit{memory_limit}, m_disk_limit{disk_limit}
+    {
+        namespace fs = std::filesystem;
+
+        if (!enabled())
+            return;
+
+        std::error_code ec;
+        fs::create_directories(m_dir, ec);
+
+        // Entries of a previous run are kept, leftovers of interrupted writes are not
+        for (const fs::directory_entry &file : fs::directory_iterator(m_dir, ec))
+        {
+            Hash key;
+
+            if (!parseName(file.path().filename().string(), key))
+            {
+                fs::remove(file.path(), ec);
+                continue;
+            }
+
+            const uint64_t size = file.file_size(ec);
+
+            if (!ec)
+                insert(key, size);
+        }
+
+        DBG_LOG("[CACHE] ", m_entries.size(), " blocks, ", m_disk_used, " bytes in ", m_dir);
+        evict();
+    }
+
+    ChunkCache(const ChunkCache &) = delete;
+    ChunkCache &operator=(const ChunkCache &) = delete;
+
+    bool enabled() const
+    {
+        return m_disk_limit > 0;
+    }
+
+    void put(const Hash &key, const Buffer &data)
+    {
+        if (!enabled())
+            return;
+
+        {
+            std::scoped_lock lock(m_mutex);
+
+            if (auto it = m_entries.find(key); it != m_entries.end())
+            {
+                touch(it->second);
+                return;
+            }
+        }
+
+        // Written aside and renamed, a crash never leaves a torn entry under a valid name
+        const std::filesystem::path path = m_dir / toName(key);
+        const std::filesystem::path tmp = path.string() + ".tmp";
+
+        {
+            std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+            ofs.write(reinterpret_cast<const char *>(data.data()), data.size());
+
+            if (!ofs)
+            {
+                DBG_LOG("[CACHE] failed to write ", tmp);
+                return;
+            }
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmp, path, ec);
+
+        if (ec)
+        {
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+
+        std::scoped_lock lock(m_mutex);
+
+        if (m_entries.count(key) > 0)
+            return;
+
+        Entry &entry = insert(key, data.size());
+        keepInMemory(key, entry, std::make_shared<const Buffer>(data));
+        evict();
+    }
+
+    // Data of an entry, ready at once when it is in memory. Otherwise its file is read on the pool and checked
+    // against the leaf. Null when the entry is gone or damaged, a damaged entry is dropped
+    std::future<std::shared_ptr<const Buffer>> fetch(const Hash &key, const Hash &leaf, WorkerPool &pool)
+    {
+        std::promise<std::shared_ptr<const Buffer>> ready;
+        uint64_t size = 0;
+
+        {
+            std::scoped_lock lock(m_mutex);
+            auto it = m_entries.find(key);
+
+            if (it == m_entries.end())
+            {
+                ready.set_value(nullptr);
+                return ready.get_future();
+            }
+
+            touch(it->second);
+
+            if (it->second.data)
+            {
+                ready.set_value(it->second.data);
+                return ready.get_future();
+            }
+
+            size = it->second.size;
+        }
+
+        return pool.submit([this, key, leaf, size]()
+                           { return load(key, leaf, size); });
+    }
+
+    // False when there is no such entry
+    bool pin(const Hash &key)
+    {
+        std::scoped_lock lock(m_mutex);
+        auto it = m_entries.find(key);
+
+        if (it == m_entries.end())
+            return false;
+
+        ++it->second.pins;
+        return true;
+    }
+
+    void unpin(const Hash &key)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        if (auto it = m_entries.find(key); it != m_entries.end() && it->second.pins > 0)
+            --it->second.pins;
+
+        evict();
+    }
+
+  private:
+    struct KeyHash
+    {
+        size_t operator()(const Hash &key) const
+        {
+            size_t res;
+            std::memcpy(&res, key.data(), sizeof(res));
+            return res;
+        }
+    };
+
+    struct Entry
+    {
+        uint64_t size = 0;
+        unsigned pins = 0;
+        std::list<Hash>::iterator disk_pos;
+        std::list<Hash>::iterator memory_pos;
+        std::shared_ptr<const Buffer> data;
+    };
+
+    using Entries = std::unordered_map<Hash, Entry, KeyHash>;
+
+  private:
+    static std::string toName(const Hash &key)
+    {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string res;
+
+        for (const uint8_t byte : key)
+        {
+            res += digits[byte >> 4];
+            res += digits[byte & 0xF];
+        }
+
+        return res;
+    }
+
+    static bool parseName(const std::string &name, Hash &out_key)
+    {
+        if (name.size() != 2 * out_key.size())
+            return false;
+
+        for (size_t i = 0; i < out_key.size(); ++i)
+        {
+            const int hi = digit(name[2 * i]);
+            const int lo = digit(name[2 * i + 1]);
+
+            if (hi < 0 || lo < 0)
+                return false;
+
+            out_key[i] = static_cast<uint8_t>(hi << 4 | lo);
+        }
+
+        return true;
+    }
+
+    static int digit(const char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+
+        return -1;
+    }
+
+    std::shared_ptr<const Buffer> load(const Hash &key, const Hash &leaf, const uint64_t size)
+    {
+        auto data = std::make_shared<Buffer>(size);
+        std::ifstream ifs(m_dir / toName(key), std::ios::binary);
+        const bool valid = ifs.read(reinterpret_cast<char *>(data->data()), data->size()) && merkle_leaf(data->data(), data->size()) == leaf;
+
+        std::scoped_lock lock(m_mutex);
+        auto it = m_entries.find(key);
+
+        if (it == m_entries.end())
+            return valid ? std::move(data) : nullptr;
+
+        if (!valid)
+        {
+            DBG_LOG("[CACHE] entry ", toName(key), " is damaged");
+            erase(it);
+            return nullptr;
+        }
+
+        // Another read of the same entry may have been first
+        if (!it->second.data)
+        {
+            keepInMemory(key, it->second, std::move(data));
+            evict();
+        }
+
+        return it->second.data;
+    }
+
+    Entry &insert(const Hash &key, const uint64_t size)
+    {
+        Entry &entry = m_entries[key];
+        entry.size = size;
+        entry.disk_pos = m_disk_lru.insert(m_disk_lru.begin(), key);
+        entry.memory_pos = m_memory_lru.end();
+        m_disk_used += size;
+
+        return entry;
+    }
+
+    void erase(Entries::iterator it)
+    {
+        Entry &entry = it->second;
+
+        dropFromMemory(entry);
+        m_disk_lru.erase(entry.disk_pos);
+        m_disk_used -= entry.size;
+
+        std::error_code ec;
+        std::filesystem::remove(m_dir / toName(it->first), ec);
+
+        m_entries.erase(it);
+    }
+
+    void touch(Entry &entry)
+    {
+        m_disk_lru.splice(m_disk_lru.begin(), m_disk_lru, entry.disk_pos);
+
+        if (entry.data)
+            m_memory_lru.splice(m_memory_lru.begin(), m_memory_lru, entry.memory_pos);
+    }
+
+    void keepInMemory(const Hash &key, Entry &entry, std::shared_ptr<const Buffer> data)
+    {
+        entry.data = std::move(data);
+        entry.memory_pos = m_memory_lru.insert(m_memory_lru.begin(), key);
+        m_memory_used += entry.size;
+    }
+
+    void dropFromMemory(Entry &entry)
+    {
+        if (!entry.data)
+            return;
+
+        entry.data.reset();
+        m_memory_lru.erase(entry.memory_pos);
+        entry.memory_pos = m_memory_lru.end();
+        m_memory_used -= entry.size;
+    }
+
+    void evict()
+    {
+        while (m_memory_used > m_memory_limit)
+            dropFromMemory(m_entries.at(m_memory_lru.back()));
+
+        for (auto pos = m_disk_lru.end(); m_disk_used > m_disk_limit && pos != m_disk_lru.begin();)
+        {
+            auto it = m_entries.find(*--pos);
+
+            if (it->second.pins > 0)
+                continue;
+
+            // Erasing invalidates only the erased position
+            auto next = std::next(pos);
+            erase(it);
+            pos = next;
+        }
+    }
+
+  private:
+    const std::filesystem::path m_dir;
+    const uint64_t m_memory_limit;
+    const uint64_t m_disk_limit;
+    mutable std::mutex m_mutex;
+    Entries m_entries;
+    std::list<Hash> m_disk_lru;   // most recently used first
+    std::list<Hash> m_memory_lru; // entries with their data loaded, most recently used first
+    uint64_t m_disk_used = 0;
+    uint64_t m_memory_used = 0;
+};
+
+// Blocks of one transfer the cache promised to serve in place of the sender. Their entries are pinned until
+// the lease is gone, which is when the last session of the transfer is.
+// The owner comes with the sender's first CacheQuery, later ones have to carry the same
+class CacheLease
+{
+  public:
+    struct Block
+    {
+        Hash leaf;
+        Hash key;
+    };
+
+  public:
+    explicit CacheLease(ChunkCache &cache)
+        : m_cache{cache}
+    {
+    }
+
+    ~CacheLease()
+    {
+        for (const auto &[index, block] : m_blocks)
+            m_cache.unpin(block.key);
+    }
+
+    CacheLease(const CacheLease &) = delete;
+    CacheLease &operator=(const CacheLease &) = delete;
+
+    bool claim(const Hash &owner)
+    {
+        if (!m_owner)
+            m_owner = owner;
+
+        return *m_owner == owner;
+    }
+
+    const std::optional<Hash> &owner() const
+    {
+        return m_owner;
+    }
+
+    // False when the cache holds no such block of the owner
+    bool add(const uint64_t index, const Hash &leaf)
+    {
+        if (m_blocks.count(index) > 0)
+            return true;
+
+        const Hash key = cache_key(*m_owner, leaf);
+
+        if (!m_cache.pin(key))
+            return false;
+
+        m_blocks.emplace(index, Block{leaf, key});
+        return true;
+    }
+
+    const Block *find(const uint64_t index) const
+    {
+        auto it = m_blocks.find(index);
+        return it == m_blocks.end() ? nullptr : &it->second;
+    }
+
+  private:
+    ChunkCache &m_cache;
+    std::optional<Hash> m_owner;
+    std::unordered_map<uint64_t, Block> m_blocks;
+};
+
+// Puts the blocks one stripe relays whole into the cache, off the server thread. Chunks have to be added in the
+// order they were relayed, so all collectors share a pool of one thread.
+// A block is only kept if its chunks came in order and none were left out
+class CacheCollector
+{
+  public:
+    // Relayed bytes waiting to be collected. Chunks beyond it are left out rather than held
+    static constexpr uint64_t c_max_backlog = uint64_t{16} * 1024 * 1024;
+
+  public:
+    CacheCollector(ChunkCache &cache, const Hash &owner, const uint64_t total_size, const uint32_t max_chunk_size, const uint32_t block_size)
+        : m_cache{cache}, m_owner{owner}, m_total_size{total_size}, m_max_chunk_size{max_chunk_size}, m_block_size{block_size}
+    {
+    }
+
+    // Called on the server thread for every chunk before it is handed to add(). False leaves the chunk out
+    bool reserve(const uint64_t size)
+    {
+        if (m_backlog.fetch_add(size) + size <= c_max_backlog)
+            return true;
+
+        m_backlog -= size;
+        return false;
+    }
+
+    void add(Message &&msg)
+    {
+        const size_t size = msg.body.size();
+        collect(msg);
+        m_backlog -= size;
+    }
+
+  private:
+    void collect(Message &msg)
+    {
+        const size_t size = msg.body.size();
+
+        if (size < c_chunk_header_size)
+            return;
+
+        const ChunkData chunk = decode<EMessageType::Chunk>(msg);
+
+        if ((chunk.flags & c_chunk_crc32c) && size < c_chunk_overhead)
+            return;
+
+        uint64_t offset = chunk.offset;
+        const uint8_t *data = chunk.data.data();
+        size_t data_size = chunk.data.size();
+
+        if (chunk.flags & c_chunk_compressed)
+        {
+            if (!m_decompressor.decompress(data, data_size, m_decompressed, m_max_chunk_size))
+            {
+                m_collecting = false;
+                return;
+            }
+
+            data = m_decompressed.data();
+            data_size = m_decompressed.size();
+        }
+
+        if (offset >= m_total_size || data_size > m_total_size - offset)
+        {
+            m_collecting = false;
+            return;
+        }
+
+        while (data_size > 0)
+        {
+            const uint64_t index = offset / m_block_size;
+            const uint64_t pos = offset - index * m_block_size;
+
+            if (pos == 0)
+            {
+                m_block = index;
+                m_block_data.resize(merkle_block_length(index, m_total_size, m_block_size));
+                m_collecting = true;
+            }
+            else if (!m_collecting || index != m_block || pos != m_filled)
+            {
+                m_collecting = false;
+                return;
+            }
+
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(data_size, m_block_data.size() - pos));
+            std::copy_n(data, n, m_block_data.begin() + pos);
+
+            m_filled = pos + n;
+            offset += n;
+            data += n;
+            data_size -= n;
+
+            if (m_filled < m_block_data.size())
+                continue;
+
+            // Zero blocks are holes on the sender side, they never travel as data
+            const bool zeros = std::all_of(m_block_data.begin(), m_block_data.end(), [](uint8_t byte)
+                                           { return byte == 0; });
+
+            if (!zeros)
+                m_cache.put(cache_key(m_owner, merkle_leaf(m_block_data.data(), m_block_data.size())), m_block_data);
+
+            m_collecting = false;
+        }
+    }
+
+  private:
+    ChunkCache &m_cache;
+    const Hash m_owner;
+    const uint64_t m_total_size;
+    const uint32_t m_max_chunk_size;
+    const uint32_t m_block_size;
+    std::atomic<uint64_t> m_backlog{0};
+    ChunkDecompressor m_decompressor;
+    Buffer m_decompressed;
+    uint64_t m_block = 0;
+    uint64_t m_filled = 0;
+    bool m_collecting = false;
+    Buffer m_block_data;
+};
+
+} // namespace Common
+} // namespace PingPong
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "logger/logger.hpp"
+#include "ppcommon.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Raw deflate without the zlib header and trailer: chunks are small and carry their own hash.
+// The streams are reset per chunk instead of being reallocated
+
+class ChunkCompressor
+{
+  public:
+    explicit ChunkCompressor(const ECompression compression)
+        : m_enabled{compression == ECompression::Zlib}
+    {
+        if (m_enabled && deflateInit2(&m_stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Failed to initialize deflate");
+    }
+
+    ~ChunkCompressor()
+    {
+        if (m_enabled)
+            deflateEnd(&m_stream);
+    }
+
+    ChunkCompressor(const ChunkCompressor &) = delete;
+    ChunkCompressor &operator=(const ChunkCompressor &) = delete;
+
+    // Returns false when the chunk has to go out raw: compression is off, the chunk doesn't shrink
+    // by at least 1/8, or recent chunks didn't and compression is paused for a while
+    bool compress(const uint8_t *in, const size_t size, Buffer &out)
+    {
+        if (!m_enabled || size == 0)
+            return false;
+
+        if (m_skip > 0)
+        {
+            --m_skip;
+            return false;
+        }
+
+        // Output that doesn't fit under the limit is useless, deflate stops there
+        const size_t limit = size - size / 8;
+        out.resize(limit);
+
+        deflateReset(&m_stream);
+        m_stream.next_in = const_cast<Bytef *>(in);
+        m_stream.avail_in = static_cast<uInt>(size);
+        m_stream.next_out = out.data();
+        m_stream.avail_out = static_cast<uInt>(limit);
+
+        if (deflate(&m_stream, Z_FINISH) != Z_STREAM_END)
+        {
+            // Already compressed or encrypted data. Stop trying after a run of such chunks
+            if (++m_misses >= c_misses_before_pause)
+            {
+                DBG_LOG("[COMPRESSION] payload doesn't compress, pausing for ", c_pause_chunks, " chunks");
+                m_misses = 0;
+                m_skip = c_pause_chunks;
+            }
+
+            return false;
+        }
+
+        m_misses = 0;
+        out.resize(limit - m_stream.avail_out);
+        return true;
+    }
+
+  private:
+    static constexpr unsigned c_misses_before_pause = 8;
+    static constexpr unsigned c_pause_chunks = 256;
+
+    const bool m_enabled;
+    z_stream m_stream{};
+    unsigned m_misses = 0;
+    unsigned m_skip = 0;
+};
+
+class ChunkDecompressor
+{
+  public:
+    ChunkDecompressor()
+    {
+        if (inflateInit2(&m_stream, -MAX_WBITS) != Z_OK)
+            throw std::runtime_error("Failed to initialize inflate");
+    }
+
+    ~ChunkDecompressor()
+    {
+        inflateEnd(&m_stream);
+    }
+
+    ChunkDecompressor(const ChunkDecompressor &) = delete;
+    ChunkDecompressor &operator=(const ChunkDecompressor &) = delete;
+
+    // A chunk never inflates past max_size, anything else is a broken stream
+    bool decompress(const uint8_t *in, const size_t size, Buffer &out, const size_t max_size)
+    {
+        out.resize(max_size);
+
+        inflateReset(&m_stream);
+        m_stream.next_in = const_cast<Bytef *>(in);
+        m_stream.avail_in = static_cast<uInt>(size);
+        m_stream.next_out = out.data();
+        m_stream.avail_out = static_cast<uInt>(out.size());
+
+        if (inflate(&m_stream, Z_FINISH) != Z_STREAM_END || m_stream.avail_in != 0)
+            return false;
+
+        out.resize(max_size - m_stream.avail_out);
+        return true;
+    }
+
+  private:
+    z_stream m_stream{};
+};
+
+} // namespace Common
+} // namespace PingPong
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace PingPong
+{
+namespace Common
+{
+
+// CRC-32C (Castagnoli). Catches transmission errors, not tampering. Uses the CPU's crc32 instructions
+// when there are any: SSE4.2 is picked at runtime, ARMv8 when the compiler targets it
+
+namespace detail
+{
+using Crc32cImpl = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+constexpr std::array<uint32_t, 256> crc32c_table()
+{
+    std::array<uint32_t, 256> table{};
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+
+        table[i] = crc;
+    }
+
+    return table;
+}
+
+inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static constexpr std::array<uint32_t, 256> table = crc32c_table();
+
+    while (size-- > 0)
+        crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t size)
+{
+    uint64_t crc64 = crc;
+
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = static_cast<uint32_t>(crc64);
+
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t size)
+{
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+
+    while (size-- > 0)
+        crc = __crc32cb(crc, *data++);
+
+    return crc;
+}
+#endif
+
+inline Crc32cImpl crc32c_pick()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_hw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    return crc32c_hw;
+#endif
+
+    return crc32c_sw;
+}
+} // namespace detail
+
+inline uint32_t crc32c(const void *data, size_t size)
+{
+    static const detail::Crc32cImpl impl = detail::crc32c_pick();
+    return ~impl(~0u, static_cast<const uint8_t *>(data), size);
+}
+
+} // namespace Common
+} // namespace PingPong
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "crc32c.hpp"
+#include "hash.hpp"
+#include "logger/logger.hpp"
+#include "payload.hpp"
+#include "ppcommon.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Delta sync. The receiver cuts its older copy of the file into content-defined chunks and sends a signature
+// per chunk: its size, CRC-32C as the weak hash and SHA-256 as the strong one. The sender cuts its payload
+// the same way and sends the chunks found among the signatures as Copy ranges of the older copy.
+// Boundaries depend on the bytes around them only, so an edit changes just the chunks it touches.
+// Holes of sparse files are not chunked on either side, they are still sent as holes
+
+struct ChunkSignature
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t weak;
+    Hash strong;
+};
+
+// Average chunk of 8 KiB, grown for large files so the signatures stay around c_delta_target_chunks
+constexpr uint8_t c_delta_min_avg_bits = 13;
+constexpr uint8_t c_delta_max_avg_bits = 20;
+constexpr uint64_t c_delta_target_chunks = 64 * 1024;
+// Longer signature lists are refused
+constexpr uint32_t c_delta_max_signatures = 256 * 1024;
+constexpr size_t c_max_signatures_size = sizeof(uint8_t) + sizeof(uint32_t) + size_t{c_delta_max_signatures} * sizeof(ChunkSignature);
+
+inline uint8_t delta_avg_bits(const uint64_t basis_size)
+{
+    uint8_t bits = c_delta_min_avg_bits;
+
+    while (bits < c_delta_max_avg_bits && (basis_size >> bits) > c_delta_target_chunks)
+        ++bits;
+
+    return bits;
+}
+
+namespace detail
+{
+// Random-looking constants for the gear hash, the same on every build
+constexpr std::array<uint64_t, 256> gear_table()
+{
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+
+    for (uint64_t &entry : table)
+    {
+        // splitmix64
+        state += 0x9E3779B97F4A7C15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        entry = z ^ (z >> 31);
+    }
+
+    return table;
+}
+} // namespace detail
+
+// Gear rolling hash: each byte shifts the hash left by one, so its top bits only depend on the last 64 bytes.
+// A chunk ends where they are all zero, chunks are kept between 1/4 and 8 times the average
+class ContentChunker
+{
+  public:
+    explicit ContentChunker(const uint8_t avg_bits)
+        : m_min{size_t{1} << (avg_bits - 2)}, m_max{size_t{1} << (avg_bits + 3)}, m_shift{64u - avg_bits}
+    {
+    }
+
+    size_t maxSize() const
+    {
+        return m_max;
+    }
+
+    // Length of the chunk at the start of `data`. Less than maxSize() bytes are only passed at the end of the stream
+    size_t cut(const uint8_t *data, const size_t size) const
+    {
+        static constexpr std::array<uint64_t, 256> gear = detail::gear_table();
+
+        if (size <= m_min)
+            return size;
+
+        const size_t end = std::min(size, m_max);
+        uint64_t hash = 0;
+
+        // The window before the minimum primes the hash, a cut never depends on where the chunk started
+        for (size_t i = m_min - 64; i < end; ++i)
+        {
+            hash = (hash << 1) + gear[data[i]];
+
+            if (i + 1 >= m_min && (hash >> m_shift) == 0)
+                return i + 1;
+        }
+
+        return end;
+    }
+
+  private:
+    const size_t m_min;
+    const size_t m_max;
+    const unsigned m_shift;
+};
+
+// Calls on_chunk(offset, data, size) for every content-defined chunk of the data in [start, end) of the payload.
+// A hole ends the chunk in front of it
+template <class OnChunk>
+void for_each_content_chunk(PayloadReader &reader, const uint64_t start, const uint64_t end, const ContentChunker &chunker, OnChunk &&on_chunk)
+{
+    Buffer buf(4 * chunker.maxSize());
+    size_t begin = 0;
+    size_t filled = 0;
+    uint64_t offset = start;
+    uint64_t unread = end - start;
+    bool at_hole = false;
+
+    reader.seek(start);
+
+    while (true)
+    {
+        if (filled - begin < chunker.maxSize() && unread > 0 && !at_hole)
+        {
+            std::memmove(buf.data(), buf.data() + begin, filled - begin);
+            filled -= begin;
+            begin = 0;
+
+            const size_t want = static_cast<size_t>(std::min<uint64_t>(buf.size() - filled, unread));
+            const size_t n = reader.readData(buf.data() + filled, want);
+
+            filled += n;
+            unread -= n;
+            at_hole = n < want;
+        }
+
+        if (begin == filled)
+        {
+            if (unread == 0)
+                break;
+
+            const uint64_t hole = std::min(reader.skipHole(), unread);
+
+            if (hole == 0)
+                throw std::runtime_error("Payload is shorter than listed");
+
+            offset += hole;
+            unread -= hole;
+            at_hole = false;
+            continue;
+        }
+
+        const size_t size = chunker.cut(buf.data() + begin, filled - begin);
+        on_chunk(offset, buf.data() + begin, size);
+
+        begin += size;
+        offset += size;
+    }
+}
+
+// Receiver side: signatures of the older copy. Empty when there would be too many of them
+inline SignatureData sign_basis(PayloadReader &reader, const uint64_t basis_size)
+{
+    SignatureData res;
+    res.avg_bits = delta_avg_bits(basis_size);
+
+    const ContentChunker chunker(res.avg_bits);
+
+    for_each_content_chunk(reader, 0, basis_size, chunker, [&res](uint64_t offset, const uint8_t *data, size_t size)
+                           {
+                               const ChunkSignature signature{offset, static_cast<uint32_t>(size), crc32c(data, size), sha256_chunk(data, size)};
+                               const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&signature);
+                               res.entries.insert(res.entries.end(), bytes, bytes + sizeof(signature));
+                               ++res.count; });
+
+    if (res.count > c_delta_max_signatures)
+        return SignatureData{};
+
+    DBG_LOG("[DELTA] ", res.count, " signatures of ", basis_size, " bytes");
+    return res;
+}
+
+// Sender side: ranges of the payload the receiver's older copy already has, in payload order
+class DeltaPlan
+{
+  public:
+    struct Range
+    {
+        uint64_t offset = 0;
+        uint64_t basis_offset = 0;
+        uint64_t size = 0;
+    };
+
+  public:
+    DeltaPlan() = default;
+
+    // An invalid signature list gives an empty plan, the payload is then sent in full
+    static DeltaPlan build(PayloadReader &reader, const uint64_t total_size, const SignatureData &signatures, const uint64_t basis_size)
+    {
+        DeltaPlan res;
+
+        if (signatures.avg_bits < c_delta_min_avg_bits || signatures.avg_bits > c_delta_max_avg_bits || signatures.count > c_delta_max_signatures ||
+            signatures.entries.size() != size_t{signatures.count} * sizeof(ChunkSignature))
+        {
+            DBG_LOG("[DELTA] malformed signatures");
+            return res;
+        }
+
+        std::vector<ChunkSignature> chunks(signatures.count);
+        std::unordered_multimap<uint64_t, size_t> index;
+        uint64_t basis_offset = 0;
+
+        if (signatures.count > 0)
+            std::memcpy(chunks.data(), signatures.entries.data(), signatures.entries.size());
+
+        // Chunks are in order and inside the older copy, only holes may lie between them
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            if (chunks[i].offset < basis_offset || chunks[i].size == 0 || chunks[i].size > basis_size - chunks[i].offset)
+            {
+                DBG_LOG("[DELTA] signature ", i, " is outside of the older copy");
+                return res;
+            }
+
+            basis_offset = chunks[i].offset + chunks[i].size;
+            index.emplace(key(chunks[i].size, chunks[i].weak), i);
+        }
+
+        const ContentChunker chunker(signatures.avg_bits);
+
+        // The strong hash is only computed for chunks whose weak hash is known
+        for_each_content_chunk(reader, 0, total_size, chunker, [&](uint64_t offset, const uint8_t *data, size_t size)
+                               {
+                                   auto [it, end] = index.equal_range(key(size, crc32c(data, size)));
+                                   if (it == end)
+                                       return;
+
+                                   const Hash strong = sha256_chunk(data, size);
+
+                                   for (; it != end; ++it)
+                                   {
+                                       if (chunks[it->second].strong == strong)
+                                       {
+                                           res.add(Range{offset, chunks[it->second].offset, size});
+                                           break;
+                                       }
+                                   } });
+
+        DBG_LOG("[DELTA] ", res.m_ranges.size(), " ranges, ", res.m_copied, " of ", total_size, " bytes are in the older copy");
+        return res;
+    }
+
+    bool empty() const
+    {
+        return m_ranges.empty();
+    }
+
+    uint64_t copiedSize() const
+    {
+        return m_copied;
+    }
+
+    // Range that covers `offset`, if any
+    const Range *find(const uint64_t offset) const
+    {
+        auto it = std::upper_bound(m_ranges.begin(), m_ranges.end(), offset, [](uint64_t value, const Range &range)
+                                   { return value < range.offset; });
+
+        if (it == m_ranges.begin() || offset >= std::prev(it)->offset + std::prev(it)->size)
+            return nullptr;
+
+        return &*std::prev(it);
+    }
+
+    // Start of the first range past `offset`
+    uint64_t nextStart(const uint64_t offset) const
+    {
+        auto it = std::upper_bound(m_ranges.begin(), m_ranges.end(), offset, [](uint64_t value, const Range &range)
+                                   { return value < range.offset; });
+
+        return it == m_ranges.end() ? std::numeric_limits<uint64_t>::max() : it->offset;
+    }
+
+  private:
+    static uint64_t key(const uint64_t size, const uint32_t weak)
+    {
+        return (size << 32) | weak;
+    }
+
+    // Runs of chunks that follow each other in both files become one range
+    void add(const Range &range)
+    {
+        m_copied += range.size;
+
+        if (!m_ranges.empty())
+        {
+            Range &last = m_ranges.back();
+
+            if (last.offset + last.size == range.offset && last.basis_offset + last.size == range.basis_offset)
+            {
+                last.size += range.size;
+                return;
+            }
+        }
+
+        m_ranges.push_back(range);
+    }
+
+  private:
+    std::vector<Range> m_ranges;
+    uint64_t m_copied = 0;
+};
+
+} // namespace Common
+} // namespace PingPong
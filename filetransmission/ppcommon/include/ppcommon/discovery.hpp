@@ -0,0 +1,134 @@
+#pragma once
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace PingPong
+{
+namespace Common
+{
+
+// UDP discovery. Clients probe the discovery port and get "pingpong_server_v1/<tcp port>/<load>" back.
+// Servers also announce themselves as "pingpong_beacon_v1/<tcp port>/<load>" on a multicast group.
+// The load is "<sessions>/<queued bytes>/<io utilization>", replies of older servers end after the port
+constexpr char c_discovery_phrase[] = "pingpong_discover_v1";
+constexpr char c_response_phrase[] = "pingpong_server_v1";
+constexpr char c_beacon_phrase[] = "pingpong_beacon_v1";
+
+// Site-local group, beacons stay on the local link
+constexpr char c_beacon_group[] = "239.255.96.9";
+constexpr uint16_t c_beacon_port = 60008;
+constexpr std::chrono::milliseconds c_beacon_interval{20};
+// Listening this long, an interval and its jitter, hears every server that beacons
+constexpr std::chrono::milliseconds c_beacon_window{30};
+
+// A client picks the least loaded of the servers it heard about
+constexpr std::chrono::milliseconds c_discovery_gather_window{50};
+
+struct ServerLoad
+{
+    uint32_t sessions = 0;
+    uint64_t queued_bytes = 0;   // waiting to be written to clients
+    uint16_t io_utilization = 0; // busy time of the io thread, in 1/1000
+};
+
+// Sessions weigh most, queued bytes tell apart servers with as many of them
+inline bool less_loaded(const ServerLoad &lhs, const ServerLoad &rhs)
+{
+    if (lhs.sessions != rhs.sessions)
+        return lhs.sessions < rhs.sessions;
+
+    if (lhs.queued_bytes != rhs.queued_bytes)
+        return lhs.queued_bytes < rhs.queued_bytes;
+
+    return lhs.io_utilization < rhs.io_utilization;
+}
+
+struct ServerAnnouncement
+{
+    uint16_t port = 0;
+    ServerLoad load;
+};
+
+namespace detail
+{
+inline std::string format_announcement(const char *phrase, const ServerAnnouncement &announcement)
+{
+    return std::string(phrase) + "/" + std::to_string(announcement.port) + "/" + std::to_string(announcement.load.sessions) + "/" +
+           std::to_string(announcement.load.queued_bytes) + "/" + std::to_string(announcement.load.io_utilization);
+}
+
+// Strips "<phrase>/" off the front of `data`
+inline bool consume_phrase(std::string_view &data, const std::string_view phrase)
+{
+    if (data.size() <= phrase.size() || data.substr(0, phrase.size()) != phrase || data[phrase.size()] != '/')
+        return false;
+
+    data.remove_prefix(phrase.size() + 1);
+    return true;
+}
+
+// Parses the number up to the next '/' or the end, and strips it with its separator. Nothing may end with a '/'
+template <class T>
+bool consume_number(std::string_view &data, T &out_value)
+{
+    auto [ptr, ec] = std::from_chars(data.data(), data.data() + data.size(), out_value);
+
+    if (ec != std::errc{} || ptr == data.data())
+        return false;
+
+    data.remove_prefix(ptr - data.data());
+
+    if (!data.empty())
+    {
+        if (data.front() != '/' || data.size() == 1)
+            return false;
+
+        data.remove_prefix(1);
+    }
+
+    return true;
+}
+} // namespace detail
+
+inline std::string format_response(const ServerAnnouncement &announcement)
+{
+    return detail::format_announcement(c_response_phrase, announcement);
+}
+
+inline std::string format_beacon(const ServerAnnouncement &announcement)
+{
+    return detail::format_announcement(c_beacon_phrase, announcement);
+}
+
+// Port and, when there is one, load of a probe reply or a beacon
+inline std::optional<ServerAnnouncement> parse_announcement(std::string_view data, const std::string_view phrase)
+{
+    ServerAnnouncement res;
+
+    if (!detail::consume_phrase(data, phrase) || !detail::consume_number(data, res.port) || res.port == 0)
+        return std::nullopt;
+
+    if (!data.empty() && !(detail::consume_number(data, res.load.sessions) && detail::consume_number(data, res.load.queued_bytes) &&
+                           detail::consume_number(data, res.load.io_utilization) && data.empty()))
+        return std::nullopt;
+
+    return res;
+}
+
+inline std::optional<ServerAnnouncement> parse_response(const std::string_view data)
+{
+    return parse_announcement(data, c_response_phrase);
+}
+
+inline std::optional<ServerAnnouncement> parse_beacon(const std::string_view data)
+{
+    return parse_announcement(data, c_beacon_phrase);
+}
+
+} // namespace Common
+} // namespace PingPong
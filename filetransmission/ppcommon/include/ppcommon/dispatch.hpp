@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <type_traits>
+#include <utility>
+
+#include "ppcommon.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Message type as a type, picks the handler of a message
+template <EMessageType M>
+using MessageTag = std::integral_constant<EMessageType, M>;
+
+constexpr size_t c_message_type_count = static_cast<size_t>(EMessageType::Count);
+
+// Set of handlers, one per message type, and a (Message &) one for everything else. A handler takes either
+//   (MessageTag<M>, Message &) for the message as it came, or
+//   (MessageTag<M>, Payload<M>::Type &&) for its decoded payload.
+// All of them return the same type
+template <class... Handlers>
+struct MessageHandlers : Handlers...
+{
+    using Handlers::operator()...;
+};
+
+template <class... Handlers>
+MessageHandlers(Handlers...) -> MessageHandlers<Handlers...>;
+
+namespace detail
+{
+template <class Handlers>
+using DispatchResult = std::invoke_result_t<Handlers &, Message &>;
+
+template <class Handlers, EMessageType M>
+DispatchResult<Handlers> dispatch_one(Handlers &handlers, Message &msg)
+{
+    using Tag = MessageTag<M>;
+
+    if constexpr (std::is_invocable_v<Handlers &, Tag, Message &>)
+        return handlers(Tag{}, msg);
+    else if constexpr (std::is_invocable_v<Handlers &, Tag, typename Payload<M>::Type &&>)
+        return handlers(Tag{}, decode<M>(msg));
+    else
+        return handlers(msg);
+}
+
+template <class Handlers, size_t... Types>
+constexpr auto dispatch_table(std::index_sequence<Types...>)
+{
+    using Entry = DispatchResult<Handlers> (*)(Handlers &, Message &);
+    return std::array<Entry, sizeof...(Types)>{&dispatch_one<Handlers, static_cast<EMessageType>(Types)>...};
+}
+} // namespace detail
+
+// One indexed call per message. The table is built at compile time for every set of handlers
+template <class Handlers>
+detail::DispatchResult<Handlers> dispatch(Handlers &handlers, Message &msg)
+{
+    static constexpr auto table = detail::dispatch_table<Handlers>(std::make_index_sequence<c_message_type_count>{});
+
+    const auto index = static_cast<size_t>(msg.header.id);
+
+    if (index >= table.size())
+        return handlers(msg);
+
+    return table[index](handlers, msg);
+}
+
+} // namespace Common
+} // namespace PingPong
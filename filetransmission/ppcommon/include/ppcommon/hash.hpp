@@ -1,56 +1,98 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include <openssl/evp.h>
+#include <openssl/opensslv.h>
 #include <openssl/sha.h>
 
+#include "sha256_batch.hpp"
+
 namespace PingPong
 {
 namespace Common
 {
 
-inline std::array<uint8_t, SHA256_DIGEST_LENGTH> sha256_chunk(const void *data, size_t size)
+// The digest algorithm is looked up once per process, not on every init
+inline const EVP_MD *sha256_md()
 {
-    std::array<uint8_t, SHA256_DIGEST_LENGTH> hash{};
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static EVP_MD *md = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+    return md ? md : EVP_sha256();
+#else
+    return EVP_sha256();
+#endif
+}
 
-    EVP_MD_CTX *context = EVP_MD_CTX_new();
+// Streaming SHA-256. The context is allocated once and reinitialized after every digest
+class Sha256
+{
+  public:
+    Sha256()
+        : m_context{EVP_MD_CTX_new()}
+    {
+        if (!m_context)
+            throw std::runtime_error("EVP_MD_CTX_new() failed");
 
-    if (!context)
-        throw std::runtime_error("EVP_MD_CTX_new() failed");
+        init();
+    }
 
-    if (EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1)
+    ~Sha256()
     {
-        EVP_MD_CTX_free(context);
-        throw std::runtime_error("EVP_DigestInit_ex() failed");
+        EVP_MD_CTX_free(m_context);
     }
 
-    if (size > 0)
+    Sha256(const Sha256 &) = delete;
+    Sha256 &operator=(const Sha256 &) = delete;
+
+    void update(const void *data, size_t size)
     {
-        if (EVP_DigestUpdate(context, data, size) != 1)
-        {
-            EVP_MD_CTX_free(context);
+        if (size > 0 && EVP_DigestUpdate(m_context, data, size) != 1)
             throw std::runtime_error("EVP_DigestUpdate() failed");
-        }
     }
 
-    unsigned int out_length = 0;
+    // Returns the digest of everything fed so far and starts over
+    std::array<uint8_t, SHA256_DIGEST_LENGTH> finish()
+    {
+        std::array<uint8_t, SHA256_DIGEST_LENGTH> hash{};
+        unsigned int out_length = 0;
+
+        if (EVP_DigestFinal_ex(m_context, hash.data(), &out_length) != 1)
+            throw std::runtime_error("EVP_DigestFinal_ex() failed");
+
+        if (out_length != hash.size())
+            throw std::runtime_error("Unexpexted hash size");
+
+        init();
+
+        return hash;
+    }
 
-    if (EVP_DigestFinal_ex(context, hash.data(), &out_length) != 1)
+  private:
+    void init()
     {
-        EVP_MD_CTX_free(context);
-        throw std::runtime_error("EVP_DigestFinal_ex() failed");
+        if (EVP_DigestInit_ex(m_context, sha256_md(), nullptr) != 1)
+            throw std::runtime_error("EVP_DigestInit_ex() failed");
     }
 
-    EVP_MD_CTX_free(context);
+  private:
+    EVP_MD_CTX *m_context;
+};
 
-    if (out_length != hash.size())
-        throw std::runtime_error("Unexpexted hash size");
+inline std::array<uint8_t, SHA256_DIGEST_LENGTH> sha256_chunk(const void *data, size_t size)
+{
+    // Chunks are small, a context per call would cost more than the hashing
+    thread_local Sha256 hasher;
 
-    return hash;
+    hasher.update(data, size);
+    return hasher.finish();
 }
 
 inline std::array<uint8_t, SHA256_DIGEST_LENGTH> sha256_chunk(const std::vector<uint8_t> &buf)
@@ -58,5 +100,157 @@ inline std::array<uint8_t, SHA256_DIGEST_LENGTH> sha256_chunk(const std::vector<
     return sha256_chunk(buf.data(), buf.size());
 }
 
+// Hashes independent messages together when the CPU has a multi-buffer kernel, one by one otherwise
+inline void sha256_batch(const Sha256Input *inputs, const size_t count, std::array<uint8_t, SHA256_DIGEST_LENGTH> *out)
+{
+    static const detail::Sha256BatchKernel kernel = detail::sha256_batch_pick();
+
+    if (kernel.hash && count >= kernel.min_batch)
+    {
+        kernel.hash(inputs, count, out);
+        return;
+    }
+
+    thread_local Sha256 hasher;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (inputs[i].prefix)
+            hasher.update(&*inputs[i].prefix, 1);
+
+        hasher.update(inputs[i].data, inputs[i].size);
+        out[i] = hasher.finish();
+    }
+}
+
+// Hashes the first `size` bytes produced by `read`, which returns how many bytes it could read
+inline std::array<uint8_t, SHA256_DIGEST_LENGTH> sha256_prefix(const std::function<size_t(uint8_t *, size_t)> &read, uint64_t size)
+{
+    Sha256 hasher;
+    std::vector<uint8_t> buf(64 * 1024);
+
+    while (size > 0)
+    {
+        const size_t n = read(buf.data(), static_cast<size_t>(std::min<uint64_t>(size, buf.size())));
+
+        if (n == 0)
+            throw std::runtime_error("Data is shorter than the hashed prefix");
+
+        hasher.update(buf.data(), n);
+        size -= n;
+    }
+
+    return hasher.finish();
+}
+
+// Running digest of a whole payload: SHA-256 over (offset, size, Merkle leaf) of its blocks in stream order.
+// It is not the SHA-256 of the payload bytes. The bytes are covered only through their leaves, so it is as strong as
+// the per-block check and adds that every block arrived exactly once and in its place. The leaves are computed anyway,
+// so keeping it costs no second pass over the data.
+// Records of different stripes arrive out of order and wait until the gap closes
+class PayloadDigest
+{
+  public:
+    using Hash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+  public:
+    // A resumed transfer starts from the digest of the prefix both sides agreed on
+    PayloadDigest(const uint64_t start, const Hash &prefix_digest)
+        : m_next{start}
+    {
+        if (start > 0)
+            m_hasher.update(prefix_digest.data(), prefix_digest.size());
+    }
+
+    void add(const uint64_t offset, const uint64_t size, const Hash &hash)
+    {
+        if (offset != m_next)
+        {
+            m_pending.emplace(offset, std::make_pair(size, hash));
+            return;
+        }
+
+        feed(offset, size, hash);
+
+        for (auto it = m_pending.begin(); it != m_pending.end() && it->first == m_next; it = m_pending.erase(it))
+            feed(it->first, it->second.first, it->second.second);
+    }
+
+    // Everything up to `end` has been added and nothing is left over
+    bool isComplete(const uint64_t end) const
+    {
+        return m_next == end && m_pending.empty();
+    }
+
+    Hash finish()
+    {
+        return m_hasher.finish();
+    }
+
+  private:
+    void feed(const uint64_t offset, const uint64_t size, const Hash &hash)
+    {
+        m_hasher.update(&offset, sizeof(offset));
+        m_hasher.update(&size, sizeof(size));
+        m_hasher.update(hash.data(), hash.size());
+        m_next = offset + size;
+    }
+
+  private:
+    Sha256 m_hasher;
+    uint64_t m_next;
+    std::map<uint64_t, std::pair<uint64_t, Hash>> m_pending;
+};
+
+// Running digest of a whole payload for transfers without a Merkle tree: SHA-256 over the data bytes
+// in stream order, then the list of holes. Holes are never hashed as zeros. Everything is added in order
+class StreamDigest
+{
+  public:
+    using Hash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+  public:
+    StreamDigest(const uint64_t start, const Hash &prefix_digest)
+        : m_next{start}
+    {
+        if (start > 0)
+            m_hasher.update(prefix_digest.data(), prefix_digest.size());
+    }
+
+    // Stream offset the next data is expected at
+    uint64_t next() const
+    {
+        return m_next;
+    }
+
+    void addData(const void *data, const size_t size)
+    {
+        m_hasher.update(data, size);
+        m_next += size;
+    }
+
+    void addHole(const uint64_t size)
+    {
+        m_holes.emplace_back(m_next, size);
+        m_next += size;
+    }
+
+    Hash finish()
+    {
+        for (const auto &[offset, size] : m_holes)
+        {
+            m_hasher.update(&offset, sizeof(offset));
+            m_hasher.update(&size, sizeof(size));
+        }
+
+        return m_hasher.finish();
+    }
+
+  private:
+    Sha256 m_hasher;
+    uint64_t m_next;
+    std::vector<std::pair<uint64_t, uint64_t>> m_holes;
+};
+
 } // namespace Common
 } // namespace PingPong
@@ -0,0 +1,460 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "hash.hpp"
+#include "logger/logger.hpp"
+#include "payload.hpp"
+#include "ppcommon.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Merkle tree over fixed-size blocks of the payload stream. Only the root is sent up front,
+// every batch of blocks comes with a proof of its leaves, so blocks can be checked in any order.
+// Leaves and inner nodes are domain-separated, an odd node at the end of a level is carried up as is
+
+constexpr uint32_t c_merkle_block_size = 64 * 1024;
+// Blocks covered by one proof
+constexpr uint32_t c_merkle_batch_blocks = 16;
+// Larger blocks are refused, the receiver keeps the blocks in flight in memory
+constexpr uint32_t c_merkle_max_block_size = 16 * 1024 * 1024;
+// Domain separation of leaves and inner nodes
+constexpr uint8_t c_merkle_leaf_prefix = 0;
+constexpr uint8_t c_merkle_node_prefix = 1;
+// Largest Proof message: a full batch of leaves and two siblings per tree level
+constexpr size_t c_max_proof_size = 2 * sizeof(uint64_t) + sizeof(uint8_t) + (c_merkle_batch_blocks + 2 * 64) * SHA256_DIGEST_LENGTH;
+
+inline Hash merkle_leaf(const void *data, size_t size)
+{
+    thread_local Sha256 hasher;
+
+    hasher.update(&c_merkle_leaf_prefix, sizeof(c_merkle_leaf_prefix));
+    hasher.update(data, size);
+    return hasher.finish();
+}
+
+inline Hash merkle_node(const Hash &left, const Hash &right)
+{
+    thread_local Sha256 hasher;
+
+    hasher.update(&c_merkle_node_prefix, sizeof(c_merkle_node_prefix));
+    hasher.update(left.data(), left.size());
+    hasher.update(right.data(), right.size());
+    return hasher.finish();
+}
+
+// Parents of a run of nodes that starts at an even index. Equal pairs are hashed once, runs of hole blocks are all alike.
+// The other pairs go through sha256_batch() together
+inline std::vector<Hash> merkle_parents(const std::vector<Hash> &nodes)
+{
+    static_assert(sizeof(Hash) == SHA256_DIGEST_LENGTH, "A pair of nodes must be contiguous");
+
+    std::vector<Hash> res((nodes.size() + 1) / 2);
+    std::vector<Sha256Input> inputs;
+    std::vector<size_t> hashed;
+    std::vector<size_t> repeated;
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(nodes.data());
+    size_t prev = nodes.size();
+
+    for (size_t i = 0; i < nodes.size(); i += 2)
+    {
+        if (i + 1 == nodes.size())
+        {
+            res[i / 2] = nodes[i];
+        }
+        else if (prev < nodes.size() && nodes[prev] == nodes[i] && nodes[prev + 1] == nodes[i + 1])
+        {
+            repeated.push_back(i / 2);
+        }
+        else
+        {
+            inputs.push_back(Sha256Input{bytes + i * sizeof(Hash), 2 * sizeof(Hash), c_merkle_node_prefix});
+            hashed.push_back(i / 2);
+            prev = i;
+        }
+    }
+
+    std::vector<Hash> digests(inputs.size());
+    sha256_batch(inputs.data(), inputs.size(), digests.data());
+
+    for (size_t i = 0; i < hashed.size(); ++i)
+        res[hashed[i]] = digests[i];
+
+    // In order, a repeat may follow another repeat
+    for (const size_t index : repeated)
+        res[index] = res[index - 1];
+
+    return res;
+}
+
+inline uint64_t merkle_block_count(const uint64_t total_size, const uint32_t block_size)
+{
+    return (total_size + block_size - 1) / block_size;
+}
+
+inline uint64_t merkle_block_length(const uint64_t index, const uint64_t total_size, const uint32_t block_size)
+{
+    return std::min<uint64_t>(block_size, total_size - index * block_size);
+}
+
+// Sender side: all levels of the tree, built from the payload before the transfer
+class MerkleTree
+{
+  public:
+    MerkleTree() = default;
+
+    static MerkleTree build(PayloadReader &reader, const uint64_t total_size, const uint32_t block_size)
+    {
+        MerkleTree res;
+        res.m_total_size = total_size;
+        res.m_block_size = block_size;
+
+        const uint64_t block_count = merkle_block_count(total_size, block_size);
+        std::vector<Hash> leaves(block_count);
+        res.m_holes.resize(block_count);
+
+        const Hash zero_leaf = merkle_leaf(Buffer(block_size).data(), block_size);
+
+        // Data blocks are read a batch at a time and their leaves hashed together
+        Buffer buf(uint64_t{c_merkle_batch_blocks} * block_size);
+        std::vector<uint64_t> batch;
+        std::vector<Sha256Input> inputs;
+        std::vector<Hash> digests;
+
+        const auto hash_batch = [&]()
+        {
+            inputs.clear();
+            for (size_t k = 0; k < batch.size(); ++k)
+                inputs.push_back(Sha256Input{buf.data() + k * block_size, merkle_block_length(batch[k], total_size, block_size), c_merkle_leaf_prefix});
+
+            digests.resize(inputs.size());
+            sha256_batch(inputs.data(), inputs.size(), digests.data());
+
+            for (size_t k = 0; k < batch.size(); ++k)
+                leaves[batch[k]] = digests[k];
+
+            batch.clear();
+        };
+
+        reader.seek(0);
+        uint64_t pos = 0;
+
+        for (uint64_t i = 0; i < block_count;)
+        {
+            const uint64_t start = i * block_size;
+            const uint64_t size = merkle_block_length(i, total_size, block_size);
+
+            if (pos != start)
+                reader.seek(start);
+
+            // Blocks that lie entirely in a hole are zeros and don't have to be read
+            const uint64_t hole_end = start + reader.skipHole();
+            pos = hole_end;
+
+            if (hole_end >= start + size)
+            {
+                for (; i < block_count && (i + 1) * block_size <= hole_end; ++i)
+                {
+                    leaves[i] = zero_leaf;
+                    res.m_holes[i] = true;
+                }
+
+                // A short last block can't share the zero leaf
+                if (i + 1 == block_count && hole_end == total_size)
+                {
+                    leaves[i] = merkle_leaf(Buffer(size).data(), size);
+                    res.m_holes[i++] = true;
+                }
+
+                continue;
+            }
+
+            if (pos != start)
+                reader.seek(start);
+
+            if (reader.read(buf.data() + batch.size() * block_size, size) != size)
+                throw std::runtime_error("Payload is shorter than listed");
+
+            batch.push_back(i++);
+            pos = start + size;
+
+            if (batch.size() == c_merkle_batch_blocks)
+                hash_batch();
+        }
+
+        hash_batch();
+
+        res.m_levels.push_back(std::move(leaves));
+
+        while (res.m_levels.back().size() > 1)
+            res.m_levels.push_back(merkle_parents(res.m_levels.back()));
+
+        DBG_LOG("[MERKLE] ", block_count, " blocks, ", res.m_levels.size(), " levels");
+        return res;
+    }
+
+    Hash root() const
+    {
+        if (m_levels.empty() || m_levels.back().empty())
+            return merkle_leaf(nullptr, 0);
+
+        return m_levels.back().front();
+    }
+
+    uint32_t blockSize() const
+    {
+        return m_block_size;
+    }
+
+    uint64_t blockCount() const
+    {
+        return m_levels.empty() ? 0 : m_levels.front().size();
+    }
+
+    const Hash &leaf(const uint64_t index) const
+    {
+        return m_levels.front()[index];
+    }
+
+    // Blocks from `first` that share one proof: a run of hole blocks or up to c_merkle_batch_blocks others
+    uint64_t batchSize(const uint64_t first) const
+    {
+        uint64_t count = 1;
+
+        if (m_holes[first])
+        {
+            while (first + count < blockCount() && m_holes[first + count] && leaf(first + count) == leaf(first))
+                ++count;
+        }
+        else
+        {
+            while (count < c_merkle_batch_blocks && first + count < blockCount() && !m_holes[first + count])
+                ++count;
+        }
+
+        return count;
+    }
+
+    // Leaves of the batch followed by the siblings needed to climb from them to the root
+    ProofData prove(const uint64_t first, const uint64_t count) const
+    {
+        ProofData res;
+        res.first_block = first;
+        res.block_count = count;
+        res.flags = 0;
+
+        const bool uniform = count > 1 && std::all_of(m_levels.front().begin() + first, m_levels.front().begin() + first + count, [&](const Hash &leaf)
+                                                      { return leaf == m_levels.front()[first]; });
+
+        if (uniform)
+        {
+            res.flags |= c_proof_uniform;
+            append(res.hashes, leaf(first));
+        }
+        else
+        {
+            for (uint64_t i = first; i < first + count; ++i)
+                append(res.hashes, leaf(i));
+        }
+
+        uint64_t lo = first;
+        uint64_t hi = first + count - 1;
+
+        for (size_t level = 0; level + 1 < m_levels.size(); ++level)
+        {
+            const std::vector<Hash> &nodes = m_levels[level];
+
+            if (lo % 2 == 1)
+                append(res.hashes, nodes[lo - 1]);
+
+            if (hi % 2 == 0 && hi + 1 < nodes.size())
+                append(res.hashes, nodes[hi + 1]);
+
+            lo /= 2;
+            hi /= 2;
+        }
+
+        return res;
+    }
+
+  private:
+    static void append(Buffer &out, const Hash &hash)
+    {
+        out.insert(out.end(), hash.begin(), hash.end());
+    }
+
+  private:
+    uint64_t m_total_size = 0;
+    uint32_t m_block_size = c_merkle_block_size;
+    std::vector<std::vector<Hash>> m_levels;
+    std::vector<bool> m_holes;
+};
+
+// Receiver side: checks proofs against the root and remembers the leaves they vouch for
+class MerkleVerifier
+{
+  public:
+    MerkleVerifier(const Hash &root, const uint32_t block_size, const uint64_t total_size)
+        : m_root{root}, m_block_size{block_size}, m_total_size{total_size}, m_block_count{merkle_block_count(total_size, block_size)}
+    {
+    }
+
+    uint32_t blockSize() const
+    {
+        return m_block_size;
+    }
+
+    uint64_t blockLength(const uint64_t index) const
+    {
+        return merkle_block_length(index, m_total_size, m_block_size);
+    }
+
+    bool accept(const ProofData &proof)
+    {
+        if (proof.block_count == 0 || proof.first_block >= m_block_count || proof.block_count > m_block_count - proof.first_block)
+            return false;
+
+        if (proof.hashes.size() % SHA256_DIGEST_LENGTH != 0)
+            return false;
+
+        const bool uniform = proof.flags & c_proof_uniform;
+        const size_t leaf_count = uniform ? 1 : proof.block_count;
+        const size_t hash_count = proof.hashes.size() / SHA256_DIGEST_LENGTH;
+
+        // A batch is proven once
+        if (hash_count < leaf_count || m_batches.count(proof.first_block) > 0)
+            return false;
+
+        Batch batch{proof.block_count, uniform, {}, std::vector<bool>(proof.block_count), proof.block_count};
+        for (size_t i = 0; i < leaf_count; ++i)
+            batch.leaves.push_back(hashAt(proof.hashes, i));
+
+        std::vector<Hash> nodes = uniform ? std::vector<Hash>(proof.block_count, batch.leaves.front()) : batch.leaves;
+
+        uint64_t lo = proof.first_block;
+        uint64_t hi = proof.first_block + proof.block_count - 1;
+        uint64_t level_size = m_block_count;
+        size_t next = leaf_count;
+
+        while (level_size > 1)
+        {
+            if (lo % 2 == 1)
+            {
+                if (next == hash_count)
+                    return false;
+
+                nodes.insert(nodes.begin(), hashAt(proof.hashes, next++));
+                --lo;
+            }
+
+            if (hi % 2 == 0 && hi + 1 < level_size)
+            {
+                if (next == hash_count)
+                    return false;
+
+                nodes.push_back(hashAt(proof.hashes, next++));
+                ++hi;
+            }
+
+            nodes = merkle_parents(nodes);
+            lo /= 2;
+            hi /= 2;
+            level_size = (level_size + 1) / 2;
+        }
+
+        if (next != hash_count || nodes.size() != 1 || nodes.front() != m_root)
+            return false;
+
+        m_batches[proof.first_block] = std::move(batch);
+        return true;
+    }
+
+    // Leaf of a block whose proof has been accepted and that has not been retired yet
+    const Hash *leaf(const uint64_t index) const
+    {
+        auto it = findBatch(m_batches, index);
+        if (it == m_batches.end() || it->second.retired[index - it->first])
+            return nullptr;
+
+        return it->second.uniform ? &it->second.leaves.front() : &it->second.leaves[index - it->first];
+    }
+
+    // The block is written, its leaf is no longer needed. A batch is dropped with its last block
+    void retire(const uint64_t index)
+    {
+        auto it = findBatch(m_batches, index);
+        if (it == m_batches.end() || it->second.retired[index - it->first])
+            return;
+
+        it->second.retired[index - it->first] = true;
+
+        if (--it->second.left == 0)
+            m_batches.erase(it);
+    }
+
+    // Zero-filled block, cached for the common full size
+    const Hash &zeroLeaf(const uint64_t length)
+    {
+        if (length != m_block_size)
+        {
+            m_short_zero_leaf = merkle_leaf(Buffer(length).data(), length);
+            return m_short_zero_leaf;
+        }
+
+        if (!m_zero_leaf)
+            m_zero_leaf = merkle_leaf(Buffer(length).data(), length);
+
+        return *m_zero_leaf;
+    }
+
+  private:
+    struct Batch
+    {
+        uint64_t count = 0;
+        bool uniform = false;
+        std::vector<Hash> leaves;
+        std::vector<bool> retired;
+        uint64_t left = 0; // blocks not retired yet
+    };
+
+    using Batches = std::map<uint64_t, Batch>;
+
+    // Batch holding the block, or end(). For both constnesses of the map
+    template <class Map>
+    static auto findBatch(Map &batches, const uint64_t index) -> decltype(batches.begin())
+    {
+        auto it = batches.upper_bound(index);
+        if (it == batches.begin())
+            return batches.end();
+
+        --it;
+        return index - it->first < it->second.count ? it : batches.end();
+    }
+
+    static Hash hashAt(const Buffer &hashes, const size_t index)
+    {
+        Hash res;
+        std::copy_n(hashes.begin() + index * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, res.begin());
+        return res;
+    }
+
+  private:
+    const Hash m_root;
+    const uint32_t m_block_size;
+    const uint64_t m_total_size;
+    const uint64_t m_block_count;
+    Batches m_batches; // first block -> batch, until all of its blocks are retired
+    std::optional<Hash> m_zero_leaf;
+    Hash m_short_zero_leaf{};
+};
+
+} // namespace Common
+} // namespace PingPong
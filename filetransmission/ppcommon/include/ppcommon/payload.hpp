@@ -0,0 +1,603 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger/logger.hpp"
+#include "ppcommon.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// A payload is sent as one stream of bytes: the contents of its files concatenated in manifest order.
+// Chunks are cut from that stream, so many small files share one chunk.
+
+struct ManifestEntry
+{
+    std::string path; // relative to the payload root, empty for a single file payload
+    uint64_t size = 0;
+    bool is_directory = false;
+    bool is_executable = false;
+};
+
+class Manifest
+{
+  public:
+    static Manifest forFile(const uint64_t size)
+    {
+        Manifest res;
+        res.add(ManifestEntry{"", size, false, false});
+        return res;
+    }
+
+    // Regular files and directories in a stable order. Other entries (symlinks, sockets) are skipped
+    static Manifest scanDirectory(const std::filesystem::path &root)
+    {
+        namespace fs = std::filesystem;
+
+        std::vector<ManifestEntry> entries;
+
+        for (const fs::directory_entry &dir_entry : fs::recursive_directory_iterator(root))
+        {
+            ManifestEntry entry;
+            entry.path = dir_entry.path().lexically_relative(root).generic_string();
+
+            if (dir_entry.is_symlink())
+            {
+                DBG_LOG("[MANIFEST] skipping symlink ", entry.path);
+                continue;
+            }
+
+            if (dir_entry.is_directory())
+            {
+                entry.is_directory = true;
+            }
+            else if (dir_entry.is_regular_file())
+            {
+                entry.size = dir_entry.file_size();
+                entry.is_executable = (dir_entry.status().permissions() & fs::perms::owner_exec) != fs::perms::none;
+            }
+            else
+            {
+                DBG_LOG("[MANIFEST] skipping special file ", entry.path);
+                continue;
+            }
+
+            entries.push_back(std::move(entry));
+        }
+
+        // Sorted paths share long prefixes, which keeps the encoded manifest small
+        std::sort(entries.begin(), entries.end(), [](const ManifestEntry &l, const ManifestEntry &r)
+                  { return l.path < r.path; });
+
+        Manifest res;
+        for (ManifestEntry &entry : entries)
+            res.add(std::move(entry));
+
+        return res;
+    }
+
+    // Per entry: shared prefix length with the previous path, suffix length, suffix,
+    // and size << 2 | executable << 1 | directory. Numbers are LEB128 varints
+    ManifestData encode() const
+    {
+        ManifestData res;
+        res.entry_count = static_cast<uint32_t>(m_entries.size());
+
+        const std::string *prev = nullptr;
+
+        for (const ManifestEntry &entry : m_entries)
+        {
+            size_t common = 0;
+
+            if (prev)
+            {
+                const size_t limit = std::min(prev->size(), entry.path.size());
+                while (common < limit && (*prev)[common] == entry.path[common])
+                    ++common;
+            }
+
+            putVarint(res.data, common);
+            putVarint(res.data, entry.path.size() - common);
+            res.data.insert(res.data.end(), entry.path.begin() + common, entry.path.end());
+            putVarint(res.data, entry.size << 2 | uint64_t(entry.is_executable) << 1 | uint64_t(entry.is_directory));
+
+            prev = &entry.path;
+        }
+
+        return res;
+    }
+
+    // Rejects malformed input and paths that would escape the payload root
+    bool decode(const ManifestData &data)
+    {
+        m_entries.clear();
+        m_offsets.clear();
+        m_total_size = 0;
+
+        size_t pos = 0;
+        std::string prev;
+
+        for (uint32_t i = 0; i < data.entry_count; ++i)
+        {
+            uint64_t common = 0, suffix_size = 0, bits = 0;
+
+            if (!getVarint(data.data, pos, common) || !getVarint(data.data, pos, suffix_size))
+                return false;
+
+            if (common > prev.size() || suffix_size > data.data.size() - pos)
+                return false;
+
+            ManifestEntry entry;
+            entry.path = prev.substr(0, common);
+            entry.path.append(data.data.begin() + pos, data.data.begin() + pos + suffix_size);
+            pos += suffix_size;
+
+            if (!getVarint(data.data, pos, bits))
+                return false;
+
+            entry.size = bits >> 2;
+            entry.is_executable = bits & 2;
+            entry.is_directory = bits & 1;
+
+            if (!isSafePath(entry.path) || (entry.is_directory && entry.size != 0))
+                return false;
+
+            prev = entry.path;
+            add(std::move(entry));
+        }
+
+        return pos == data.data.size();
+    }
+
+    const std::vector<ManifestEntry> &entries() const
+    {
+        return m_entries;
+    }
+
+    bool isSingleFile() const
+    {
+        return m_entries.size() == 1 && m_entries.front().path.empty();
+    }
+
+    uint64_t totalSize() const
+    {
+        return m_total_size;
+    }
+
+    size_t fileCount() const
+    {
+        return std::count_if(m_entries.begin(), m_entries.end(), [](const ManifestEntry &entry)
+                             { return !entry.is_directory; });
+    }
+
+    // Start of the entry in the payload stream
+    uint64_t entryOffset(const size_t index) const
+    {
+        return m_offsets[index];
+    }
+
+    // Entry that holds the byte at the given stream offset
+    size_t findEntry(const uint64_t offset) const
+    {
+        auto it = std::upper_bound(m_offsets.begin(), m_offsets.end(), offset);
+        return static_cast<size_t>(it - m_offsets.begin()) - 1;
+    }
+
+    std::filesystem::path entryPath(const std::filesystem::path &root, const size_t index) const
+    {
+        const std::string &path = m_entries[index].path;
+        return path.empty() ? root : root / path;
+    }
+
+  private:
+    void add(ManifestEntry entry)
+    {
+        m_offsets.push_back(m_total_size);
+        m_total_size += entry.size;
+        m_entries.push_back(std::move(entry));
+    }
+
+    static bool isSafePath(const std::string &path)
+    {
+        if (path.empty() || path.front() == '/')
+            return false;
+
+        for (const auto &part : std::filesystem::path(path))
+        {
+            if (part == ".." || part == ".")
+                return false;
+        }
+
+        return true;
+    }
+
+    static void putVarint(Buffer &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    static bool getVarint(const Buffer &in, size_t &pos, uint64_t &value)
+    {
+        value = 0;
+
+        for (unsigned shift = 0; shift < 64 && pos < in.size(); shift += 7)
+        {
+            const uint8_t byte = in[pos++];
+            value |= uint64_t(byte & 0x7F) << shift;
+
+            if (!(byte & 0x80))
+                return true;
+        }
+
+        return false;
+    }
+
+  private:
+    std::vector<ManifestEntry> m_entries;
+    std::vector<uint64_t> m_offsets;
+    uint64_t m_total_size = 0;
+};
+
+// Reads the payload stream from the files of a manifest
+class PayloadReader
+{
+  public:
+    PayloadReader(const std::filesystem::path &root, const Manifest &manifest)
+        : m_root{root}, m_manifest{manifest}
+    {
+    }
+
+    ~PayloadReader()
+    {
+        closeEntry();
+    }
+
+    PayloadReader(const PayloadReader &) = delete;
+    PayloadReader &operator=(const PayloadReader &) = delete;
+
+    void seek(const uint64_t offset)
+    {
+        closeEntry();
+
+        if (offset >= m_manifest.totalSize())
+        {
+            m_entry = m_manifest.entries().size();
+            m_entry_pos = 0;
+            return;
+        }
+
+        m_entry = m_manifest.findEntry(offset);
+        m_entry_pos = offset - m_manifest.entryOffset(m_entry);
+    }
+
+    // Reads less than asked only at the end of the stream or when a file is missing or shorter than listed.
+    // Holes of sparse files read as zeros
+    size_t read(uint8_t *data, const size_t size)
+    {
+        return readImpl(data, size, false);
+    }
+
+    // Same as read, but stops in front of a hole
+    size_t readData(uint8_t *data, const size_t size)
+    {
+        return readImpl(data, size, true);
+    }
+
+    // Moves past the hole at the current position and returns its length, 0 when there is data.
+    // A hole never spans two files
+    uint64_t skipHole()
+    {
+        if (!openEntry())
+            return 0;
+
+        locateData();
+
+        if (m_hole_end <= m_entry_pos)
+            return 0;
+
+        const uint64_t hole = m_hole_end - m_entry_pos;
+        m_entry_pos = m_hole_end;
+
+        return hole;
+    }
+
+  private:
+    size_t readImpl(uint8_t *data, size_t size, const bool stop_at_hole)
+    {
+        size_t total = 0;
+
+        while (size > 0 && openEntry())
+        {
+            const ManifestEntry &entry = m_manifest.entries()[m_entry];
+            uint64_t available = entry.size - m_entry_pos;
+
+            if (stop_at_hole)
+            {
+                locateData();
+
+                if (m_hole_end > m_entry_pos)
+                    break;
+
+                available = m_data_end - m_entry_pos;
+            }
+
+            const size_t to_read = static_cast<size_t>(std::min<uint64_t>(size, available));
+            const ssize_t n = ::pread(m_fd, data, to_read, static_cast<off_t>(m_entry_pos));
+
+            if (n <= 0)
+                break;
+
+            total += n;
+            data += n;
+            size -= n;
+            m_entry_pos += n;
+        }
+
+        return total;
+    }
+
+    // Skips finished entries and opens the file the current position is in. False at the end or on a missing file
+    bool openEntry()
+    {
+        while (m_entry < m_manifest.entries().size() && m_entry_pos >= m_manifest.entries()[m_entry].size)
+        {
+            closeEntry();
+            ++m_entry;
+            m_entry_pos = 0;
+        }
+
+        if (m_entry >= m_manifest.entries().size())
+            return false;
+
+        if (m_fd < 0)
+        {
+            m_fd = ::open(m_manifest.entryPath(m_root, m_entry).c_str(), O_RDONLY);
+
+            struct stat st;
+            if (m_fd < 0 || ::fstat(m_fd, &st) != 0)
+                return false;
+
+            m_file_size = static_cast<uint64_t>(st.st_size);
+        }
+
+        return true;
+    }
+
+    void closeEntry()
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+
+        m_fd = -1;
+        m_hole_end = m_data_end = 0;
+    }
+
+    // Finds the extent the current position is in: [pos, m_hole_end) is a hole, [pos, m_data_end) is data.
+    // Filesystems without SEEK_DATA report the whole file as data
+    void locateData()
+    {
+        if (m_entry_pos < m_data_end || m_entry_pos < m_hole_end)
+            return;
+
+        const uint64_t end = std::min(m_manifest.entries()[m_entry].size, m_file_size);
+        const off_t pos = static_cast<off_t>(m_entry_pos);
+
+        m_hole_end = m_data_end = m_entry_pos;
+
+        // Past the real end of a file that shrank, reads come up short
+        if (m_entry_pos >= end)
+            return;
+
+        const off_t data = ::lseek(m_fd, pos, SEEK_DATA);
+
+        if (data < 0)
+        {
+            if (errno == ENXIO)
+                m_hole_end = end;
+            else
+                m_data_end = end;
+        }
+        else if (data > pos)
+        {
+            m_hole_end = std::min(static_cast<uint64_t>(data), end);
+        }
+        else
+        {
+            const off_t hole = ::lseek(m_fd, pos, SEEK_HOLE);
+            m_data_end = hole < 0 ? end : std::min(static_cast<uint64_t>(hole), end);
+        }
+    }
+
+  private:
+    const std::filesystem::path m_root;
+    const Manifest &m_manifest;
+    int m_fd = -1;
+    uint64_t m_file_size = 0;
+    size_t m_entry = 0;
+    uint64_t m_entry_pos = 0;
+    uint64_t m_hole_end = 0;
+    uint64_t m_data_end = 0;
+};
+
+// Writes chunks of the payload stream at their offsets into the files of a manifest
+class PayloadWriter
+{
+  public:
+    PayloadWriter(const std::filesystem::path &root, const Manifest &manifest)
+        : m_root{root}, m_manifest{manifest}
+    {
+    }
+
+    // Creates the tree and trims every file to its part below offset, the rest is going to be received
+    bool prepare(const uint64_t offset)
+    {
+        namespace fs = std::filesystem;
+
+        close();
+
+        std::error_code ec;
+
+        if (!m_manifest.isSingleFile())
+        {
+            fs::create_directories(m_root, ec);
+            if (ec)
+                return false;
+        }
+
+        for (size_t i = 0; i < m_manifest.entries().size(); ++i)
+        {
+            const ManifestEntry &entry = m_manifest.entries()[i];
+            const fs::path path = m_manifest.entryPath(m_root, i);
+
+            if (entry.is_directory)
+            {
+                fs::create_directories(path, ec);
+                if (ec)
+                    return false;
+
+                continue;
+            }
+
+            const uint64_t start = m_manifest.entryOffset(i);
+            const uint64_t keep = offset > start ? std::min(offset - start, entry.size) : 0;
+
+            if (keep > 0)
+            {
+                fs::resize_file(path, keep, ec);
+            }
+            else
+            {
+                if (path.has_parent_path())
+                    fs::create_directories(path.parent_path(), ec);
+
+                std::ofstream create(path, std::ios::binary | std::ios::trunc);
+                if (!create.is_open())
+                    return false;
+            }
+
+            if (ec)
+                return false;
+
+            if (entry.is_executable)
+                fs::permissions(path, fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec, fs::perm_options::add, ec);
+        }
+
+        return true;
+    }
+
+    bool write(uint64_t offset, const uint8_t *data, size_t size)
+    {
+        while (size > 0)
+        {
+            if (offset >= m_manifest.totalSize())
+                return false;
+
+            const size_t index = m_manifest.findEntry(offset);
+            const uint64_t entry_pos = offset - m_manifest.entryOffset(index);
+
+            if (index != m_entry)
+            {
+                m_ofs.close();
+                m_ofs.open(m_manifest.entryPath(m_root, index), std::ios::in | std::ios::out | std::ios::binary);
+                m_entry = index;
+                m_entry_pos = 0;
+            }
+
+            // Chunks of different stripes interleave, seek only when the order breaks
+            if (entry_pos != m_entry_pos)
+                m_ofs.seekp(static_cast<std::streamoff>(entry_pos));
+
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(size, m_manifest.entries()[index].size - entry_pos));
+            m_ofs.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(n));
+
+            if (!m_ofs)
+                return false;
+
+            m_entry_pos = entry_pos + n;
+            offset += n;
+            data += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    // Leaves a range unwritten. prepare() cut the files below it, so only a file that ends
+    // inside the hole has to be extended, which the filesystem does without allocating blocks
+    bool hole(uint64_t offset, uint64_t size)
+    {
+        namespace fs = std::filesystem;
+
+        if (size > m_manifest.totalSize() || offset > m_manifest.totalSize() - size)
+            return false;
+
+        // Buffered writes must land before the file length changes under them
+        m_ofs.flush();
+
+        while (size > 0)
+        {
+            const size_t index = m_manifest.findEntry(offset);
+            const uint64_t entry_pos = offset - m_manifest.entryOffset(index);
+            const uint64_t n = std::min(size, m_manifest.entries()[index].size - entry_pos);
+            const fs::path path = m_manifest.entryPath(m_root, index);
+
+            std::error_code ec;
+            const uintmax_t current = fs::file_size(path, ec);
+
+            if (ec)
+                return false;
+
+            if (current < entry_pos + n)
+            {
+                fs::resize_file(path, entry_pos + n, ec);
+                if (ec)
+                    return false;
+            }
+
+            offset += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    bool flush()
+    {
+        m_ofs.flush();
+        return !m_ofs.fail();
+    }
+
+    void close()
+    {
+        m_ofs.close();
+        m_entry = c_no_entry;
+    }
+
+  private:
+    static constexpr size_t c_no_entry = static_cast<size_t>(-1);
+
+    const std::filesystem::path m_root;
+    const Manifest &m_manifest;
+    std::fstream m_ofs;
+    size_t m_entry = c_no_entry;
+    uint64_t m_entry_pos = 0;
+};
+
+} // namespace Common
+} // namespace PingPong
@@ -3,6 +3,8 @@
 #include <array>
 #include <cstdint>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <openssl/sha.h>
@@ -16,27 +18,67 @@ namespace Common
 
 enum class EPayloadType : uint8_t
 {
-    File
+    File,
+    Directory
+};
+
+// Chunk compression the sender asks for. The server passes it on to the receiver
+enum class ECompression : uint8_t
+{
+    None,
+    Zlib
+};
+
+// How chunks are checked on the way. A whole payload digest is compared at the end in every mode
+enum class EIntegrity : uint8_t
+{
+    None,
+    Crc32c, // per chunk, against transmission errors
+    Sha256  // per block, against the Merkle root
 };
 
 struct CodePhrase
 {
-    uint8_t code_size;
+    uint8_t code_size = 0;
     std::string code;
 };
 
 struct FileData
 {
-    uint64_t file_size;
-    uint8_t file_name_size;
+    uint64_t file_size = 0;
+    uint8_t file_name_size = 0;
     std::string file_name;
 };
 
+using Buffer = std::vector<uint8_t>;
+using Hash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+// Root of the Merkle tree over the payload's blocks, see merkle.hpp
+struct MerkleRoot
+{
+    Hash root{};
+    uint32_t block_size = 0;
+};
+
 struct PreMetadata
 {
     EPayloadType payload_type;
     CodePhrase code_phrase;
     FileData file_data;
+    uint8_t stripe_count = 1; // parallel connections the sender asks for
+    ECompression compression = ECompression::None;
+    MerkleRoot merkle;
+    EIntegrity integrity = EIntegrity::Sha256;
+};
+
+// Valid prefix of a partially received file. An empty offset means a fresh transfer.
+// basis_size is the size of an older copy the receiver holds, its Signatures follow the request.
+// The sender's Resume reply keeps it only if it sends Copy messages against that copy
+struct ResumeData
+{
+    uint64_t offset = 0;
+    Hash digest{};
+    uint64_t basis_size = 0;
 };
 
 struct PostMetadata
@@ -45,21 +87,125 @@ struct PostMetadata
     uint64_t max_chunk_size;
     CodePhrase code_phrase;
     FileData file_data;
+    ResumeData resume;
+    uint8_t stripe_count = 1; // parallel connections granted by the server
+    ECompression compression = ECompression::None;
+    MerkleRoot merkle;
+    EIntegrity integrity = EIntegrity::Sha256;
+};
+
+struct ReceiveRequest
+{
+    CodePhrase code_phrase;
+    ResumeData resume;
 };
 
 struct Empty
 {
 };
 
-using Buffer = std::vector<uint8_t>;
-using Hash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+// Encoded Manifest of a directory payload, see payload.hpp
+struct ManifestData
+{
+    uint32_t entry_count = 0;
+    Buffer data;
+};
+
+// Most connections one transfer is striped over, the primary one included
+constexpr uint8_t c_max_stripe_count = 8;
 
+// Stripe connection joining an already established transfer
+struct StripeRequest
+{
+    CodePhrase code_phrase;
+    uint8_t stripe_index = 0;
+};
+
+// Flags of a chunk
+constexpr uint8_t c_chunk_compressed = 1;
+constexpr uint8_t c_chunk_crc32c = 2;
+
+// With EIntegrity::Sha256 chunks are checked per block against the Merkle tree and carry no checksum.
+// The data follows the other fields, a decoded chunk views it inside the received message
 struct ChunkData
 {
-    Hash hash;
-    Buffer data;
+    uint64_t offset = 0; // position of the chunk in the file
+    uint8_t flags = 0;
+    uint32_t crc = 0; // of the uncompressed data, only with c_chunk_crc32c
+    Net::ByteView data;
 };
 
+// Flags of a proof
+constexpr uint8_t c_proof_uniform = 1;
+
+// Leaves of a batch of blocks and the sibling hashes that lead from them to the root.
+// A uniform batch (a run of hole blocks) sends its common leaf once
+struct ProofData
+{
+    uint64_t first_block;
+    uint64_t block_count;
+    uint8_t flags;
+    Buffer hashes;
+};
+
+// Run of zeros in a sparse file. Sent instead of chunks, the receiver leaves a hole there
+struct HoleData
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Ends every stripe. Carries the sender's PayloadDigest of everything it sent
+struct FinalChunkData
+{
+    Hash digest;
+};
+
+// Content-defined chunks of the receiver's older copy, see delta.hpp. Entries are packed ChunkSignatures
+struct SignatureData
+{
+    uint8_t avg_bits = 0; // chunker parameter, the sender has to cut its payload the same way
+    uint32_t count = 0;
+    Buffer entries;
+};
+
+// Range of the payload the receiver already has in its older copy. Sent instead of its chunks
+struct CopyData
+{
+    uint64_t offset;
+    uint64_t basis_offset;
+    uint64_t size;
+};
+
+// Merkle leaves of blocks from first_block on. The sender asks which of them the server's chunk cache holds.
+// owner is a secret of the sender: the cache files blocks under it, and only shows a sender its own
+struct CacheQueryData
+{
+    uint64_t first_block = 0;
+    Hash owner{};
+    Buffer leaves;
+};
+
+// Bit i of the bitmap is set when block first_block + i is cached. The server keeps them until the transfer ends
+struct CacheReplyData
+{
+    uint64_t first_block = 0;
+    uint64_t block_count = 0;
+    Buffer bitmap;
+};
+
+// Run of blocks the server sends the receiver from its cache. Takes the place of their chunks.
+// Also the Refill the server asks for blocks it can't send after all, and the one the sender ends them with
+struct CachedData
+{
+    uint64_t first_block;
+    uint64_t block_count;
+};
+
+// Bytes of a Chunk message that are not file data: always present and at most
+constexpr size_t c_chunk_header_size = sizeof(uint64_t) + sizeof(uint8_t);
+constexpr size_t c_chunk_overhead = c_chunk_header_size + sizeof(uint32_t);
+
 } // namespace Common
 } // namespace PingPong
 
@@ -69,7 +215,7 @@ namespace Net
 template <typename T>
 Message<T> &operator<<(Message<T> &msg, const PingPong::Common::CodePhrase &data)
 {
-    msg << data.code << data.code_size;
+    msg << data.code_size << data.code;
     return msg;
 }
 
@@ -85,7 +231,7 @@ Message<T> &operator>>(Message<T> &msg, PingPong::Common::CodePhrase &data)
 template <typename T>
 Message<T> &operator<<(Message<T> &msg, const PingPong::Common::FileData &data)
 {
-    msg << data.file_name << data.file_name_size << data.file_size;
+    msg << data.file_size << data.file_name_size << data.file_name;
     return msg;
 }
 
@@ -101,46 +247,162 @@ Message<T> &operator>>(Message<T> &msg, PingPong::Common::FileData &data)
 template <typename T>
 Message<T> &operator<<(Message<T> &msg, const PingPong::Common::PreMetadata &data)
 {
-    msg << data.file_data << data.code_phrase << data.payload_type;
+    msg << data.payload_type << data.code_phrase << data.file_data << data.stripe_count << data.compression << data.merkle << data.integrity;
     return msg;
 }
 
 template <typename T>
 Message<T> &operator>>(Message<T> &msg, PingPong::Common::PreMetadata &data)
 {
-    msg >> data.payload_type >> data.code_phrase >> data.file_data;
+    msg >> data.payload_type >> data.code_phrase >> data.file_data >> data.stripe_count >> data.compression >> data.merkle >> data.integrity;
     return msg;
 }
 
 template <typename T>
 Message<T> &operator<<(Message<T> &msg, const PingPong::Common::PostMetadata &data)
 {
-    msg << data.file_data << data.code_phrase << data.max_chunk_size << data.payload_type;
+    msg << data.payload_type << data.max_chunk_size << data.code_phrase << data.file_data << data.resume << data.stripe_count << data.compression << data.merkle << data.integrity;
     return msg;
 }
 
 template <typename T>
 Message<T> &operator>>(Message<T> &msg, PingPong::Common::PostMetadata &data)
 {
-    msg >> data.payload_type >> data.max_chunk_size >> data.code_phrase >> data.file_data;
+    msg >> data.payload_type >> data.max_chunk_size >> data.code_phrase >> data.file_data >> data.resume >> data.stripe_count >> data.compression >> data.merkle >> data.integrity;
     return msg;
 }
 
 template <typename T>
-Message<T> &operator<<(Message<T> &msg, const PingPong::Common::ChunkData &data)
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::ReceiveRequest &data)
 {
-    msg << data.data << data.hash;
+    msg << data.code_phrase << data.resume;
     return msg;
 }
 
 template <typename T>
-Message<T> &operator>>(Message<T> &msg, PingPong::Common::ChunkData &data)
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::ReceiveRequest &data)
+{
+    msg >> data.code_phrase >> data.resume;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::ManifestData &data)
 {
-    msg >> data.hash;
+    msg << data.entry_count << data.data;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::ManifestData &data)
+{
+    msg >> data.entry_count;
     data.data.resize(msg.size());
     msg >> data.data;
     return msg;
 }
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::StripeRequest &data)
+{
+    msg << data.code_phrase << data.stripe_index;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::StripeRequest &data)
+{
+    msg >> data.code_phrase >> data.stripe_index;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::ChunkData &data)
+{
+    msg << data.offset << data.flags;
+
+    if (data.flags & PingPong::Common::c_chunk_crc32c)
+        msg << data.crc;
+
+    msg << data.data;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::ChunkData &data)
+{
+    msg >> data.offset >> data.flags;
+
+    if (data.flags & PingPong::Common::c_chunk_crc32c)
+        msg >> data.crc;
+
+    data.data = msg.view(msg.size());
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::SignatureData &data)
+{
+    msg << data.avg_bits << data.count << data.entries;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::SignatureData &data)
+{
+    msg >> data.avg_bits >> data.count;
+    data.entries.resize(msg.size());
+    msg >> data.entries;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::CacheQueryData &data)
+{
+    msg << data.first_block << data.owner << data.leaves;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::CacheQueryData &data)
+{
+    msg >> data.first_block >> data.owner;
+    data.leaves.resize(msg.size());
+    msg >> data.leaves;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::CacheReplyData &data)
+{
+    msg << data.first_block << data.block_count << data.bitmap;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::CacheReplyData &data)
+{
+    msg >> data.first_block >> data.block_count;
+    data.bitmap.resize(msg.size());
+    msg >> data.bitmap;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator<<(Message<T> &msg, const PingPong::Common::ProofData &data)
+{
+    msg << data.first_block << data.block_count << data.flags << data.hashes;
+    return msg;
+}
+
+template <typename T>
+Message<T> &operator>>(Message<T> &msg, PingPong::Common::ProofData &data)
+{
+    msg >> data.first_block >> data.block_count >> data.flags;
+    data.hashes.resize(msg.size());
+    msg >> data.hashes;
+    return msg;
+}
 } // namespace Net
 
 namespace PingPong
@@ -163,7 +425,32 @@ enum class EMessageType : uint32_t
     Receive = 8,
     // File transmission process
     Chunk = 9,
-    FinalChunk = 10
+    FinalChunk = 10,
+    // Sender's reply to a resume offer. Precedes the first chunk of every stripe
+    Resume = 11,
+    // Extra connections of a striped transfer
+    SendStripe = 12,
+    ReceiveStripe = 13,
+    // File list of a directory payload. Follows Send and Accept to the receiver
+    Manifest = 14,
+    // Unallocated range of a sparse file, takes the place of its chunks
+    Hole = 15,
+    // Merkle proof for the batch of blocks that follows on the same stripe
+    Proof = 16,
+    // Delta sync: the receiver's signatures of its older copy, follows Receive to the sender
+    Signatures = 17,
+    // Delta sync: range to take from the receiver's older copy, takes the place of its chunks
+    Copy = 18,
+    // Server chunk cache: the sender asks which blocks the server has and gets a bitmap back
+    CacheQuery = 19,
+    CacheReply = 20,
+    // Server chunk cache: blocks the server sends from its cache, never reaches the receiver
+    Cached = 21,
+    // Server chunk cache: the server asks the sender for cached blocks it failed to read, the sender sends them
+    // on the same stripe and echoes the request after them
+    Refill = 22,
+    // Number of message types, new ones go above
+    Count
 };
 
 template <EMessageType M>
@@ -220,7 +507,7 @@ struct Payload<EMessageType::FailedReceive>
 template <>
 struct Payload<EMessageType::Receive>
 {
-    using Type = CodePhrase;
+    using Type = ReceiveRequest;
 };
 
 template <>
@@ -232,7 +519,244 @@ struct Payload<EMessageType::Chunk>
 template <>
 struct Payload<EMessageType::FinalChunk>
 {
-    using Type = Empty;
+    using Type = FinalChunkData;
+};
+
+template <>
+struct Payload<EMessageType::Resume>
+{
+    using Type = ResumeData;
+};
+
+template <>
+struct Payload<EMessageType::SendStripe>
+{
+    using Type = StripeRequest;
+};
+
+template <>
+struct Payload<EMessageType::ReceiveStripe>
+{
+    using Type = StripeRequest;
+};
+
+template <>
+struct Payload<EMessageType::Manifest>
+{
+    using Type = ManifestData;
+};
+
+template <>
+struct Payload<EMessageType::Hole>
+{
+    using Type = HoleData;
+};
+
+template <>
+struct Payload<EMessageType::Proof>
+{
+    using Type = ProofData;
+};
+
+template <>
+struct Payload<EMessageType::Signatures>
+{
+    using Type = SignatureData;
+};
+
+template <>
+struct Payload<EMessageType::Copy>
+{
+    using Type = CopyData;
+};
+
+template <>
+struct Payload<EMessageType::CacheQuery>
+{
+    using Type = CacheQueryData;
+};
+
+template <>
+struct Payload<EMessageType::CacheReply>
+{
+    using Type = CacheReplyData;
+};
+
+template <>
+struct Payload<EMessageType::Cached>
+{
+    using Type = CachedData;
+};
+
+template <>
+struct Payload<EMessageType::Refill>
+{
+    using Type = CachedData;
+};
+
+// Bytes a payload takes in a message body, so encode() reserves the body once.
+// Fixed-size fields are counted at compile time, strings and buffers add their length at run time
+template <typename T, typename = void>
+struct WireSize
+{
+};
+
+// Pushed raw
+template <typename T>
+struct WireSize<T, std::enable_if_t<std::is_trivially_copyable_v<T>>>
+{
+    static constexpr size_t of(const T &)
+    {
+        return sizeof(T);
+    }
+};
+
+template <typename T, typename = void>
+constexpr bool c_has_wire_size = false;
+
+template <typename T>
+constexpr bool c_has_wire_size<T, std::void_t<decltype(WireSize<T>::of(std::declval<const T &>()))>> = true;
+
+template <typename... Fields>
+constexpr size_t wire_size(const Fields &...fields)
+{
+    return (WireSize<Fields>::of(fields) + ...);
+}
+
+template <>
+struct WireSize<std::string>
+{
+    static size_t of(const std::string &data)
+    {
+        return data.size();
+    }
+};
+
+template <>
+struct WireSize<Buffer>
+{
+    static size_t of(const Buffer &data)
+    {
+        return data.size();
+    }
+};
+
+template <>
+struct WireSize<Net::ByteView>
+{
+    static size_t of(const Net::ByteView &data)
+    {
+        return data.size();
+    }
+};
+
+template <>
+struct WireSize<CodePhrase>
+{
+    static size_t of(const CodePhrase &data)
+    {
+        return wire_size(data.code_size, data.code);
+    }
+};
+
+template <>
+struct WireSize<FileData>
+{
+    static size_t of(const FileData &data)
+    {
+        return wire_size(data.file_size, data.file_name_size, data.file_name);
+    }
+};
+
+template <>
+struct WireSize<PreMetadata>
+{
+    static size_t of(const PreMetadata &data)
+    {
+        return wire_size(data.payload_type, data.code_phrase, data.file_data, data.stripe_count, data.compression, data.merkle, data.integrity);
+    }
+};
+
+template <>
+struct WireSize<PostMetadata>
+{
+    static size_t of(const PostMetadata &data)
+    {
+        return wire_size(data.payload_type, data.max_chunk_size, data.code_phrase, data.file_data, data.resume, data.stripe_count, data.compression, data.merkle, data.integrity);
+    }
+};
+
+template <>
+struct WireSize<ReceiveRequest>
+{
+    static size_t of(const ReceiveRequest &data)
+    {
+        return wire_size(data.code_phrase, data.resume);
+    }
+};
+
+template <>
+struct WireSize<ManifestData>
+{
+    static size_t of(const ManifestData &data)
+    {
+        return wire_size(data.entry_count, data.data);
+    }
+};
+
+template <>
+struct WireSize<StripeRequest>
+{
+    static size_t of(const StripeRequest &data)
+    {
+        return wire_size(data.code_phrase, data.stripe_index);
+    }
+};
+
+template <>
+struct WireSize<ChunkData>
+{
+    static size_t of(const ChunkData &data)
+    {
+        const size_t header_size = (data.flags & c_chunk_crc32c) ? c_chunk_overhead : c_chunk_header_size;
+        return header_size + data.data.size();
+    }
+};
+
+template <>
+struct WireSize<SignatureData>
+{
+    static size_t of(const SignatureData &data)
+    {
+        return wire_size(data.avg_bits, data.count, data.entries);
+    }
+};
+
+template <>
+struct WireSize<CacheQueryData>
+{
+    static size_t of(const CacheQueryData &data)
+    {
+        return wire_size(data.first_block, data.owner, data.leaves);
+    }
+};
+
+template <>
+struct WireSize<CacheReplyData>
+{
+    static size_t of(const CacheReplyData &data)
+    {
+        return wire_size(data.first_block, data.block_count, data.bitmap);
+    }
+};
+
+template <>
+struct WireSize<ProofData>
+{
+    static size_t of(const ProofData &data)
+    {
+        return wire_size(data.first_block, data.block_count, data.flags, data.hashes);
+    }
 };
 
 using Message = Net::Message<Common::EMessageType>;
@@ -240,8 +764,11 @@ using Message = Net::Message<Common::EMessageType>;
 template <EMessageType M>
 Message encode(const typename Payload<M>::Type &data)
 {
+    static_assert(c_has_wire_size<typename Payload<M>::Type>, "Payload has no WireSize");
+
     Message msg;
     msg.header.id = M;
+    msg.body.reserve(WireSize<typename Payload<M>::Type>::of(data));
     msg << data;
     return msg;
 }
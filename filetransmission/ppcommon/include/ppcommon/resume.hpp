@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "crc32c.hpp"
+#include "hash.hpp"
+#include "logger/logger.hpp"
+#include "merkle.hpp"
+#include "payload.hpp"
+#include "ppcommon.hpp"
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Sidecar file next to a partially received file or directory.
+// Every verified block that has been written is appended as (offset, size, kind, check value),
+// so after a failure the receiver can tell which bytes of the partial payload are still valid.
+// The check value is the Merkle leaf, or the CRC-32C of a chunk when there is no tree. Holes have none.
+class ResumeJournal
+{
+  public:
+    enum class EKind : uint8_t
+    {
+        Leaf,
+        Hole,
+        Crc32c
+    };
+
+    struct Entry
+    {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        EKind kind = EKind::Leaf;
+        Hash hash{};
+        uint32_t crc = 0;
+    };
+
+  public:
+    explicit ResumeJournal(const std::filesystem::path &file)
+        : m_file{file}, m_path{file.string() + ".ppresume"}
+    {
+    }
+
+    const std::filesystem::path &path() const
+    {
+        return m_path;
+    }
+
+    // Re-hashes the journaled blocks of the partial payload and returns the longest valid prefix
+    ResumeData probe(PayloadReader &reader)
+    {
+        ResumeData res;
+        m_valid.clear();
+
+        if (!std::filesystem::exists(m_file) || !std::filesystem::exists(m_path))
+            return res;
+
+        std::vector<Entry> entries = readEntries();
+        std::sort(entries.begin(), entries.end(), [](const Entry &l, const Entry &r)
+                  { return l.offset < r.offset; });
+
+        std::vector<uint8_t> buf;
+        uint64_t valid = 0;
+
+        // Only a contiguous run from the start counts, so the payload is read sequentially
+        reader.seek(0);
+
+        for (const Entry &entry : entries)
+        {
+            if (entry.offset != valid)
+                break;
+
+            if (entry.kind == EKind::Hole)
+            {
+                // Not re-read, the range only has to still be a hole
+                if (reader.skipHole() < entry.size)
+                    break;
+
+                reader.seek(entry.offset + entry.size);
+            }
+            else
+            {
+                buf.resize(entry.size);
+
+                if (reader.read(buf.data(), buf.size()) != entry.size)
+                    break;
+
+                const bool valid_entry = entry.kind == EKind::Leaf ? merkle_leaf(buf.data(), buf.size()) == entry.hash
+                                                                   : crc32c(buf.data(), buf.size()) == entry.crc;
+                if (!valid_entry)
+                    break;
+            }
+
+            m_valid.push_back(entry);
+            valid += entry.size;
+        }
+
+        DBG_LOG("[RESUME] ", m_valid.size(), " of ", entries.size(), " journaled blocks are valid, prefix = ", valid);
+
+        if (valid > 0)
+        {
+            res.offset = valid;
+            reader.seek(0);
+            res.digest = sha256_prefix([&reader](uint8_t *data, size_t size)
+                                       { return reader.read(data, size); },
+                                       valid);
+        }
+
+        return res;
+    }
+
+    // Drops everything past `offset` and reopens the journal for appending
+    bool open(uint64_t offset)
+    {
+        std::vector<Entry> kept;
+
+        for (const Entry &entry : m_valid)
+        {
+            if (entry.offset + entry.size <= offset)
+                kept.push_back(entry);
+        }
+
+        m_ofs.close();
+        m_ofs.open(m_path, std::ios::out | std::ios::binary | std::ios::trunc);
+
+        for (const Entry &entry : kept)
+            writeEntry(entry);
+
+        flush();
+        return m_ofs.is_open();
+    }
+
+    void append(uint64_t offset, uint64_t size, const Hash &hash)
+    {
+        writeEntry(Entry{offset, size, EKind::Leaf, hash});
+    }
+
+    void appendHole(uint64_t offset, uint64_t size)
+    {
+        writeEntry(Entry{offset, size, EKind::Hole});
+    }
+
+    void appendCrc32c(uint64_t offset, uint64_t size, uint32_t crc)
+    {
+        writeEntry(Entry{offset, size, EKind::Crc32c, Hash{}, crc});
+    }
+
+    // Entries are buffered, the session flushes them once the data they cover is written out
+    void flush()
+    {
+        m_ofs.flush();
+    }
+
+    void remove()
+    {
+        m_ofs.close();
+
+        std::error_code ec;
+        std::filesystem::remove(m_path, ec);
+    }
+
+  private:
+    std::vector<Entry> readEntries() const
+    {
+        std::vector<Entry> res;
+        std::ifstream ifs(m_path, std::ios::binary);
+
+        Entry entry;
+        while (ifs.read(reinterpret_cast<char *>(&entry.offset), sizeof(entry.offset)) &&
+               ifs.read(reinterpret_cast<char *>(&entry.size), sizeof(entry.size)) &&
+               ifs.read(reinterpret_cast<char *>(&entry.kind), sizeof(entry.kind)))
+        {
+            bool complete = true;
+
+            // A torn last entry is dropped
+            if (entry.kind == EKind::Leaf)
+                complete = static_cast<bool>(ifs.read(reinterpret_cast<char *>(entry.hash.data()), entry.hash.size()));
+            else if (entry.kind == EKind::Crc32c)
+                complete = static_cast<bool>(ifs.read(reinterpret_cast<char *>(&entry.crc), sizeof(entry.crc)));
+            else if (entry.kind != EKind::Hole)
+                complete = false;
+
+            if (!complete)
+                break;
+
+            res.push_back(entry);
+        }
+
+        return res;
+    }
+
+    void writeEntry(const Entry &entry)
+    {
+        m_ofs.write(reinterpret_cast<const char *>(&entry.offset), sizeof(entry.offset));
+        m_ofs.write(reinterpret_cast<const char *>(&entry.size), sizeof(entry.size));
+        m_ofs.write(reinterpret_cast<const char *>(&entry.kind), sizeof(entry.kind));
+
+        if (entry.kind == EKind::Leaf)
+            m_ofs.write(reinterpret_cast<const char *>(entry.hash.data()), entry.hash.size());
+        else if (entry.kind == EKind::Crc32c)
+            m_ofs.write(reinterpret_cast<const char *>(&entry.crc), sizeof(entry.crc));
+    }
+
+  private:
+    const std::filesystem::path m_file;
+    const std::filesystem::path m_path;
+    std::vector<Entry> m_valid;
+    std::ofstream m_ofs;
+};
+
+} // namespace Common
+} // namespace PingPong
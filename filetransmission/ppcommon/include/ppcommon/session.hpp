@@ -1,14 +1,29 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
+#include <map>
+#include <optional>
 
+#include "chunk_cache.hpp"
+#include "compression.hpp"
+#include "crc32c.hpp"
+#include "delta.hpp"
+#include "dispatch.hpp"
 #include "hash.hpp"
 #include "logger/logger.hpp"
+#include "merkle.hpp"
 #include "net_common/net_connection.hpp"
 #include "net_common/net_message.hpp"
+#include "payload.hpp"
 #include "ppcommon.hpp"
+#include "resume.hpp"
 #include "tsqueue/tsqueue.hpp"
+#include "worker_pool.hpp"
 
 namespace PingPong
 {
@@ -48,8 +63,8 @@ class ClientSession : public Session
 class ClientReceiverSession : public ClientSession
 {
   public:
-    ClientReceiverSession(Common::EPayloadType payload_type, Net::TSQueue<Net::OwnedMessage<Common::EMessageType>> &messages_in, const std::filesystem::path &file, const std::function<void(Common::Message &&)> sendcb)
-        : ClientSession(payload_type, messages_in), m_file{file}, m_sendcb{sendcb}
+    ClientReceiverSession(Common::EPayloadType payload_type, Net::TSQueue<Net::OwnedMessage<Common::EMessageType>> &messages_in, const std::filesystem::path &file, const Common::Manifest &manifest, Common::ResumeJournal &journal, Common::MerkleVerifier &verifier, const std::filesystem::path &basis, const uint64_t basis_size, const Common::EIntegrity integrity, const Common::ECompression compression, const uint8_t stripe_count, const uint64_t max_chunk_size, const std::function<void(Common::Message &&)> sendcb)
+        : ClientSession(payload_type, messages_in), m_file{file}, m_manifest{manifest}, m_writer{file, manifest}, m_readback{file, manifest}, m_journal{journal}, m_verifier{verifier}, m_integrity{integrity}, m_compression{compression}, m_basis_path{basis}, m_basis_size{basis_size}, m_stripe_count{stripe_count}, m_max_chunk_size{max_chunk_size}, m_sendcb{sendcb}, m_pool{Common::WorkerPool::defaultThreadCount()}
     {
     }
 
@@ -62,81 +77,749 @@ class ClientReceiverSession : public ClientSession
         using namespace Common;
 
         DBG_LOG(__PRETTY_FUNCTION__);
-        std::ofstream ofs(m_file, std::ios::out | std::ios::binary);
+        bool opened = false;
+        uint8_t finished_stripes = 0;
+        Hash expected_digest{};
 
-        if (!ofs.is_open())
-        {
-            std::cerr << "Error opening file: " << m_file << std::endl;
-            Message failed_msg = encode<EMessageType::FailedReceive>(Empty{});
-            m_sendcb(std::move(failed_msg));
+        // Each handler returns false to abort the transfer
+        auto handlers = MessageHandlers{
+            [](MessageTag<EMessageType::Abort>, Empty &&)
+            {
+                std::cerr << "Abort command from the server\n";
+                return false;
+            },
+            // Only stripes are answered with Reject once the transfer runs
+            [](MessageTag<EMessageType::Reject>, Empty &&)
+            {
+                std::cerr << "Server refused a stripe\n";
+                return false;
+            },
+            [&](MessageTag<EMessageType::Resume>, ResumeData &&resume)
+            {
+                // Every stripe starts with the same Resume, the first one prepares the output
+                if (opened)
+                    return true;
 
-            return false;
-        }
+                DBG_LOG("Sender resumes from offset ", resume.offset);
 
-        bool op_result = true;
-        bool finish = false;
+                if (!openOutput(resume.offset))
+                    return false;
 
-        while (ofs && !finish && op_result)
-        {
-            m_messages_in.wait();
+                opened = true;
 
-            // Check for incoming messages from a server
-            while (!m_messages_in.empty())
-            {
-                auto msg = m_messages_in.pop_front().msg;
-                if (msg.header.id == EMessageType::Abort)
+                if (resume.basis_size != 0)
                 {
-                    std::cerr << "Abort command from the server\n";
-                    op_result = false;
-                    break;
-                }
-                else if (msg.header.id == EMessageType::Chunk)
-                {
-                    const auto offset = SHA256_DIGEST_LENGTH;
-                    DBG_LOG("Incoming chunk of size ", msg.size() - offset);
+                    if (resume.basis_size != m_basis_size)
                     {
-                        Hash inc_hash;
-                        msg >> inc_hash;
+                        std::cerr << "Sender refers to an unknown older copy. Aborting\n";
+                        return false;
+                    }
 
-                        Hash hash = sha256_chunk(msg.body);
+                    m_basis_manifest.emplace(Manifest::forFile(m_basis_size));
+                    m_basis.emplace(m_basis_path, *m_basis_manifest);
+                }
 
-                        if (inc_hash != hash)
-                        {
-                            std::cerr << "Chunk control sums don't match. Aborting\n";
-                            op_result = false;
-                            break;
-                        }
-                    }
-                    ofs.write(reinterpret_cast<const char *>(msg.body.data()), msg.size());
+                if (m_integrity == EIntegrity::Sha256)
+                    m_block_digest.emplace(resume.offset, resume.digest);
+                else
+                    m_stream_digest.emplace(resume.offset, resume.digest);
+
+                return true;
+            },
+            [this](MessageTag<EMessageType::Copy>, CopyData &&copy)
+            {
+                if (!m_basis)
+                {
+                    std::cerr << "Copy arrived without an older copy to take it from. Aborting\n";
+                    return false;
                 }
-                else if (msg.header.id == EMessageType::FinalChunk)
+
+                return defer([this, copy]()
+                             { return applyCopy(copy); });
+            },
+            [this](MessageTag<EMessageType::Proof>, ProofData &&proof)
+            {
+                DBG_LOG("Incoming proof for ", proof.block_count, " blocks from ", proof.first_block);
+
+                return defer([this, proof = std::move(proof)]()
+                             {
+                                 if (!m_verifier.accept(proof))
+                                 {
+                                     std::cerr << "Merkle proof doesn't match the root. Aborting\n";
+                                     return false;
+                                 }
+
+                                 return true;
+                             });
+            },
+            [&](MessageTag<EMessageType::Chunk>, Message &msg)
+            {
+                if (!opened)
                 {
-                    DBG_LOG("End of transmission. Finishing.");
-                    finish = true;
-                    break;
+                    std::cerr << "Chunk arrived before Resume. Aborting\n";
+                    return false;
                 }
-                else
+
+                DBG_LOG("Incoming chunk of size ", msg.size() - c_chunk_header_size);
+
+                if (!makeRoom())
+                    return false;
+
+                // Decoded on the pool, where the message no longer moves and views into it stay valid
+                submit([this, msg = std::move(msg)]() mutable
+                       { return decodeChunk(std::move(msg)); });
+
+                return true;
+            },
+            [&](MessageTag<EMessageType::Hole>, HoleData &&hole)
+            {
+                if (!opened)
                 {
-                    DBG_LOG("Skipped an unknown message from the server with header ", static_cast<uint32_t>(msg.header.id));
+                    std::cerr << "Hole arrived before Resume. Aborting\n";
+                    return false;
                 }
+
+                DBG_LOG("Incoming hole of size ", hole.size, " at ", hole.offset);
+
+                return defer([this, hole]()
+                             { return m_integrity == EIntegrity::Sha256 ? addHole(hole.offset, hole.size)
+                                                                        : writeHole(hole.offset, hole.size); });
+            },
+            [&](MessageTag<EMessageType::FinalChunk>, FinalChunkData &&final_chunk)
+            {
+                // Every stripe carries the same digest
+                expected_digest = final_chunk.digest;
+                ++finished_stripes;
+                DBG_LOG("End of stripe transmission. ", static_cast<int>(finished_stripes), "/", static_cast<int>(m_stripe_count), " finished");
+
+                return true;
+            },
+            []([[maybe_unused]] Message &msg)
+            {
+                DBG_LOG("Skipped an unknown message from the server with header ", static_cast<uint32_t>(msg.header.id));
+                return true;
+            }};
+
+        bool op_result = true;
+
+        while (finished_stripes < m_stripe_count && op_result)
+        {
+            // With nothing to dispatch, finished work is applied meanwhile
+            if (m_jobs.empty())
+            {
+                m_messages_in.wait();
+            }
+            else if (m_messages_in.empty() && !retire(m_jobs.size() - 1))
+            {
+                op_result = false;
+                break;
             }
+
+            // Check for incoming messages from a server. Stripes share one queue
+            while (op_result && finished_stripes < m_stripe_count && !m_messages_in.empty())
+            {
+                auto msg = m_messages_in.pop_front().msg;
+                op_result = dispatch(handlers, msg);
+            }
+
+            // The queue is drained, blocks filled so far are not held back any longer
+            if (op_result && !retire(m_jobs.size()))
+                op_result = false;
+
+            if (op_result)
+                verifyBlocks();
+        }
+
+        // The last blocks are verified once everything before them is applied
+        if (op_result)
+            op_result = retire(0);
+
+        if (op_result)
+        {
+            verifyBlocks();
+            op_result = retire(0);
+        }
+
+        // Also catches data that never came
+        if (op_result && (!drainStream() || !isComplete() || finishDigest() != expected_digest))
+        {
+            std::cerr << "Payload digest doesn't match. Aborting\n";
+            op_result = false;
         }
 
-        ofs.close();
+        m_writer.close();
+
+        // Keep the partial payload and its journal around for a later resume
+        if (op_result)
+            m_journal.remove();
 
         return op_result;
     }
 
+  private:
+    static constexpr uint64_t c_copy_piece_size = 256 * 1024;
+    static constexpr size_t c_max_jobs = 64;
+
+    // Runs on the session thread once its job is done
+    using Completion = std::function<bool()>;
+
+    struct Segment
+    {
+        uint64_t pos;
+        uint64_t size;
+        bool is_hole;
+    };
+
+    // Written, but not yet hashed into the stream digest
+    struct Unhashed
+    {
+        uint64_t size = 0;
+        bool is_hole = false;
+    };
+
+    // Block collecting its chunks and holes. Nothing is written before the whole block matches its leaf
+    struct PendingBlock
+    {
+        Common::Buffer data; // zero-filled, holes need no copying
+        uint64_t filled = 0;
+        std::vector<Segment> segments;
+    };
+
+    // Verification runs on the pool, its results are applied in submission order
+    template <class Job>
+    void submit(Job &&job)
+    {
+        m_jobs.push_back(m_pool.submit(std::forward<Job>(job)));
+    }
+
+    // Work without a pool side, applied in order with the jobs submitted before it
+    bool defer(Completion &&completion)
+    {
+        if (!makeRoom())
+            return false;
+
+        std::promise<Completion> ready;
+        ready.set_value(std::move(completion));
+        m_jobs.push_back(ready.get_future());
+        return true;
+    }
+
+    // Messages wait for a free job slot, so a slow disk holds the queue up instead of memory growing.
+    // Never called from a completion, that would apply later jobs ahead of it
+    bool makeRoom()
+    {
+        return m_jobs.size() < c_max_jobs || retire(c_max_jobs - 1);
+    }
+
+    // Applies finished jobs until at most `keep` are left, waiting for them if needed. Stops early on failure
+    bool retire(const size_t keep)
+    {
+        while (!m_jobs.empty())
+        {
+            if (m_jobs.size() <= keep && m_jobs.front().wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                break;
+
+            Completion completion;
+
+            try
+            {
+                completion = m_jobs.front().get();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Verification failed: " << e.what() << ". Aborting\n";
+                return false;
+            }
+
+            m_jobs.pop_front();
+
+            if (!completion())
+                return false;
+        }
+
+        return true;
+    }
+
+    // Pool side of a chunk: decoding, decompression and checksums. Only reads the settings, the CRC-32C is kept for the journal.
+    // Raw data is used in place: `data` keeps the whole message body and `pos` is where the data starts in it
+    Completion decodeChunk(Common::Message &&msg)
+    {
+        using namespace Common;
+
+        // A zlib stream per pool thread
+        thread_local ChunkDecompressor decompressor;
+
+        const ChunkData chunk = decode<EMessageType::Chunk>(msg);
+        const uint64_t offset = chunk.offset;
+        Buffer data;
+        size_t pos = 0;
+
+        if (!(chunk.flags & c_chunk_crc32c) && m_integrity == EIntegrity::Crc32c)
+        {
+            return [offset]()
+            {
+                std::cerr << "Chunk at " << offset << " has no checksum. Aborting\n";
+                return false;
+            };
+        }
+
+        // Only a sender that negotiated compression may send compressed chunks
+        if ((chunk.flags & c_chunk_compressed) && m_compression != ECompression::Zlib)
+        {
+            return [offset]()
+            {
+                std::cerr << "Chunk at " << offset << " is compressed, but compression is off. Aborting\n";
+                return false;
+            };
+        }
+
+        if (!(chunk.flags & c_chunk_compressed))
+        {
+            pos = static_cast<size_t>(chunk.data.data() - msg.body.data());
+            data = msg.body.takeBuffer();
+        }
+        else if (!decompressor.decompress(chunk.data.data(), chunk.data.size(), data, m_max_chunk_size))
+        {
+            return [offset]()
+            {
+                std::cerr << "Failed to decompress a chunk at " << offset << ". Aborting\n";
+                return false;
+            };
+        }
+
+        if (m_integrity == EIntegrity::Sha256)
+            return [this, offset, pos, data = std::move(data)]()
+            { return addData(offset, data.data() + pos, data.size() - pos); };
+
+        const uint32_t data_crc = crc32c(data.data() + pos, data.size() - pos);
+
+        if ((chunk.flags & c_chunk_crc32c) && data_crc != chunk.crc)
+            return []()
+            {
+                std::cerr << "Chunk checksums don't match. Aborting\n";
+                return false;
+            };
+
+        return [this, offset, pos, data_crc, data = std::move(data)]()
+        { return writeChunk(offset, data.data() + pos, data.size() - pos, data_crc); };
+    }
+
+    bool checkRange(uint64_t offset, uint64_t size) const
+    {
+        if (size > m_manifest.totalSize() || offset > m_manifest.totalSize() - size)
+        {
+            std::cerr << "Data at " << offset << " lies outside of the payload. Aborting\n";
+            return false;
+        }
+
+        return true;
+    }
+
+    // Copied bytes go the same way as received ones and are checked the same way
+    bool applyCopy(const Common::CopyData &copy)
+    {
+        if (copy.basis_offset > m_basis_size || copy.size > m_basis_size - copy.basis_offset)
+        {
+            std::cerr << "Copy range lies outside of the older copy. Aborting\n";
+            return false;
+        }
+
+        DBG_LOG("Copying ", copy.size, " bytes from ", copy.basis_offset, " of the older copy to ", copy.offset);
+
+        m_copy_buf.resize(std::min<uint64_t>(copy.size, c_copy_piece_size));
+        m_basis->seek(copy.basis_offset);
+
+        for (uint64_t done = 0; done < copy.size;)
+        {
+            const size_t n = m_basis->read(m_copy_buf.data(), std::min<uint64_t>(copy.size - done, m_copy_buf.size()));
+
+            if (n == 0)
+            {
+                std::cerr << "Older copy is shorter than it was. Aborting\n";
+                return false;
+            }
+
+            const bool added = m_integrity == Common::EIntegrity::Sha256 ? addData(copy.offset + done, m_copy_buf.data(), n)
+                                                                         : writeChunk(copy.offset + done, m_copy_buf.data(), n, Common::crc32c(m_copy_buf.data(), n));
+
+            if (!added)
+                return false;
+
+            done += n;
+        }
+
+        return true;
+    }
+
+    bool isComplete() const
+    {
+        if (m_integrity == Common::EIntegrity::Sha256)
+            return m_block_digest && m_block_digest->isComplete(m_manifest.totalSize());
+
+        return m_stream_digest && m_stream_digest->next() == m_manifest.totalSize() && m_unhashed.empty();
+    }
+
+    Common::Hash finishDigest()
+    {
+        return m_integrity == Common::EIntegrity::Sha256 ? m_block_digest->finish() : m_stream_digest->finish();
+    }
+
+    // Without a Merkle tree chunks are written as they come
+    bool writeChunk(uint64_t offset, const uint8_t *data, uint64_t size, uint32_t crc)
+    {
+        if (!checkRange(offset, size))
+            return false;
+
+        if (!m_writer.write(offset, data, size))
+        {
+            std::cerr << "Failed to write a chunk at " << offset << ". Aborting\n";
+            return false;
+        }
+
+        m_journal.appendCrc32c(offset, size, crc);
+
+        if (offset != m_stream_digest->next())
+        {
+            m_unhashed.emplace(offset, Unhashed{size, false});
+            return true;
+        }
+
+        m_stream_digest->addData(data, size);
+        return drainStream();
+    }
+
+    bool writeHole(uint64_t offset, uint64_t size)
+    {
+        if (!checkRange(offset, size) || !flushHoleSpan(offset, offset + size))
+            return false;
+
+        m_unhashed.emplace(offset, Unhashed{size, true});
+        return drainStream();
+    }
+
+    // Chunks of other stripes that arrived ahead of the digest are hashed from the output,
+    // a run of them at a time
+    bool drainStream()
+    {
+        if (!m_stream_digest)
+            return true;
+
+        while (!m_unhashed.empty() && m_unhashed.begin()->first == m_stream_digest->next())
+        {
+            auto it = m_unhashed.begin();
+
+            if (it->second.is_hole)
+            {
+                m_stream_digest->addHole(it->second.size);
+                m_unhashed.erase(it);
+                continue;
+            }
+
+            uint64_t size = 0;
+            for (auto run = it; run != m_unhashed.end() && !run->second.is_hole && run->first == it->first + size; run = m_unhashed.erase(run))
+                size += run->second.size;
+
+            m_readback_buf.resize(size);
+
+            if (!m_writer.flush())
+                return false;
+
+            m_readback.seek(it->first);
+
+            if (m_readback.read(m_readback_buf.data(), size) != size)
+            {
+                std::cerr << "Failed to read back the output. Aborting\n";
+                return false;
+            }
+
+            m_stream_digest->addData(m_readback_buf.data(), size);
+        }
+
+        return true;
+    }
+
+    bool addData(uint64_t offset, const uint8_t *data, uint64_t size)
+    {
+        if (!checkRange(offset, size))
+            return false;
+
+        while (size > 0)
+        {
+            const uint64_t index = offset / m_verifier.blockSize();
+            const uint64_t pos = offset - index * m_verifier.blockSize();
+            const uint64_t n = std::min(size, m_verifier.blockLength(index) - pos);
+
+            PendingBlock *block = pendingBlock(index);
+            if (!block)
+                return false;
+
+            std::copy_n(data, n, block->data.begin() + pos);
+
+            if (!addSegment(index, *block, Segment{pos, n, false}))
+                return false;
+
+            offset += n;
+            data += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    // Blocks that are holes as a whole never get a buffer: zeros hash to a known leaf
+    bool addHole(uint64_t offset, uint64_t size)
+    {
+        using namespace Common;
+
+        if (!checkRange(offset, size))
+            return false;
+
+        uint64_t span_start = offset;
+        uint64_t span_end = offset;
+
+        while (size > 0)
+        {
+            const uint64_t index = offset / m_verifier.blockSize();
+            const uint64_t pos = offset - index * m_verifier.blockSize();
+            const uint64_t length = m_verifier.blockLength(index);
+            const uint64_t n = std::min(size, length - pos);
+
+            if (pos == 0 && n == length && m_blocks.count(index) == 0)
+            {
+                const Hash *leaf = m_verifier.leaf(index);
+
+                if (!leaf || *leaf != m_verifier.zeroLeaf(length))
+                {
+                    std::cerr << "Hole block " << index << " doesn't match the Merkle tree. Aborting\n";
+                    return false;
+                }
+
+                m_block_digest->add(offset, length, *leaf);
+                m_verifier.retire(index);
+                span_end = offset + n;
+            }
+            else
+            {
+                if (!flushHoleSpan(span_start, span_end))
+                    return false;
+
+                span_start = span_end = offset + n;
+
+                PendingBlock *block = pendingBlock(index);
+                if (!block || !addSegment(index, *block, Segment{pos, n, true}))
+                    return false;
+            }
+
+            offset += n;
+            size -= n;
+        }
+
+        return flushHoleSpan(span_start, span_end);
+    }
+
+    bool flushHoleSpan(uint64_t start, uint64_t end)
+    {
+        if (start == end)
+            return true;
+
+        if (!m_writer.hole(start, end - start))
+        {
+            std::cerr << "Failed to leave a hole at " << start << ". Aborting\n";
+            return false;
+        }
+
+        m_journal.appendHole(start, end - start);
+        return true;
+    }
+
+    // Only blocks a proof vouches for get a buffer, so a peer can't make the receiver hold arbitrary data
+    PendingBlock *pendingBlock(uint64_t index)
+    {
+        if (!m_verifier.leaf(index))
+        {
+            std::cerr << "Block " << index << " arrived without a proof. Aborting\n";
+            return nullptr;
+        }
+
+        PendingBlock &block = m_blocks[index];
+
+        if (block.data.empty())
+            block.data.resize(m_verifier.blockLength(index));
+
+        return &block;
+    }
+
+    bool addSegment(uint64_t index, PendingBlock &block, const Segment &segment)
+    {
+        block.segments.push_back(segment);
+        block.filled += segment.size;
+
+        if (block.filled < block.data.size())
+            return true;
+
+        if (block.filled > block.data.size())
+        {
+            std::cerr << "Block " << index << " got more data than it holds. Aborting\n";
+            return false;
+        }
+
+        m_filled.push_back(index);
+
+        if (m_filled.size() >= Common::c_merkle_batch_blocks)
+            verifyBlocks();
+
+        return true;
+    }
+
+    // Filled blocks are checked a batch at a time, their leaves are hashed together on the pool
+    void verifyBlocks()
+    {
+        if (m_filled.empty())
+            return;
+
+        std::vector<std::pair<uint64_t, PendingBlock>> blocks;
+
+        for (const uint64_t index : m_filled)
+            blocks.emplace_back(index, std::move(m_blocks.extract(index).mapped()));
+
+        m_filled.clear();
+
+        submit([this, blocks = std::move(blocks)]() mutable
+               {
+                   std::vector<Common::Hash> digests = hashBlocks(blocks);
+                   return Completion{[this, blocks = std::move(blocks), digests = std::move(digests)]()
+                                     { return writeBlocks(blocks, digests); }}; });
+    }
+
+    static std::vector<Common::Hash> hashBlocks(const std::vector<std::pair<uint64_t, PendingBlock>> &blocks)
+    {
+        using namespace Common;
+
+        std::vector<Sha256Input> inputs;
+        std::vector<Hash> digests(blocks.size());
+
+        for (const auto &[index, block] : blocks)
+            inputs.push_back(Sha256Input{block.data.data(), block.data.size(), c_merkle_leaf_prefix});
+
+        sha256_batch(inputs.data(), inputs.size(), digests.data());
+        return digests;
+    }
+
+    bool writeBlocks(const std::vector<std::pair<uint64_t, PendingBlock>> &blocks, const std::vector<Common::Hash> &digests)
+    {
+        using namespace Common;
+
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            const auto &[index, block] = blocks[i];
+            const Hash *leaf = m_verifier.leaf(index);
+
+            if (!leaf || digests[i] != *leaf)
+            {
+                std::cerr << "Block " << index << " doesn't match the Merkle tree. Aborting\n";
+                return false;
+            }
+
+            if (!writeBlock(index, block))
+                return false;
+        }
+
+        // The journal must never get ahead of the data
+        if (!m_writer.flush())
+        {
+            std::cerr << "Failed to write blocks. Aborting\n";
+            return false;
+        }
+
+        for (const auto &[index, block] : blocks)
+        {
+            const uint64_t start = index * m_verifier.blockSize();
+            const Hash &leaf = *m_verifier.leaf(index);
+
+            const bool is_hole = std::all_of(block.segments.begin(), block.segments.end(), [](const Segment &segment)
+                                             { return segment.is_hole; });
+
+            if (is_hole)
+                m_journal.appendHole(start, block.data.size());
+            else
+                m_journal.append(start, block.data.size(), leaf);
+
+            m_block_digest->add(start, block.data.size(), leaf);
+            m_verifier.retire(index);
+        }
+
+        m_journal.flush();
+        return true;
+    }
+
+    bool writeBlock(uint64_t index, const PendingBlock &block)
+    {
+        const uint64_t start = index * m_verifier.blockSize();
+
+        for (const Segment &segment : block.segments)
+        {
+            const bool written = segment.is_hole ? m_writer.hole(start + segment.pos, segment.size)
+                                                 : m_writer.write(start + segment.pos, block.data.data() + segment.pos, segment.size);
+
+            if (!written)
+            {
+                std::cerr << "Failed to write a block at " << start << ". Aborting\n";
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool openOutput(uint64_t offset)
+    {
+        using namespace Common;
+
+        if (!m_writer.prepare(offset) || !m_journal.open(offset))
+        {
+            std::cerr << "Error opening file: " << m_file << std::endl;
+            Message failed_msg = encode<EMessageType::FailedReceive>(Empty{});
+            m_sendcb(std::move(failed_msg));
+
+            return false;
+        }
+
+        return true;
+    }
+
   private:
     const std::filesystem::path m_file;
+    const Common::Manifest &m_manifest;
+    Common::PayloadWriter m_writer;
+    Common::PayloadReader m_readback;
+    Common::Buffer m_readback_buf;
+    Common::ResumeJournal &m_journal;
+    Common::MerkleVerifier &m_verifier;
+    const Common::EIntegrity m_integrity;
+    const Common::ECompression m_compression;
+    std::map<uint64_t, PendingBlock> m_blocks;
+    std::vector<uint64_t> m_filled;
+    std::optional<Common::PayloadDigest> m_block_digest;
+    std::optional<Common::StreamDigest> m_stream_digest;
+    std::map<uint64_t, Unhashed> m_unhashed;
+    const std::filesystem::path m_basis_path;
+    const uint64_t m_basis_size;
+    std::optional<Common::Manifest> m_basis_manifest;
+    std::optional<Common::PayloadReader> m_basis;
+    Common::Buffer m_copy_buf;
+    const uint8_t m_stripe_count;
+    const uint64_t m_max_chunk_size;
     std::function<void(Common::Message &&)> m_sendcb;
+    std::deque<std::future<Completion>> m_jobs;
+    Common::WorkerPool m_pool;
 };
 
 class ClientSenderSession : public ClientSession
 {
   public:
-    ClientSenderSession(Common::EPayloadType payload_type, Net::TSQueue<Net::OwnedMessage<Common::EMessageType>> &messages_in, const std::filesystem::path &file, const uint64_t chunksize, const std::function<bool(Common::Message &&)> sendcb)
-        : ClientSession(payload_type, messages_in), m_file{file}, m_max_chunk_size{chunksize}, m_sendcb{sendcb}
+    // sendcb gets the index of the stripe the message has to go through
+    ClientSenderSession(Common::EPayloadType payload_type, Net::TSQueue<Net::OwnedMessage<Common::EMessageType>> &messages_in, const std::filesystem::path &file, const Common::Manifest &manifest, const Common::MerkleTree &tree, const Common::DeltaPlan &delta, const std::vector<bool> &cached, const uint64_t chunksize, const Common::ResumeData &resume, const uint8_t stripe_count, const Common::ECompression compression, const Common::EIntegrity integrity, const std::function<bool(uint8_t, Common::Message &&)> sendcb)
+        : ClientSession(payload_type, messages_in), m_file{file}, m_manifest{manifest}, m_tree{tree}, m_delta{delta}, m_cached{cached}, m_max_chunk_size{chunksize}, m_resume{resume}, m_stripe_count{stripe_count}, m_integrity{integrity}, m_compressor{compression}, m_sendcb{sendcb}
     {
     }
 
@@ -151,15 +834,40 @@ class ClientSenderSession : public ClientSession
         DBG_LOG(__PRETTY_FUNCTION__);
         if (!std::filesystem::exists(m_file))
         {
-            std::cerr << "File " << m_file << " doesn't exist\n";
-            return false;
+            std::cerr << "File " << m_file << " doesn't exist\n";
+            return false;
+        }
+
+        PayloadReader reader(m_file, m_manifest);
+
+        ResumeData resume = acceptResume(reader);
+        reader.seek(resume.offset);
+
+        // The receiver may only expect Copy messages if there are any
+        resume.basis_size = m_delta.empty() ? 0 : m_resume.basis_size;
+
+        // Without a tree the digest covers the data itself, with one it covers the leaves
+        const bool merkle = m_integrity == EIntegrity::Sha256;
+        std::optional<PayloadDigest> block_digest;
+        std::optional<StreamDigest> stream_digest;
+
+        if (merkle)
+            block_digest.emplace(resume.offset, resume.digest);
+        else
+            stream_digest.emplace(resume.offset, resume.digest);
+
+        DBG_LOG("Sending Resume from offset ", resume.offset);
+        for (uint8_t stripe = 0; stripe < m_stripe_count; ++stripe)
+        {
+            if (!m_sendcb(stripe, encode<EMessageType::Resume>(resume)))
+                return false;
         }
 
-        std::ifstream ifs(m_file, std::ios::binary);
-
         bool op_result = true;
+        uint64_t file_offset = resume.offset;
+        uint64_t batch_index = 0;
 
-        while (ifs && op_result)
+        while (op_result && file_offset < m_manifest.totalSize())
         {
             // Check for incoming messages from a server
             while (!m_messages_in.empty())
@@ -171,6 +879,13 @@ class ClientSenderSession : public ClientSession
                     op_result = false;
                     break;
                 }
+                else if (incoming_msg.header.id == EMessageType::Refill)
+                {
+                    op_result = refill(incoming_msg);
+
+                    if (!op_result)
+                        break;
+                }
                 else
                 {
                     DBG_LOG("Skipped an unknown message from the server with header ", static_cast<uint32_t>(incoming_msg.header.id));
@@ -180,52 +895,297 @@ class ClientSenderSession : public ClientSession
             if (!op_result)
                 break;
 
-            const auto offset = SHA256_DIGEST_LENGTH;
+            // Batches are dealt to the stripes round-robin, a proof goes ahead of its blocks on the same stripe
+            const uint8_t stripe = static_cast<uint8_t>(batch_index++ % m_stripe_count);
+
+            if (!merkle)
+            {
+                const uint64_t batch_end = std::min(file_offset + c_stream_batch_size, m_manifest.totalSize());
+                op_result = sendBatch(reader, stripe, file_offset, batch_end, &*stream_digest);
+                continue;
+            }
+
+            uint64_t block = file_offset / m_tree.blockSize();
+            const uint64_t count = m_tree.batchSize(block);
+
+            if (!m_sendcb(stripe, encode<EMessageType::Proof>(m_tree.prove(block, count))))
+            {
+                DBG_LOG(__PRETTY_FUNCTION__, " failed to send message");
+                op_result = false;
+                break;
+            }
+
+            const uint64_t batch_end = std::min((block + count) * m_tree.blockSize(), m_manifest.totalSize());
+            op_result = sendBatch(reader, stripe, file_offset, batch_end, nullptr);
+
+            for (uint64_t end = block + count; block < end; ++block)
+                block_digest->add(block * m_tree.blockSize(), merkle_block_length(block, m_manifest.totalSize(), m_tree.blockSize()), m_tree.leaf(block));
+        }
+
+        DBG_LOG("Sending FinalChunk");
+        const FinalChunkData final_chunk{merkle ? block_digest->finish() : stream_digest->finish()};
+
+        for (uint8_t stripe = 0; stripe < m_stripe_count; ++stripe)
+        {
+            Message final_msg = encode<EMessageType::FinalChunk>(final_chunk);
+            m_sendcb(stripe, std::move(final_msg));
+        }
+
+        if (op_result && file_offset != m_manifest.totalSize())
+        {
+            std::cerr << "Sent " << file_offset << " bytes instead of " << m_manifest.totalSize() << ". Was the payload modified?\n";
+            op_result = false;
+        }
+
+        return op_result;
+    }
+
+    // Blocks the server's cache failed to give after all. They are sent again on the stripe their Cached went
+    // through, followed by the Refill itself
+    bool refill(Common::Message &msg)
+    {
+        using namespace Common;
+
+        if (msg.size() != sizeof(CachedData))
+            return false;
+
+        const CachedData blocks = decode<EMessageType::Refill>(msg);
+        auto run = m_cached_runs.upper_bound(blocks.first_block);
+
+        if (run == m_cached_runs.begin())
+            return false;
+
+        --run;
+        const uint64_t run_end = run->first + run->second.block_count;
+
+        if (blocks.first_block >= run_end || blocks.block_count == 0 || blocks.block_count > run_end - blocks.first_block)
+        {
+            std::cerr << "Server asked for blocks it wasn't sent as cached\n";
+            return false;
+        }
+
+        for (uint64_t block = blocks.first_block; block < blocks.first_block + blocks.block_count; ++block)
+            m_cached[block] = false;
+
+        uint64_t file_offset = blocks.first_block * m_tree.blockSize();
+        const uint64_t end = std::min((blocks.first_block + blocks.block_count) * m_tree.blockSize(), m_manifest.totalSize());
+
+        PayloadReader reader(m_file, m_manifest);
+        reader.seek(file_offset);
 
+        DBG_LOG("Sending ", blocks.block_count, " cached blocks from ", blocks.first_block, " again");
+        return sendBatch(reader, run->second.stripe, file_offset, end, nullptr) && m_sendcb(run->second.stripe, encode<EMessageType::Refill>(blocks));
+    }
+
+  private:
+    struct CachedRun
+    {
+        uint64_t block_count;
+        uint8_t stripe;
+    };
+
+    // Payload bytes per stripe turn when there is no tree to batch by
+    static constexpr uint64_t c_stream_batch_size = uint64_t{Common::c_merkle_batch_blocks} * Common::c_merkle_block_size;
+
+    // Chunks and holes of the stream up to batch_end. Chunks never cross it, holes only do without a tree.
+    // stream_digest is fed the uncompressed data when there is no tree
+    bool sendBatch(Common::PayloadReader &reader, const uint8_t stripe, uint64_t &file_offset, const uint64_t batch_end, Common::StreamDigest *stream_digest)
+    {
+        using namespace Common;
+
+        while (file_offset < batch_end)
+        {
             Message msg;
-            msg.body = std::vector<std::uint8_t>(m_max_chunk_size);
 
-            ifs.read(reinterpret_cast<char *>(msg.body.data()), msg.body.size());
+            // Holes of sparse files are described instead of being sent as zeros
+            if (uint64_t hole = reader.skipHole(); hole > 0)
+            {
+                if (!stream_digest && file_offset + hole > batch_end)
+                {
+                    hole = batch_end - file_offset;
+                    reader.seek(batch_end);
+                }
 
-            const std::streamsize n = ifs.gcount();
+                if (stream_digest)
+                    stream_digest->addHole(hole);
 
-            if (n > 0)
+                msg = encode<EMessageType::Hole>(HoleData{file_offset, hole});
+                DBG_LOG("Sending Hole of size ", hole, " at ", file_offset);
+                file_offset += hole;
+            }
+            // What the receiver's older copy has is taken from there
+            else if (const DeltaPlan::Range *range = m_delta.find(file_offset))
             {
-                msg.header.id = EMessageType::Chunk;
-                msg.body.resize(static_cast<size_t>(n));
-                msg.header.size = msg.body.size();
+                uint64_t size = range->offset + range->size - file_offset;
 
-                Hash hash = sha256_chunk(msg.body);
-                msg << hash;
+                if (!stream_digest)
+                    size = std::min(size, batch_end - file_offset);
 
-                DBG_LOG("Sending Chunk of size ", msg.size() - offset);
+                if (!skipCopied(reader, file_offset, size, stream_digest))
+                    return false;
+
+                msg = encode<EMessageType::Copy>(CopyData{file_offset, range->basis_offset + (file_offset - range->offset), size});
+                DBG_LOG("Sending Copy of size ", size, " at ", file_offset);
+                file_offset += size;
+            }
+            // Blocks the server already has are not uploaded again
+            else if (const uint64_t count = cachedRun(file_offset, batch_end); count > 0)
+            {
+                const uint64_t first = file_offset / m_tree.blockSize();
+                const uint64_t end = std::min((first + count) * m_tree.blockSize(), m_manifest.totalSize());
+
+                reader.seek(end);
+                m_cached_runs[first] = CachedRun{count, stripe};
+                msg = encode<EMessageType::Cached>(CachedData{first, count});
+                DBG_LOG("Sending Cached for ", count, " blocks from ", first);
+                file_offset = end;
             }
             else
             {
-                break;
+                // The data is read in right behind room left for the other fields of the chunk
+                const size_t header_size = m_integrity == EIntegrity::Crc32c ? c_chunk_overhead : c_chunk_header_size;
+                const size_t want = static_cast<size_t>(std::min<uint64_t>({m_max_chunk_size, batch_end - file_offset, m_delta.nextStart(file_offset) - file_offset}));
+
+                msg.body.resize(header_size + want);
+                const size_t n = reader.readData(msg.body.data() + header_size, want);
+
+                if (n == 0)
+                {
+                    std::cerr << "Payload ended at " << file_offset << ". Was the payload modified?\n";
+                    return false;
+                }
+
+                msg.body.resize(header_size + n);
+                const uint8_t *data = msg.body.data() + header_size;
+
+                if (stream_digest)
+                    stream_digest->addData(data, n);
+
+                ChunkData chunk{file_offset, 0, 0, {}};
+
+                if (m_integrity == EIntegrity::Crc32c)
+                {
+                    chunk.crc = crc32c(data, n);
+                    chunk.flags |= c_chunk_crc32c;
+                }
+
+                if (m_compressor.compress(data, n, m_compressed))
+                {
+                    chunk.flags |= c_chunk_compressed;
+                    msg.body.resize(header_size);
+                    msg.body.append(m_compressed.data(), m_compressed.size());
+                }
+
+                // Without data the chunk encodes to exactly its header
+                const Message header = encode<EMessageType::Chunk>(chunk);
+                std::copy(header.body.begin(), header.body.end(), msg.body.begin());
+
+                msg.header.id = EMessageType::Chunk;
+                msg.header.size = msg.body.size();
+                file_offset += n;
+
+                DBG_LOG("Sending Chunk of size ", msg.size() - header_size);
             }
 
-            if (!m_sendcb(std::move(msg)))
+            if (!m_sendcb(stripe, std::move(msg)))
             {
                 DBG_LOG(__PRETTY_FUNCTION__, " failed to send message");
-                op_result = false;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Cached blocks from `offset` on that end before `end`. Only whole blocks count, and none the older copy has
+    uint64_t cachedRun(const uint64_t offset, const uint64_t end) const
+    {
+        if (m_cached.empty() || offset % m_tree.blockSize() != 0)
+            return 0;
+
+        const uint64_t first = offset / m_tree.blockSize();
+        uint64_t count = 0;
+
+        for (uint64_t block = first; block < m_cached.size() && m_cached[block] && block * m_tree.blockSize() < end; ++block, ++count)
+        {
+            const uint64_t start = block * m_tree.blockSize();
+            const uint64_t block_end = std::min(start + m_tree.blockSize(), m_manifest.totalSize());
+
+            if (m_delta.find(start) || m_delta.nextStart(start) < block_end)
                 break;
+        }
+
+        return count;
+    }
+
+    // Copied bytes are not sent, but without a tree the digest still has to cover them
+    bool skipCopied(Common::PayloadReader &reader, const uint64_t file_offset, const uint64_t size, Common::StreamDigest *stream_digest)
+    {
+        if (!stream_digest)
+        {
+            reader.seek(file_offset + size);
+            return true;
+        }
+
+        Common::Buffer buf(std::min<uint64_t>(size, c_stream_batch_size));
+
+        for (uint64_t left = size; left > 0;)
+        {
+            const size_t n = reader.read(buf.data(), std::min<uint64_t>(left, buf.size()));
+
+            if (n == 0)
+            {
+                std::cerr << "Payload ended at " << file_offset + size - left << ". Was the payload modified?\n";
+                return false;
             }
+
+            stream_digest->addData(buf.data(), n);
+            left -= n;
         }
 
-        DBG_LOG("Sending FinalChunk");
-        Message final_msg = encode<EMessageType::FinalChunk>(Empty{});
-        m_sendcb(std::move(final_msg));
+        return true;
+    }
+
+    // The receiver's partial payload is only trusted if it matches our own prefix
+    Common::ResumeData acceptResume(Common::PayloadReader &reader) const
+    {
+        using namespace Common;
 
-        ifs.close();
+        if (m_resume.offset == 0 || m_resume.offset > m_manifest.totalSize())
+            return ResumeData{};
 
-        return op_result;
+        // With a tree the receiver only keeps whole blocks
+        if (m_integrity == EIntegrity::Sha256 && m_resume.offset % m_tree.blockSize() != 0 && m_resume.offset != m_manifest.totalSize())
+            return ResumeData{};
+
+        reader.seek(0);
+        const Hash digest = sha256_prefix([&reader](uint8_t *data, size_t size)
+                                          { return reader.read(data, size); },
+                                          m_resume.offset);
+
+        if (digest != m_resume.digest)
+        {
+            DBG_LOG("Receiver's partial file doesn't match. Sending from the start");
+            return ResumeData{};
+        }
+
+        return m_resume;
     }
 
   private:
     const std::filesystem::path m_file;
+    const Common::Manifest &m_manifest;
+    const Common::MerkleTree &m_tree;
+    const Common::DeltaPlan &m_delta;
+    std::vector<bool> m_cached;                  // blocks the server has, until it asks for them again
+    std::map<uint64_t, CachedRun> m_cached_runs; // first block -> run sent as Cached
     const uint64_t m_max_chunk_size;
-    std::function<bool(Common::Message &&)> m_sendcb;
+    const Common::ResumeData m_resume;
+    const uint8_t m_stripe_count;
+    const Common::EIntegrity m_integrity;
+    Common::ChunkCompressor m_compressor;
+    Common::Buffer m_compressed; // reused by every chunk
+    std::function<bool(uint8_t, Common::Message &&)> m_sendcb;
 };
 
 class ServerSession : public Session
@@ -241,6 +1201,18 @@ class ServerSession : public Session
 
   public:
     virtual bool onMessage(Common::Message &&msg) = 0;
+
+    // True while the session waits for work done off the server thread, which is polled for it then.
+    // poll() goes on with what finished meanwhile, false aborts the transfer
+    virtual bool isWaiting() const
+    {
+        return false;
+    }
+
+    virtual bool poll()
+    {
+        return true;
+    }
 };
 
 class ServerOneToOneRetranslatorSession : public ServerSession
@@ -261,7 +1233,7 @@ class ServerOneToOneRetranslatorSession : public ServerSession
 
         DBG_LOG(__PRETTY_FUNCTION__, " msg type: ", (int)msg.header.id);
 
-        if (msg.header.id == EMessageType::Chunk || msg.header.id == EMessageType::FinalChunk || msg.header.id == EMessageType::Abort)
+        if (msg.header.id == EMessageType::Chunk || msg.header.id == EMessageType::Hole || msg.header.id == EMessageType::Proof || msg.header.id == EMessageType::Copy || msg.header.id == EMessageType::FinalChunk || msg.header.id == EMessageType::Abort || msg.header.id == EMessageType::Resume)
         {
             if (!m_sink->send(std::move(msg)))
             {
@@ -279,6 +1251,253 @@ class ServerOneToOneRetranslatorSession : public ServerSession
     ConnectionPtr m_sink;
 };
 
+// Relays like its base. Blocks it sees whole go into the chunk cache, Cached runs are sent to the sink from there.
+// Cached blocks are read on the reader pool, and what the sender sends after them waits until they are relayed.
+// A block the cache fails to give is asked from the sender with a Refill. A block size of 0 turns all of it off
+class ServerCachingRetranslatorSession : public ServerOneToOneRetranslatorSession
+{
+  public:
+    ServerCachingRetranslatorSession(const uint64_t file_size, const uint32_t max_chunk_size, ConnectionPtr source, ConnectionPtr sink, Common::ChunkCache &cache, Common::WorkerPool &readers, Common::WorkerPool &collectors, const uint32_t block_size, std::shared_ptr<const Common::CacheLease> lease)
+        : ServerOneToOneRetranslatorSession(file_size, max_chunk_size, sink), m_total_size{file_size}, m_max_chunk_size{max_chunk_size}, m_source{source}, m_cache{cache}, m_readers{readers}, m_collectors{collectors}, m_block_size{block_size}, m_lease{std::move(lease)}
+    {
+    }
+
+    bool onMessage(Common::Message &&msg) override
+    {
+        using namespace Common;
+
+        if (m_block_size == 0)
+            return ServerOneToOneRetranslatorSession::onMessage(std::move(msg));
+
+        switch (msg.header.id)
+        {
+        case EMessageType::Cached:
+            return readCached(decode<EMessageType::Cached>(msg)) && poll();
+        case EMessageType::Refill:
+            return refilled(decode<EMessageType::Refill>(msg)) && poll();
+        case EMessageType::Abort:
+            m_pending.clear();
+            m_open_refills = 0;
+            return ServerOneToOneRetranslatorSession::onMessage(std::move(msg));
+        case EMessageType::Chunk:
+            collect(msg);
+            break;
+        default:
+            break;
+        }
+
+        if (Pending *refill = refillOf(msg))
+        {
+            refill->refilled.push_back(std::move(msg));
+            return true;
+        }
+
+        if (m_pending.empty())
+            return ServerOneToOneRetranslatorSession::onMessage(std::move(msg));
+
+        m_pending.push_back(Pending{EPending::Relay, std::move(msg)});
+        return true;
+    }
+
+    bool isWaiting() const override
+    {
+        return !m_pending.empty() && m_pending.front().kind == EPending::Read;
+    }
+
+    // Relays what is no longer waiting for a read or a refill
+    bool poll() override
+    {
+        using namespace Common;
+        using namespace std::chrono_literals;
+
+        while (!m_pending.empty())
+        {
+            Pending &front = m_pending.front();
+
+            if (front.kind == EPending::Read)
+            {
+                if (front.data.wait_for(0s) != std::future_status::ready)
+                    return true;
+
+                const std::shared_ptr<const Buffer> data = front.data.get();
+
+                if (!data || data->size() != merkle_block_length(front.block, m_total_size, m_block_size))
+                {
+                    DBG_LOG("[CACHE] block ", front.block, " can't be served, asking the sender");
+                    front.kind = EPending::Refill;
+                    ++m_open_refills;
+
+                    if (!m_source->send(encode<EMessageType::Refill>(CachedData{front.block, 1})))
+                        return false;
+                }
+                else if (!serveBlock(front.block, *data))
+                {
+                    return false;
+                }
+            }
+
+            if (front.kind == EPending::Refill)
+            {
+                if (!front.complete)
+                    return true;
+
+                for (Message &refilled : front.refilled)
+                {
+                    if (!ServerOneToOneRetranslatorSession::onMessage(std::move(refilled)))
+                        return false;
+                }
+            }
+
+            if (front.kind == EPending::Relay && !ServerOneToOneRetranslatorSession::onMessage(std::move(front.msg)))
+                return false;
+
+            m_pending.pop_front();
+        }
+
+        return true;
+    }
+
+  private:
+    enum class EPending
+    {
+        Relay,  // a message of the sender
+        Read,   // a cached block being read
+        Refill, // a cached block the sender sends again
+    };
+
+    struct Pending
+    {
+        EPending kind;
+        Common::Message msg{};
+        uint64_t block = 0;
+        std::future<std::shared_ptr<const Common::Buffer>> data{};
+        std::vector<Common::Message> refilled{};
+        bool complete = false; // the sender ended the refill
+    };
+
+  private:
+    bool readCached(const Common::CachedData &cached)
+    {
+        using namespace Common;
+
+        if (cached.block_count > c_cache_query_blocks)
+            return false;
+
+        for (uint64_t i = 0; i < cached.block_count; ++i)
+        {
+            const uint64_t block = cached.first_block + i;
+            const CacheLease::Block *entry = m_lease->find(block);
+
+            // Only blocks the cache promised to this transfer
+            if (!entry || block * m_block_size >= m_total_size)
+            {
+                DBG_LOG("[CACHE] block ", block, " wasn't promised");
+                return false;
+            }
+
+            m_pending.push_back(Pending{EPending::Read, {}, block, m_cache.fetch(entry->key, entry->leaf, m_readers)});
+        }
+
+        return true;
+    }
+
+    // The sender's Refill echo ends the blocks it sent again
+    bool refilled(const Common::CachedData &refill)
+    {
+        for (Pending &pending : m_pending)
+        {
+            if (pending.kind == EPending::Refill && !pending.complete && pending.block == refill.first_block && refill.block_count == 1)
+            {
+                pending.complete = true;
+                --m_open_refills;
+                return true;
+            }
+        }
+
+        DBG_LOG("[CACHE] unexpected refill of block ", refill.first_block);
+        return false;
+    }
+
+    // Open refill a message of the sender belongs to. Refills are whole blocks, none of their messages cross one
+    Pending *refillOf(Common::Message &msg)
+    {
+        using namespace Common;
+
+        if (m_open_refills == 0)
+            return nullptr;
+
+        uint64_t offset = 0;
+
+        if (msg.header.id == EMessageType::Chunk || msg.header.id == EMessageType::Hole || msg.header.id == EMessageType::Copy)
+            msg >> offset;
+        else
+            return nullptr;
+
+        msg.read_pos = 0;
+
+        for (Pending &pending : m_pending)
+        {
+            if (pending.kind == EPending::Refill && !pending.complete && pending.block == offset / m_block_size)
+                return &pending;
+        }
+
+        return nullptr;
+    }
+
+    bool serveBlock(const uint64_t block, const Common::Buffer &data)
+    {
+        using namespace Common;
+
+        const uint64_t start = block * m_block_size;
+
+        for (uint64_t pos = 0; pos < data.size(); pos += m_max_chunk_size)
+        {
+            const uint64_t n = std::min<uint64_t>(m_max_chunk_size, data.size() - pos);
+
+            Message chunk = encode<EMessageType::Chunk>(ChunkData{start + pos, 0, 0, Net::ByteView(data.data() + pos, n)});
+
+            if (!ServerOneToOneRetranslatorSession::onMessage(std::move(chunk)))
+                return false;
+        }
+
+        return true;
+    }
+
+    // The chunk goes to the collector as is, its body is shared with the relayed one
+    void collect(Common::Message &msg)
+    {
+        using namespace Common;
+
+        if (!m_collector)
+        {
+            if (!m_lease || !m_lease->owner())
+                return;
+
+            m_collector = std::make_shared<CacheCollector>(m_cache, *m_lease->owner(), m_total_size, m_max_chunk_size, m_block_size);
+        }
+
+        if (!m_collector->reserve(msg.body.size()))
+            return;
+
+        msg.body.share();
+        m_collectors.submit([collector = m_collector, chunk = msg]() mutable
+                            { collector->add(std::move(chunk)); });
+    }
+
+  private:
+    const uint64_t m_total_size;
+    const uint32_t m_max_chunk_size;
+    ConnectionPtr m_source;
+    Common::ChunkCache &m_cache;
+    Common::WorkerPool &m_readers;
+    Common::WorkerPool &m_collectors;
+    const uint32_t m_block_size;
+    std::shared_ptr<const Common::CacheLease> m_lease;
+    std::shared_ptr<Common::CacheCollector> m_collector;
+    std::deque<Pending> m_pending; // relayed in order, the front first
+    size_t m_open_refills = 0;
+};
+
 class ServerSaveFileSession : public ServerSession
 {
   public:
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Multi-buffer SHA-256: independent messages are hashed side by side, one per SIMD lane
+// (AVX2, AVX-512) or interleaved through the SHA extensions so their latencies overlap.
+// Only the kernels live here, sha256_batch() in hash.hpp picks one and falls back to OpenSSL
+
+// One message of a batch: an optional domain-separation byte followed by the data
+struct Sha256Input
+{
+    const void *data = nullptr;
+    size_t size = 0;
+    std::optional<uint8_t> prefix;
+};
+
+namespace detail
+{
+using Sha256Digest = std::array<uint8_t, 32>;
+using Sha256BatchImpl = void (*)(const Sha256Input *, size_t, Sha256Digest *);
+
+// Kernels only pay off when most of their lanes have work
+struct Sha256BatchKernel
+{
+    Sha256BatchImpl hash = nullptr;
+    size_t min_batch = 0;
+};
+
+alignas(64) constexpr uint32_t c_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+constexpr uint32_t c_sha256_iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+inline uint32_t sha256_load_be32(const uint8_t *p)
+{
+    uint32_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return __builtin_bswap32(word);
+}
+
+inline size_t sha256_block_count(const Sha256Input &in)
+{
+    const uint64_t length = in.size + (in.prefix ? 1 : 0);
+    return static_cast<size_t>((length + 8) / 64 + 1);
+}
+
+// Block `index` of the padded message. Blocks that lie wholly in the data are read in place and
+// `run` says how many follow, the first one (with the prefix) and the padded tail go through `staging`
+inline const uint8_t *sha256_block(const Sha256Input &in, const size_t index, uint8_t *staging, size_t &run)
+{
+    const uint8_t *data = static_cast<const uint8_t *>(in.data);
+    const uint64_t head = in.prefix ? 1 : 0;
+    const uint64_t length = head + in.size;
+    const uint64_t begin = uint64_t{index} * 64;
+
+    if (begin >= head && begin + 64 <= length)
+    {
+        run = static_cast<size_t>((length - begin) / 64);
+        return data + (begin - head);
+    }
+
+    run = 1;
+    std::memset(staging, 0, 64);
+
+    uint64_t pos = begin;
+    if (pos < head && pos < length)
+        staging[pos++ - begin] = *in.prefix;
+
+    if (pos < length)
+        std::memcpy(staging + (pos - begin), data + (pos - head), static_cast<size_t>(std::min(begin + 64, length) - pos));
+
+    if (length >= begin && length < begin + 64)
+        staging[length - begin] = 0x80;
+
+    if (index + 1 == sha256_block_count(in))
+    {
+        const uint64_t bits = length * 8;
+        for (int i = 0; i < 8; ++i)
+            staging[56 + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    }
+
+    return staging;
+}
+
+// Feeds messages to the lanes of a kernel as they free up. State is kept transposed, a word per lane
+template <size_t Lanes, void (*Compress)(uint32_t (&)[8][Lanes], const uint8_t *const (&)[Lanes], size_t)>
+void sha256_schedule(const Sha256Input *inputs, const size_t count, Sha256Digest *out)
+{
+    uint32_t state[8][Lanes];
+    size_t message[Lanes];
+    size_t position[Lanes];
+    size_t total[Lanes];
+    bool active[Lanes] = {};
+    alignas(64) uint8_t staging[Lanes][64];
+
+    size_t next = 0;
+
+    while (true)
+    {
+        const uint8_t *blocks[Lanes];
+        size_t steps = SIZE_MAX;
+        size_t first_active = Lanes;
+
+        for (size_t lane = 0; lane < Lanes; ++lane)
+        {
+            if (!active[lane] && next < count)
+            {
+                active[lane] = true;
+                message[lane] = next++;
+                position[lane] = 0;
+                total[lane] = sha256_block_count(inputs[message[lane]]);
+
+                for (int i = 0; i < 8; ++i)
+                    state[i][lane] = c_sha256_iv[i];
+            }
+
+            if (!active[lane])
+                continue;
+
+            size_t run = 0;
+            blocks[lane] = sha256_block(inputs[message[lane]], position[lane], staging[lane], run);
+            steps = std::min(steps, run);
+            first_active = std::min(first_active, lane);
+        }
+
+        if (first_active == Lanes)
+            break;
+
+        // Idle lanes hash someone else's blocks, their state is thrown away
+        for (size_t lane = 0; lane < Lanes; ++lane)
+        {
+            if (!active[lane])
+                blocks[lane] = blocks[first_active];
+        }
+
+        Compress(state, blocks, steps);
+
+        for (size_t lane = 0; lane < Lanes; ++lane)
+        {
+            if (!active[lane] || (position[lane] += steps) != total[lane])
+                continue;
+
+            Sha256Digest &digest = out[message[lane]];
+            for (int i = 0; i < 8; ++i)
+            {
+                const uint32_t word = __builtin_bswap32(state[i][lane]);
+                std::memcpy(digest.data() + 4 * i, &word, sizeof(word));
+            }
+
+            active[lane] = false;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+using Sha256Vec8 = uint32_t __attribute__((vector_size(32)));
+using Sha256Vec16 = uint32_t __attribute__((vector_size(64)));
+
+// Written with vector extensions so one body serves every width, the caller's target picks the instructions.
+// Not a function: vectors passed by value would change the ABI outside the kernel's target
+#define PP_SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+template <class Vec, size_t Lanes>
+[[gnu::always_inline]] inline void sha256_compress_vector(uint32_t (&state)[8][Lanes], const uint8_t *const (&blocks)[Lanes], const size_t count)
+{
+    static_assert(sizeof(Vec) == Lanes * sizeof(uint32_t));
+
+    Vec s[8];
+    for (int i = 0; i < 8; ++i)
+        std::memcpy(&s[i], state[i], sizeof(Vec));
+
+    for (size_t block = 0; block < count; ++block)
+    {
+        Vec w[16];
+        Vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+#pragma GCC unroll 64
+        for (int t = 0; t < 64; ++t)
+        {
+            if (t < 16)
+            {
+                alignas(64) uint32_t words[Lanes];
+                for (size_t lane = 0; lane < Lanes; ++lane)
+                    words[lane] = sha256_load_be32(blocks[lane] + block * 64 + t * 4);
+
+                std::memcpy(&w[t], words, sizeof(Vec));
+            }
+            else
+            {
+                const Vec w15 = w[(t - 15) & 15];
+                const Vec w2 = w[(t - 2) & 15];
+                w[t & 15] += (PP_SHA256_ROTR(w15, 7) ^ PP_SHA256_ROTR(w15, 18) ^ (w15 >> 3)) + (PP_SHA256_ROTR(w2, 17) ^ PP_SHA256_ROTR(w2, 19) ^ (w2 >> 10)) + w[(t - 7) & 15];
+            }
+
+            const Vec t1 = h + (PP_SHA256_ROTR(e, 6) ^ PP_SHA256_ROTR(e, 11) ^ PP_SHA256_ROTR(e, 25)) + (g ^ (e & (f ^ g))) + c_sha256_k[t] + w[t & 15];
+            const Vec t2 = (PP_SHA256_ROTR(a, 2) ^ PP_SHA256_ROTR(a, 13) ^ PP_SHA256_ROTR(a, 22)) + ((a & b) | (c & (a | b)));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        s[0] += a;
+        s[1] += b;
+        s[2] += c;
+        s[3] += d;
+        s[4] += e;
+        s[5] += f;
+        s[6] += g;
+        s[7] += h;
+    }
+
+    for (int i = 0; i < 8; ++i)
+        std::memcpy(state[i], &s[i], sizeof(Vec));
+}
+
+#undef PP_SHA256_ROTR
+
+[[gnu::target("avx2")]] inline void sha256_compress_avx2(uint32_t (&state)[8][8], const uint8_t *const (&blocks)[8], const size_t count)
+{
+    sha256_compress_vector<Sha256Vec8, 8>(state, blocks, count);
+}
+
+[[gnu::target("avx512f")]] inline void sha256_compress_avx512(uint32_t (&state)[8][16], const uint8_t *const (&blocks)[16], const size_t count)
+{
+    sha256_compress_vector<Sha256Vec16, 16>(state, blocks, count);
+}
+
+// SHA extensions hash a single block fast but with long dependency chains, so a few messages are interleaved
+template <size_t Lanes>
+[[gnu::target("sha,sse4.1")]] inline void sha256_compress_shani(uint32_t (&state)[8][Lanes], const uint8_t *const (&blocks)[Lanes], const size_t count)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i abef[Lanes];
+    __m128i cdgh[Lanes];
+
+    for (size_t lane = 0; lane < Lanes; ++lane)
+    {
+        const __m128i cdab = _mm_shuffle_epi32(_mm_set_epi32(state[3][lane], state[2][lane], state[1][lane], state[0][lane]), 0xB1);
+        const __m128i efgh = _mm_shuffle_epi32(_mm_set_epi32(state[7][lane], state[6][lane], state[5][lane], state[4][lane]), 0x1B);
+        abef[lane] = _mm_alignr_epi8(cdab, efgh, 8);
+        cdgh[lane] = _mm_blend_epi16(efgh, cdab, 0xF0);
+    }
+
+    for (size_t block = 0; block < count; ++block)
+    {
+        __m128i abef_save[Lanes];
+        __m128i cdgh_save[Lanes];
+        __m128i msg[Lanes][4];
+
+        for (size_t lane = 0; lane < Lanes; ++lane)
+        {
+            abef_save[lane] = abef[lane];
+            cdgh_save[lane] = cdgh[lane];
+        }
+
+        // Four rounds per step, the schedule is extended for the steps ahead
+#pragma GCC unroll 16
+        for (int step = 0; step < 16; ++step)
+        {
+#pragma GCC unroll 4
+            for (size_t lane = 0; lane < Lanes; ++lane)
+            {
+                if (step < 4)
+                    msg[lane][step] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks[lane] + block * 64 + step * 16)), mask);
+
+                __m128i m = _mm_add_epi32(msg[lane][step & 3], _mm_load_si128(reinterpret_cast<const __m128i *>(c_sha256_k + step * 4)));
+                cdgh[lane] = _mm_sha256rnds2_epu32(cdgh[lane], abef[lane], m);
+
+                if (step >= 3 && step < 15)
+                {
+                    const __m128i tmp = _mm_alignr_epi8(msg[lane][step & 3], msg[lane][(step - 1) & 3], 4);
+                    msg[lane][(step + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg[lane][(step + 1) & 3], tmp), msg[lane][step & 3]);
+                }
+
+                m = _mm_shuffle_epi32(m, 0x0E);
+                abef[lane] = _mm_sha256rnds2_epu32(abef[lane], cdgh[lane], m);
+
+                if (step >= 1 && step < 13)
+                    msg[lane][(step - 1) & 3] = _mm_sha256msg1_epu32(msg[lane][(step - 1) & 3], msg[lane][step & 3]);
+            }
+        }
+
+        for (size_t lane = 0; lane < Lanes; ++lane)
+        {
+            abef[lane] = _mm_add_epi32(abef[lane], abef_save[lane]);
+            cdgh[lane] = _mm_add_epi32(cdgh[lane], cdgh_save[lane]);
+        }
+    }
+
+    for (size_t lane = 0; lane < Lanes; ++lane)
+    {
+        const __m128i feba = _mm_shuffle_epi32(abef[lane], 0x1B);
+        const __m128i dchg = _mm_shuffle_epi32(cdgh[lane], 0xB1);
+
+        alignas(16) uint32_t words[8];
+        _mm_store_si128(reinterpret_cast<__m128i *>(words), _mm_blend_epi16(feba, dchg, 0xF0));
+        _mm_store_si128(reinterpret_cast<__m128i *>(words + 4), _mm_alignr_epi8(dchg, feba, 8));
+
+        for (int i = 0; i < 8; ++i)
+            state[i][lane] = words[i];
+    }
+}
+#endif
+
+inline Sha256BatchKernel sha256_batch_pick()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        return {sha256_schedule<2, sha256_compress_shani<2>>, 2};
+
+    if (__builtin_cpu_supports("avx512f"))
+        return {sha256_schedule<16, sha256_compress_avx512>, 8};
+
+    if (__builtin_cpu_supports("avx2"))
+        return {sha256_schedule<8, sha256_compress_avx2>, 4};
+#endif
+
+    return {};
+}
+} // namespace detail
+
+} // namespace Common
+} // namespace PingPong
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace PingPong
+{
+namespace Common
+{
+
+// Fixed set of threads running jobs in the order they were submitted. Results and exceptions come back through futures.
+// Jobs must not touch mutable state of their submitter, jobs still queued on destruction are dropped
+class WorkerPool
+{
+  public:
+    explicit WorkerPool(const unsigned thread_count)
+    {
+        for (unsigned i = 0; i < std::max(thread_count, 1u); ++i)
+            m_threads.emplace_back([this]()
+                                   { run(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_stopped = true;
+            m_jobs.clear();
+        }
+
+        m_cv.notify_all();
+
+        for (std::thread &thread : m_threads)
+            thread.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // Half of the cores, the other half receives and writes
+    static unsigned defaultThreadCount()
+    {
+        return std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+    }
+
+    template <class F>
+    std::future<std::invoke_result_t<F>> submit(F &&job)
+    {
+        // packaged_task is move-only, std::function needs something copyable
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(job));
+        auto res = task->get_future();
+
+        {
+            std::scoped_lock lock(m_mutex);
+            m_jobs.emplace_back([task]()
+                                { (*task)(); });
+        }
+
+        m_cv.notify_one();
+        return res;
+    }
+
+  private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+
+            {
+                std::unique_lock<std::mutex> ul(m_mutex);
+                m_cv.wait(ul, [this]()
+                          { return m_stopped || !m_jobs.empty(); });
+
+                if (m_stopped)
+                    return;
+
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+
+            job();
+        }
+    }
+
+  private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_jobs;
+    bool m_stopped = false;
+    std::vector<std::thread> m_threads;
+};
+
+} // namespace Common
+} // namespace PingPong
@@ -0,0 +1,205 @@
+// Discovery probes answered per second by a DiscoveryServer of this process. Every sender thread keeps a window of
+// probes in flight on loopback and counts the valid responses.
+// Usage: ppdiscovery_bench [sender threads, 1] [seconds, 2] [port, 60109]
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+#include <ppcommon/discovery.hpp>
+
+#include "discovery_server.hpp"
+
+namespace
+{
+using udp = boost::asio::ip::udp;
+
+// Probes one sender keeps in flight, and sends or receives with one call
+constexpr uint64_t c_window = 256;
+constexpr size_t c_batch = 32;
+// A window that got no response for this long was dropped by the server
+constexpr std::chrono::milliseconds c_lost_after{1};
+
+constexpr size_t c_max_response_size = 128;
+
+struct Counters
+{
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> answered{0};
+    std::atomic<uint64_t> invalid{0};
+};
+
+using Responses = std::array<std::array<char, c_max_response_size>, c_batch>;
+
+// Number of probes the socket took
+size_t sendProbes(udp::socket &socket, const udp::endpoint &server)
+{
+    const std::string_view probe = PingPong::Common::c_discovery_phrase;
+
+#if defined(__linux__)
+    std::array<iovec, c_batch> iovs;
+    std::array<mmsghdr, c_batch> msgs{};
+
+    for (size_t i = 0; i < c_batch; ++i)
+    {
+        iovs[i] = iovec{const_cast<char *>(probe.data()), probe.size()};
+        msgs[i].msg_hdr.msg_name = const_cast<sockaddr *>(server.data());
+        msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(server.size());
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int n = ::sendmmsg(socket.native_handle(), msgs.data(), c_batch, 0);
+    return n > 0 ? static_cast<size_t>(n) : 0;
+#else
+    size_t n = 0;
+    boost::system::error_code ec;
+
+    while (n < c_batch && socket.send_to(boost::asio::buffer(probe.data(), probe.size()), server, 0, ec) > 0)
+        ++n;
+
+    return n;
+#endif
+}
+
+// Sizes of the responses waiting on the socket, at most c_batch of them
+size_t receiveResponses(udp::socket &socket, Responses &responses, std::array<size_t, c_batch> &sizes)
+{
+#if defined(__linux__)
+    std::array<iovec, c_batch> iovs;
+    std::array<mmsghdr, c_batch> msgs{};
+
+    for (size_t i = 0; i < c_batch; ++i)
+    {
+        iovs[i] = iovec{responses[i].data(), responses[i].size()};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int n = ::recvmmsg(socket.native_handle(), msgs.data(), c_batch, MSG_DONTWAIT, nullptr);
+
+    for (int i = 0; i < n; ++i)
+        sizes[i] = msgs[i].msg_len;
+
+    return n > 0 ? static_cast<size_t>(n) : 0;
+#else
+    size_t n = 0;
+    udp::endpoint sender;
+    boost::system::error_code ec;
+
+    for (; n < c_batch; ++n)
+    {
+        sizes[n] = socket.receive_from(boost::asio::buffer(responses[n]), sender, 0, ec);
+
+        if (ec)
+            break;
+    }
+
+    return n;
+#endif
+}
+
+void sendProbesUntil(const udp::endpoint &server, const std::chrono::steady_clock::time_point end, Counters &counters)
+{
+    boost::asio::io_context context;
+    udp::socket socket(context, udp::endpoint(udp::v4(), 0));
+    socket.set_option(boost::asio::socket_base::receive_buffer_size(4 * 1024 * 1024));
+    socket.non_blocking(true);
+
+    Responses responses;
+    std::array<size_t, c_batch> sizes{};
+    uint64_t in_flight = 0;
+    auto answered_at = std::chrono::steady_clock::now();
+
+    while (std::chrono::steady_clock::now() < end)
+    {
+        if (in_flight + c_batch <= c_window)
+        {
+            const size_t n = sendProbes(socket, server);
+            counters.sent += n;
+            in_flight += n;
+        }
+
+        const size_t n = receiveResponses(socket, responses, sizes);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (PingPong::Common::parse_response(std::string_view(responses[i].data(), sizes[i])))
+                ++counters.answered;
+            else
+                ++counters.invalid;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+
+        if (n > 0)
+        {
+            in_flight -= std::min<uint64_t>(in_flight, n);
+            answered_at = now;
+        }
+        else if (now - answered_at > c_lost_after)
+        {
+            in_flight = 0;
+            answered_at = now;
+        }
+    }
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    using namespace std::chrono;
+
+    const unsigned threads = argc > 1 ? std::stoul(argv[1]) : 1;
+    const double seconds = argc > 2 ? std::stod(argv[2]) : 2.0;
+    const uint16_t port = static_cast<uint16_t>(argc > 3 ? std::stoul(argv[3]) : 60109);
+
+    // The server gets an io thread of its own, as in ppserver
+    boost::asio::io_context server_context;
+    PingPong::DiscoveryServer server(server_context, port, 60010, []()
+                                     { return PingPong::Common::ServerLoad{}; });
+
+    auto work = boost::asio::make_work_guard(server_context);
+    std::thread server_thread([&server_context]()
+                              { server_context.run(); });
+
+    Counters counters;
+    const udp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port);
+    const auto start = steady_clock::now();
+    const auto end = start + duration_cast<steady_clock::duration>(duration<double>(seconds));
+
+    std::vector<std::thread> senders;
+
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i)
+        senders.emplace_back([&]()
+                             { sendProbesUntil(endpoint, end, counters); });
+
+    for (std::thread &sender : senders)
+        sender.join();
+
+    const double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    server_context.stop();
+    server_thread.join();
+
+    std::cout << std::max(threads, 1u) << " sender threads, " << elapsed << " s\n";
+    std::cout << "sent:     " << counters.sent / elapsed << " probes/s\n";
+    std::cout << "answered: " << counters.answered / elapsed << " probes/s\n";
+    std::cout << "invalid responses: " << counters.invalid << '\n';
+
+    return counters.answered > 0 && counters.invalid == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,19 +1,32 @@
 #include "discovery_server.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <string_view>
 
 #include <boost/asio.hpp>
 
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
 #include <logger/logger.hpp>
+#include <ppcommon/discovery.hpp>
 
 namespace PingPong
 {
-DiscoveryServer::DiscoveryServer(boost::asio::io_context &io_context, const uint16_t discovery_port, const uint16_t tcp_port)
-    : m_socket{io_context}, m_tcp_port{tcp_port}
+DiscoveryServer::DiscoveryServer(boost::asio::io_context &io_context, const uint16_t discovery_port, const uint16_t tcp_port, std::function<Common::ServerLoad()> load)
+    : m_socket{io_context}, m_retry_timer{io_context}, m_tcp_port{tcp_port}, m_refresh_timer{io_context}, m_beacon_socket{io_context}, m_beacon_timer{io_context}, m_load{std::move(load)}
 {
     using udp = boost::asio::ip::udp;
     boost::system::error_code ec;
 
+    refreshAnnouncement();
+    startBeacons();
+
     std::ignore = m_socket.open(udp::v4(), ec);
     if (ec)
     {
@@ -35,6 +48,10 @@ DiscoveryServer::DiscoveryServer(boost::asio::io_context &io_context, const uint
         return;
     }
 
+    // Probes of a whole lab sweeping at once wait here until they are drained
+    std::ignore = m_socket.set_option(boost::asio::socket_base::receive_buffer_size(4 * 1024 * 1024), ec);
+    std::ignore = m_socket.non_blocking(true, ec);
+
     // Print what we actually bound to
     udp::endpoint ep = m_socket.local_endpoint(ec);
     if (!ec)
@@ -49,52 +66,211 @@ DiscoveryServer::DiscoveryServer(boost::asio::io_context &io_context, const uint
 
 void DiscoveryServer::listenForRequests()
 {
-    DBG_LOG(__PRETTY_FUNCTION__, " 1");
-    m_socket.async_receive_from(boost::asio::buffer(m_buffer), m_remote_endpoint,
-                                [this](std::error_code ec, std::size_t bytes)
-                                {
-                                    if (!ec)
-                                    {
-                                        DBG_LOG("[DISCOVERY SERVER] got ", bytes, " bytes from ", m_remote_endpoint.address().to_string(), ":", m_remote_endpoint.port());
-
-                                        handleRequest(bytes);
-                                    }
-                                    else
-                                    {
-                                        DBG_LOG("[DISCOVERY SERVER] error in listenForRequests : ", ec.message());
-                                    }
-
-                                    listenForRequests();
-                                });
-
-    DBG_LOG(__PRETTY_FUNCTION__, " 2");
+    m_socket.async_wait(boost::asio::ip::udp::socket::wait_read,
+                        [this](boost::system::error_code ec)
+                        {
+                            if (ec == boost::asio::error::operation_aborted)
+                                return;
+
+                            if (ec)
+                            {
+                                DBG_LOG("[DISCOVERY SERVER] error in listenForRequests : ", ec.message());
+                                retryListening();
+                                return;
+                            }
+
+                            m_retry_delay = c_min_retry_delay;
+
+                            for (size_t i = 0; i < c_max_batches_per_wakeup; ++i)
+                            {
+                                if (handleBatch() < c_batch)
+                                    break;
+                            }
+
+                            listenForRequests();
+                        });
+}
+
+// A socket that keeps failing must not spin the io thread
+void DiscoveryServer::retryListening()
+{
+    m_retry_timer.expires_after(m_retry_delay);
+    m_retry_timer.async_wait([this](boost::system::error_code ec)
+                             {
+                                 if (!ec)
+                                     listenForRequests();
+                             });
+
+    m_retry_delay = std::min(2 * m_retry_delay, c_max_retry_delay);
 }
 
-void DiscoveryServer::handleRequest(const std::size_t bytes)
+size_t DiscoveryServer::handleBatch()
 {
-    DBG_LOG(__PRETTY_FUNCTION__, " 1, bytes = ", bytes);
-    std::string_view data(m_buffer.data(), bytes);
-    DBG_LOG("[DISCOVERY SERVER] payload = '", data);
+    const std::string_view probe(Common::c_discovery_phrase);
+    std::array<size_t, c_batch> sizes{};
+    size_t received = 0;
+
+#if defined(__linux__)
+    std::array<mmsghdr, c_batch> messages{};
+    std::array<iovec, c_batch> buffers{};
+
+    for (size_t i = 0; i < c_batch; ++i)
+    {
+        buffers[i] = iovec{m_requests[i].data.data(), m_requests[i].data.size()};
+        messages[i].msg_hdr.msg_name = m_requests[i].sender.data();
+        messages[i].msg_hdr.msg_namelen = static_cast<socklen_t>(m_requests[i].sender.capacity());
+        messages[i].msg_hdr.msg_iov = &buffers[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int count = ::recvmmsg(m_socket.native_handle(), messages.data(), c_batch, MSG_DONTWAIT, nullptr);
+
+    if (count <= 0)
+        return 0;
+
+    received = static_cast<size_t>(count);
+
+    for (size_t i = 0; i < received; ++i)
+    {
+        m_requests[i].sender.resize(messages[i].msg_hdr.msg_namelen);
+        sizes[i] = (messages[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : messages[i].msg_len;
+    }
+#else
+    for (; received < c_batch; ++received)
+    {
+        boost::system::error_code ec;
+        sizes[received] = m_socket.receive_from(boost::asio::buffer(m_requests[received].data), m_requests[received].sender, 0, ec);
+
+        if (ec)
+            break;
+    }
+#endif
+
+    // One shared response, every reply only differs in where it goes
+    std::array<size_t, c_batch> answered;
+    size_t answer_count = 0;
+
+    for (size_t i = 0; i < received; ++i)
+    {
+        if (std::string_view(m_requests[i].data.data(), sizes[i]) == probe)
+            answered[answer_count++] = i;
+        else
+            DBG_LOG("[DISCOVERY SERVER]: phrase from ", m_requests[i].sender.address().to_string(), " is not compatible. Skipping.");
+    }
+
+#if defined(__linux__)
+    iovec response{m_response.data(), m_response.size()};
+
+    for (size_t i = 0; i < answer_count; ++i)
+    {
+        messages[i] = mmsghdr{};
+        messages[i].msg_hdr.msg_name = m_requests[answered[i]].sender.data();
+        messages[i].msg_hdr.msg_namelen = static_cast<socklen_t>(m_requests[answered[i]].sender.size());
+        messages[i].msg_hdr.msg_iov = &response;
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Replies the socket has no room for are dropped, the client probes again on its next discovery
+    for (size_t sent = 0; sent < answer_count;)
+    {
+        const int count = ::sendmmsg(m_socket.native_handle(), messages.data() + sent, static_cast<unsigned>(answer_count - sent), MSG_DONTWAIT);
+
+        if (count <= 0)
+        {
+            DBG_LOG("[DISCOVERY SERVER]: dropped ", answer_count - sent, " responses: ", std::strerror(errno));
+            break;
+        }
+
+        sent += static_cast<size_t>(count);
+    }
+#else
+    for (size_t i = 0; i < answer_count; ++i)
+    {
+        boost::system::error_code ec;
+        m_socket.send_to(boost::asio::buffer(m_response), m_requests[answered[i]].sender, 0, ec);
+    }
+#endif
+
+    return received;
+}
+
+void DiscoveryServer::refreshAnnouncement()
+{
+    m_announcement.port = m_tcp_port;
+    m_announcement.load = m_load();
+    m_announcement.load.io_utilization = m_io_utilization;
+    m_response = Common::format_response(m_announcement);
+
+    m_refresh_timer.expires_after(c_refresh_period);
+    m_refresh_timer.async_wait([this](boost::system::error_code ec)
+                               {
+                                   if (!ec)
+                                   {
+                                       sampleIoUtilization();
+                                       refreshAnnouncement();
+                                   }
+                               });
+}
+
+void DiscoveryServer::startBeacons()
+{
+    using udp = boost::asio::ip::udp;
+    boost::system::error_code ec;
+
+    std::ignore = m_beacon_socket.open(udp::v4(), ec);
+
+    // Beacons do not leave the local network
+    if (!ec)
+        std::ignore = m_beacon_socket.set_option(boost::asio::ip::multicast::hops(1), ec);
+
+    if (ec)
+    {
+        std::cerr << "[DISCOVERY SERVER] beacon socket error: " << ec.message() << '\n';
+        return;
+    }
+
+    m_beacon_endpoint = udp::endpoint(boost::asio::ip::make_address_v4(Common::c_beacon_group), Common::c_beacon_port);
+    sendBeacon();
+}
+
+void DiscoveryServer::sendBeacon()
+{
+    m_beacon = Common::format_beacon(m_announcement);
+
+    m_beacon_socket.async_send_to(boost::asio::buffer(m_beacon), m_beacon_endpoint,
+                                  [this](std::error_code ec, std::size_t)
+                                  {
+                                      if (ec)
+                                          DBG_LOG("[DISCOVERY SERVER] error in sending a beacon: ", ec.message());
+
+                                      m_beacon_timer.expires_after(Common::c_beacon_interval);
+                                      m_beacon_timer.async_wait([this](boost::system::error_code ec)
+                                                                {
+                                                                    if (!ec)
+                                                                        sendBeacon();
+                                                                });
+                                  });
+}
+
+// Runs on the io thread, its CPU time over the time since the last sample is how busy it was
+void DiscoveryServer::sampleIoUtilization()
+{
+    timespec cpu{};
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) != 0)
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::nanoseconds cpu_time = std::chrono::seconds(cpu.tv_sec) + std::chrono::nanoseconds(cpu.tv_nsec);
 
-    if (data == c_discovery_phrase)
+    if (m_sampled_at != std::chrono::steady_clock::time_point{} && now > m_sampled_at)
     {
-        DBG_LOG("[DISCOVERY SERVER]: phrase is ok.");
-        const std::string response = std::string(c_response_phrase) + "/" + std::to_string(m_tcp_port);
-
-        m_socket.async_send_to(
-            boost::asio::buffer(response),
-            m_remote_endpoint,
-            [this](std::error_code ec, std::size_t)
-            {
-                if (!ec)
-                    DBG_LOG("[DISCOVERY SERVER] Responded to ", m_remote_endpoint.address().to_string());
-                else
-                    DBG_LOG("[DISCOVERY SERVER]: error in sending the response: ", ec.message());
-            });
+        const auto busy = std::clamp<int64_t>(1000 * (cpu_time - m_sampled_cpu_time).count() / (now - m_sampled_at).count(), 0, 1000);
+        // Smoothed over a few intervals, a single burst does not turn clients away
+        m_io_utilization = static_cast<uint16_t>((3 * m_io_utilization + busy) / 4);
     }
-    else
-        DBG_LOG("[DISCOVERY SERVER]: phrase is not compatible. Skipping.");
 
-    DBG_LOG(__PRETTY_FUNCTION__, " 2");
+    m_sampled_at = now;
+    m_sampled_cpu_time = cpu_time;
 }
 } // namespace PingPong
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <functional>
+#include <string>
+
 #include <net_common/net_common.hpp>
+#include <ppcommon/discovery.hpp>
 
 namespace PingPong
 {
@@ -8,19 +14,61 @@ namespace PingPong
 class DiscoveryServer
 {
   public:
-    DiscoveryServer(boost::asio::io_context &io_context, const uint16_t discovery_port, const uint16_t tcp_port);
+    // `load` is called from the io context once per refresh period, the io utilization is measured here
+    DiscoveryServer(boost::asio::io_context &io_context, const uint16_t discovery_port, const uint16_t tcp_port, std::function<Common::ServerLoad()> load);
 
-    void listenForRequests();
-    void handleRequest(const std::size_t bytes);
+  private:
+    // Probes received and answered with one system call each
+    static constexpr size_t c_batch = 64;
+    // Batches drained before other work of the io context gets its turn
+    static constexpr size_t c_max_batches_per_wakeup = 16;
+    // Longer datagrams are no probes
+    static constexpr size_t c_max_request_size = 64;
+    // Listening resumes after a socket error with this delay, doubled on every further error in a row
+    static constexpr std::chrono::milliseconds c_min_retry_delay{10};
+    static constexpr std::chrono::milliseconds c_max_retry_delay{1000};
+    // Beacons in between repeat the last sample, the io utilization is measured over this long
+    static constexpr std::chrono::milliseconds c_refresh_period{50};
+
+    struct Request
+    {
+        std::array<char, c_max_request_size> data;
+        boost::asio::ip::udp::endpoint sender;
+    };
 
   private:
-    static constexpr char c_discovery_phrase[] = "pingpong_discover_v1";
-    static constexpr char c_response_phrase[] = "pingpong_server_v1";
+    void listenForRequests();
+    void retryListening();
+    // Number of probes received, less than c_batch once the socket is empty
+    size_t handleBatch();
+    // Takes the load once per refresh period, for the replies and beacons alike. The io utilization is sampled
+    // only on the io thread, the first call comes from the constructor
+    void refreshAnnouncement();
+    void startBeacons();
+    void sendBeacon();
+    void sampleIoUtilization();
 
+  private:
     boost::asio::ip::udp::socket m_socket;
-    boost::asio::ip::udp::endpoint m_remote_endpoint;
-    std::array<char, 1024> m_buffer;
+    std::array<Request, c_batch> m_requests; // every one keeps its own sender
+    boost::asio::steady_timer m_retry_timer;
+    std::chrono::milliseconds m_retry_delay = c_min_retry_delay;
     uint16_t m_tcp_port;
+
+    Common::ServerAnnouncement m_announcement;
+    std::string m_response; // of m_announcement
+    boost::asio::steady_timer m_refresh_timer;
+
+    boost::asio::ip::udp::socket m_beacon_socket;
+    boost::asio::ip::udp::endpoint m_beacon_endpoint;
+    boost::asio::steady_timer m_beacon_timer;
+    std::string m_beacon; // alive until sent
+    std::function<Common::ServerLoad()> m_load;
+
+    // CPU time of the io thread at the last beacon
+    std::chrono::steady_clock::time_point m_sampled_at;
+    std::chrono::nanoseconds m_sampled_cpu_time{0};
+    uint16_t m_io_utilization = 0;
 };
 
 } // namespace PingPong
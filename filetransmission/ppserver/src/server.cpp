@@ -1,13 +1,21 @@
+#include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
 #include <limits>
 #include <optional>
 #include <unordered_map>
+#include <vector>
 
 #include <boost/bimap.hpp>
+#include <boost/program_options.hpp>
 
 #include "logger/logger.hpp"
 #include "net_common/net_server.hpp"
+#include "ppcommon/dispatch.hpp"
 #include "ppcommon/ppcommon.hpp"
 #include "ppcommon/session.hpp"
 
@@ -19,11 +27,27 @@ namespace PingPong
 using namespace Common;
 using ConnectionPtr = std::shared_ptr<Net::Connection<EMessageType>>;
 using SessionUPtr = std::unique_ptr<ServerSession>;
+using CacheLeasePtr = std::shared_ptr<CacheLease>;
+
+struct ServerOptions
+{
+    std::filesystem::path cache_dir;
+    uint64_t cache_memory_limit = uint64_t{256} * 1024 * 1024;
+    uint64_t cache_disk_limit = uint64_t{4} * 1024 * 1024 * 1024; // zero turns the chunk cache off
+};
 
 struct TransmissionContext
 {
     PreMetadata pre_metadata;
     PostMetadata post_metadata;
+    std::optional<ManifestData> manifest{}; // directory payloads only
+};
+
+// Connections of one logical transfer. Index 0 is the primary connection
+struct StripeSet
+{
+    std::vector<ConnectionPtr> senders;
+    std::vector<ConnectionPtr> receivers;
 };
 
 class ClientStorage
@@ -35,7 +59,7 @@ class ClientStorage
         m_pending_transmissions.erase(sender);
     }
 
-    void addPendingSender(ConnectionPtr sender, const uint64_t max_chunk_size, const PreMetadata &pre_metadata)
+    void addPendingSender(ConnectionPtr sender, const uint64_t max_chunk_size, const uint8_t stripe_count, const ECompression compression, const PreMetadata &pre_metadata)
     {
         m_pending_phrase_senders.insert({sender, pre_metadata.code_phrase.code});
         m_pending_transmissions.insert({sender,
@@ -43,7 +67,12 @@ class ClientStorage
                                                             PostMetadata{pre_metadata.payload_type,
                                                                          max_chunk_size,
                                                                          pre_metadata.code_phrase,
-                                                                         pre_metadata.file_data}}});
+                                                                         pre_metadata.file_data,
+                                                                         ResumeData{},
+                                                                         stripe_count,
+                                                                         compression,
+                                                                         pre_metadata.merkle,
+                                                                         pre_metadata.integrity}}});
     }
 
     std::optional<std::string> getCodeBySender(ConnectionPtr sender) const
@@ -90,15 +119,27 @@ class ClientStorage
         return nullptr;
     }
 
-    std::optional<TransmissionContext> getContextBySender(ConnectionPtr sender) const
+    const TransmissionContext *getContextBySender(ConnectionPtr sender) const
     {
         auto it = m_pending_transmissions.find(sender);
         if (it != m_pending_transmissions.end())
         {
-            return {it->second};
+            return &it->second;
         }
 
-        return {};
+        return nullptr;
+    }
+
+    bool setManifest(ConnectionPtr sender, ManifestData manifest)
+    {
+        auto it = m_pending_transmissions.find(sender);
+        if (it == m_pending_transmissions.end() || it->second.pre_metadata.payload_type != EPayloadType::Directory)
+        {
+            return false;
+        }
+
+        it->second.manifest = std::move(manifest);
+        return true;
     }
 
     ServerSession *getSessionBySender(ConnectionPtr sender) const
@@ -112,9 +153,46 @@ class ClientStorage
         return nullptr;
     }
 
+    void setCacheLease(ConnectionPtr sender, CacheLeasePtr lease)
+    {
+        m_cache_leases[sender] = std::move(lease);
+    }
+
+    CacheLeasePtr getCacheLease(ConnectionPtr sender) const
+    {
+        auto it = m_cache_leases.find(sender);
+        if (it != m_cache_leases.end())
+        {
+            return it->second;
+        }
+
+        return nullptr;
+    }
+
+    // Senders whose sessions wait for work done off the server thread
+    std::vector<ConnectionPtr> getWaitingSenders() const
+    {
+        std::vector<ConnectionPtr> res;
+
+        for (const auto &[sender, session] : m_sessions)
+        {
+            if (session->isWaiting())
+                res.push_back(sender);
+        }
+
+        return res;
+    }
+
+    // Safe to call from any thread
+    uint32_t sessionCount() const
+    {
+        return m_session_count;
+    }
+
     void removeSession(ConnectionPtr sender)
     {
-        m_sessions.erase(sender);
+        m_session_count -= static_cast<uint32_t>(m_sessions.erase(sender));
+        m_cache_leases.erase(sender);
         m_senders_receivers.left.erase(sender);
         sender->disconnectAfterFlush();
     }
@@ -122,7 +200,66 @@ class ClientStorage
     void addSession(ConnectionPtr sender, ConnectionPtr receiver, SessionUPtr session)
     {
         m_senders_receivers.insert({sender, receiver});
-        m_sessions.insert({sender, std::move(session)});
+        m_session_count += static_cast<uint32_t>(m_sessions.insert({sender, std::move(session)}).second);
+    }
+
+    void addStripes(ConnectionPtr sender, ConnectionPtr receiver, const uint8_t stripe_count)
+    {
+        StripeSet stripes;
+        stripes.senders.resize(stripe_count);
+        stripes.receivers.resize(stripe_count);
+        stripes.senders[0] = sender;
+        stripes.receivers[0] = receiver;
+
+        m_stripes.insert({sender, std::move(stripes)});
+    }
+
+    StripeSet *getStripes(ConnectionPtr sender)
+    {
+        auto it = m_stripes.find(sender);
+        if (it != m_stripes.end())
+        {
+            return &it->second;
+        }
+
+        return nullptr;
+    }
+
+    void addStripe(ConnectionPtr sender, ConnectionPtr stripe)
+    {
+        m_stripe_owners.insert({stripe, sender});
+    }
+
+    // Primary sender of a stripe connection, or the connection itself
+    ConnectionPtr getPrimaryByStripe(ConnectionPtr stripe) const
+    {
+        auto it = m_stripe_owners.find(stripe);
+        if (it != m_stripe_owners.end())
+        {
+            return it->second;
+        }
+
+        return stripe;
+    }
+
+    void removeStripes(ConnectionPtr sender)
+    {
+        auto it = m_stripes.find(sender);
+        if (it == m_stripes.end())
+            return;
+
+        for (size_t i = 1; i < it->second.senders.size(); ++i)
+        {
+            if (ConnectionPtr stripe = it->second.senders[i])
+                removeSession(stripe);
+        }
+
+        for (ConnectionPtr stripe : it->second.senders)
+            m_stripe_owners.erase(stripe);
+        for (ConnectionPtr stripe : it->second.receivers)
+            m_stripe_owners.erase(stripe);
+
+        m_stripes.erase(it);
     }
 
   private:
@@ -130,19 +267,41 @@ class ClientStorage
     std::unordered_map<ConnectionPtr, TransmissionContext> m_pending_transmissions; // sender -> context
     boost::bimap<ConnectionPtr, ConnectionPtr> m_senders_receivers;                 // sender <-> receiver
     std::unordered_map<ConnectionPtr, SessionUPtr> m_sessions;                      // sender -> session
+    std::unordered_map<ConnectionPtr, StripeSet> m_stripes;                         // primary sender -> stripes
+    std::unordered_map<ConnectionPtr, ConnectionPtr> m_stripe_owners;               // stripe -> primary sender
+    std::unordered_map<ConnectionPtr, CacheLeasePtr> m_cache_leases;                // primary sender -> cached blocks
+    std::atomic<uint32_t> m_session_count{0};                                       // size of m_sessions, read by discovery
 };
 
 class FileServer : public Net::ServerBase<EMessageType>
 {
   public:
-    FileServer(uint16_t discovery_port, uint16_t port)
-        : Net::ServerBase<EMessageType>(port), m_discovery_server(m_asio_context, discovery_port, port)
+    FileServer(uint16_t discovery_port, uint16_t port, const ServerOptions &options)
+        : Net::ServerBase<EMessageType>(port), m_cache{options.cache_dir, options.cache_memory_limit, options.cache_disk_limit}, m_discovery_server(m_asio_context, discovery_port, port, [this]()
+                                                                      { return Common::ServerLoad{m_storage.sessionCount(), getQueuedBytes()}; })
     {
         DBG_LOG(__PRETTY_FUNCTION__, " discovery_port = ", discovery_port, ", tcp_port = ", port);
     }
 
     ~FileServer() override = default;
 
+    // Cached blocks are read on the pool. While a session waits for them, messages are waited for only a while
+    void run()
+    {
+        bool waiting = false;
+
+        while (true)
+        {
+            if (waiting)
+                m_messages_in.waitFor(c_cache_poll_period);
+            else
+                m_messages_in.wait();
+
+            update();
+            waiting = pollSessions();
+        }
+    }
+
   protected:
     void onClientValidated(ConnectionPtr client) override
     {
@@ -162,33 +321,57 @@ class FileServer : public Net::ServerBase<EMessageType>
         m_storage.removePendingSender(client);
     }
 
-    void onSendEstablishment(ConnectionPtr client, Message &&msg)
+    void onSendEstablishment(ConnectionPtr client, PreMetadata &&pre)
     {
         DBG_LOG(__PRETTY_FUNCTION__);
         m_storage.removePendingSender(client);
 
-        PreMetadata pre = decode<EMessageType::Send>(msg);
         DBG_LOG("send-request: file_name = ", pre.file_data.file_name, " file_size = ", pre.file_data.file_size, ", code = ", pre.code_phrase.code);
 
         if (m_storage.getSessionBySender(client) != nullptr)
         {
             Message reject_msg = encode<EMessageType::Reject>(Empty{});
-            client->send(reject_msg);
+            client->send(std::move(reject_msg));
 
             m_storage.removeSession(client);
             m_storage.removePendingSender(client);
         }
 
+        // The receiver could not check the chunks
+        if (pre.integrity > EIntegrity::Sha256)
+        {
+            DBG_LOG("[", client->getId(), "]: unknown integrity level ", static_cast<int>(pre.integrity));
+            Message reject_msg = encode<EMessageType::Reject>(Empty{});
+            client->send(std::move(reject_msg));
+            return;
+        }
+
         DBG_LOG("[", client->getId(), "]: new pending sender with code = ", pre.code_phrase.code);
-        m_storage.addPendingSender(client, m_max_chunk_size, pre);
+        const uint8_t stripe_count = std::clamp<uint8_t>(pre.stripe_count, 1, m_max_stripe_count);
+        // Chunks are only relayed, the server just has to know that the receiver can decode them
+        const ECompression compression = pre.compression <= ECompression::Zlib ? pre.compression : ECompression::None;
+        m_storage.addPendingSender(client, m_max_chunk_size, stripe_count, compression, pre);
+    }
+
+    void onManifest(ConnectionPtr client, ManifestData &&manifest)
+    {
+        DBG_LOG(__PRETTY_FUNCTION__);
+
+        DBG_LOG("manifest: entries = ", manifest.entry_count, ", bytes = ", manifest.data.size());
+
+        if (!m_storage.setManifest(client, std::move(manifest)))
+        {
+            DBG_LOG("[", client->getId(), "]: manifest without a pending directory transfer");
+            Message reject_msg = encode<EMessageType::Reject>(Empty{});
+            client->send(std::move(reject_msg));
+            m_storage.removePendingSender(client);
+        }
     }
 
-    void onReceiveEstablishment(ConnectionPtr client, Message &&msg)
+    void onReceiveEstablishment(ConnectionPtr client, PreMetadata &&request)
     {
         DBG_LOG(__PRETTY_FUNCTION__);
 
-        PreMetadata request;
-        msg >> request;
         DBG_LOG("receive-request: code = ", request.code_phrase.code);
 
         ConnectionPtr sender = m_storage.getSenderByCode(request.code_phrase.code);
@@ -197,44 +380,48 @@ class FileServer : public Net::ServerBase<EMessageType>
         {
             DBG_LOG("[", client->getId(), "]: failed to find a valid sender. Code phrase is invalid");
             Message reject_msg = encode<EMessageType::Reject>(Empty{});
-            client->send(reject_msg);
+            client->send(std::move(reject_msg));
             return;
         }
 
-        auto opt_context = m_storage.getContextBySender(sender);
+        const TransmissionContext *context = m_storage.getContextBySender(sender);
 
-        if (!opt_context)
+        if (!context || (context->pre_metadata.payload_type == EPayloadType::Directory && !context->manifest))
         {
             DBG_LOG("[", client->getId(), "]: failed to find sender's context.");
             Message reject_msg = encode<EMessageType::Reject>(Empty{});
-            client->send(reject_msg);
+            client->send(std::move(reject_msg));
             return;
         }
 
-        const PostMetadata &response = (*opt_context).post_metadata;
+        const PostMetadata &response = context->post_metadata;
         Message accept_msg = encode<EMessageType::Accept>(response);
-        client->send(accept_msg);
+        client->send(std::move(accept_msg));
+
+        if (context->manifest)
+        {
+            Message manifest_msg = encode<EMessageType::Manifest>(*context->manifest);
+            client->send(std::move(manifest_msg));
+        }
     }
 
-    void establishTransmissionSession(ConnectionPtr receiver, Message &&msg)
+    void establishTransmissionSession(ConnectionPtr receiver, ReceiveRequest &&request)
     {
         DBG_LOG(__PRETTY_FUNCTION__);
 
-        CodePhrase request;
-        msg >> request;
-        DBG_LOG("establishTransmissionSession: code = ", request.code);
+        DBG_LOG("establishTransmissionSession: code = ", request.code_phrase.code, ", resume offset = ", request.resume.offset);
 
-        ConnectionPtr sender = m_storage.getSenderByCode(request.code);
+        ConnectionPtr sender = m_storage.getSenderByCode(request.code_phrase.code);
 
         if (!sender)
         {
             DBG_LOG("[", receiver->getId(), "]: failed to receive file. Something went wrong");
             Message abort_msg = encode<EMessageType::Abort>(Empty{});
-            receiver->send(abort_msg);
+            receiver->send(std::move(abort_msg));
             return;
         }
 
-        auto context = m_storage.getContextBySender(sender);
+        const TransmissionContext *context = m_storage.getContextBySender(sender);
 
         if (!context)
         {
@@ -242,17 +429,159 @@ class FileServer : public Net::ServerBase<EMessageType>
             return;
         }
 
-        auto session_ptr = std::make_unique<ServerOneToOneRetranslatorSession>(context->pre_metadata.file_data.file_size, m_max_chunk_size, receiver);
+        // Shared by the sessions of all stripes, filled in by the sender's CacheQuery
+        auto lease = std::make_shared<CacheLease>(m_cache);
+        auto session_ptr = std::make_unique<ServerCachingRetranslatorSession>(context->pre_metadata.file_data.file_size, m_max_chunk_size, sender, receiver, m_cache, m_cache_readers, m_cache_collectors, cacheBlockSize(*context), lease);
 
-        ServerSession &session = *session_ptr;
         m_storage.addSession(sender, receiver, std::move(session_ptr));
+        m_storage.addStripes(sender, receiver, context->post_metadata.stripe_count);
+        m_storage.setCacheLease(sender, lease);
 
-        Message accept_msg = encode<EMessageType::Accept>((*context).post_metadata);
-        sender->send(accept_msg);
+        // The receiver may open its stripes from now on
+        Message receiver_accept_msg = encode<EMessageType::Accept>((*context).post_metadata);
+        receiver->send(std::move(receiver_accept_msg));
+
+        // The sender decides whether the receiver's partial file can be resumed
+        PostMetadata post_metadata = (*context).post_metadata;
+        post_metadata.resume = request.resume;
+
+        Message accept_msg = encode<EMessageType::Accept>(post_metadata);
+        sender->send(std::move(accept_msg));
 
         DBG_LOG("Server starts to send files from ", sender->getId(), " to ", receiver->getId());
     }
 
+    // Signatures of the receiver's older copy, the sender waits for them after Accept
+    void onSignatures(ConnectionPtr receiver, Message &&msg)
+    {
+        DBG_LOG(__PRETTY_FUNCTION__);
+
+        ConnectionPtr sender = m_storage.getSenderByReceiver(receiver);
+
+        if (!sender)
+        {
+            DBG_LOG("[", receiver->getId(), "]: signatures without a transfer");
+            return;
+        }
+
+        if (msg.size() > c_max_signatures_size)
+        {
+            DBG_LOG("[", receiver->getId(), "]: too many signatures");
+            removeSessionAbruptly(sender);
+            return;
+        }
+
+        sender->send(std::move(msg));
+    }
+
+    // Blocks are cached by their Merkle leaf, so only transfers with a tree of the usual block size take part
+    uint32_t cacheBlockSize(const TransmissionContext &context) const
+    {
+        const PreMetadata &pre = context.pre_metadata;
+        return m_cache.enabled() && pre.integrity == EIntegrity::Sha256 && pre.merkle.block_size == c_merkle_block_size ? c_merkle_block_size : 0;
+    }
+
+    // Blocks the chunk cache can send in place of the sender. They stay pinned until the transfer ends.
+    // A sender only ever sees the blocks cached under its own owner secret
+    void onCacheQuery(ConnectionPtr sender, Message &&msg)
+    {
+        DBG_LOG(__PRETTY_FUNCTION__);
+
+        CacheLeasePtr lease = m_storage.getCacheLease(sender);
+        const TransmissionContext *context = m_storage.getContextBySender(sender);
+
+        if (!lease || !context || msg.size() < c_cache_query_header_size || msg.size() > c_max_cache_query_size || (msg.size() - c_cache_query_header_size) % SHA256_DIGEST_LENGTH != 0)
+        {
+            DBG_LOG("[", sender->getId(), "]: malformed cache query");
+            removeSessionAbruptly(sender);
+            return;
+        }
+
+        CacheQueryData query = decode<EMessageType::CacheQuery>(msg);
+
+        if (!lease->claim(query.owner))
+        {
+            DBG_LOG("[", sender->getId(), "]: cache query of another owner");
+            removeSessionAbruptly(sender);
+            return;
+        }
+
+        CacheReplyData reply;
+        reply.first_block = query.first_block;
+        reply.block_count = query.leaves.size() / SHA256_DIGEST_LENGTH;
+        reply.bitmap.resize((reply.block_count + 7) / 8);
+
+        for (uint64_t i = 0; i < reply.block_count && cacheBlockSize(*context) > 0; ++i)
+        {
+            Hash leaf;
+            std::copy_n(query.leaves.begin() + i * leaf.size(), leaf.size(), leaf.begin());
+
+            if (lease->add(query.first_block + i, leaf))
+            {
+                reply.bitmap[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+            }
+        }
+
+        DBG_LOG("cache-query: ", reply.block_count, " blocks from ", reply.first_block);
+
+        Message reply_msg = encode<EMessageType::CacheReply>(reply);
+        sender->send(std::move(reply_msg));
+    }
+
+    void onStripeEstablishment(ConnectionPtr client, StripeRequest &&request, const bool is_sender)
+    {
+        DBG_LOG(__PRETTY_FUNCTION__);
+
+        DBG_LOG("stripe-request: code = ", request.code_phrase.code, ", index = ", static_cast<int>(request.stripe_index), ", is_sender = ", is_sender);
+
+        ConnectionPtr sender = m_storage.getSenderByCode(request.code_phrase.code);
+        StripeSet *stripes = sender ? m_storage.getStripes(sender) : nullptr;
+
+        if (!stripes || request.stripe_index == 0 || request.stripe_index >= stripes->senders.size())
+        {
+            DBG_LOG("[", client->getId(), "]: no transfer for the stripe");
+            Message reject_msg = encode<EMessageType::Reject>(Empty{});
+            client->send(std::move(reject_msg));
+            return;
+        }
+
+        ConnectionPtr &slot = is_sender ? stripes->senders[request.stripe_index] : stripes->receivers[request.stripe_index];
+
+        if (slot)
+        {
+            DBG_LOG("[", client->getId(), "]: stripe is already taken");
+            Message reject_msg = encode<EMessageType::Reject>(Empty{});
+            client->send(std::move(reject_msg));
+            return;
+        }
+
+        slot = client;
+        m_storage.addStripe(sender, client);
+
+        ConnectionPtr stripe_sender = stripes->senders[request.stripe_index];
+        ConnectionPtr stripe_receiver = stripes->receivers[request.stripe_index];
+
+        // Both ends of the stripe are here, start relaying
+        if (stripe_sender && stripe_receiver)
+        {
+            const TransmissionContext *context = m_storage.getContextBySender(sender);
+
+            if (!context)
+            {
+                removeSessionAbruptly(sender);
+                return;
+            }
+
+            auto session_ptr = std::make_unique<ServerCachingRetranslatorSession>(context->pre_metadata.file_data.file_size, m_max_chunk_size, stripe_sender, stripe_receiver, m_cache, m_cache_readers, m_cache_collectors, cacheBlockSize(*context), m_storage.getCacheLease(sender));
+            m_storage.addSession(stripe_sender, stripe_receiver, std::move(session_ptr));
+
+            Message accept_msg = encode<EMessageType::Accept>((*context).post_metadata);
+            stripe_sender->send(std::move(accept_msg));
+
+            DBG_LOG("Stripe ", static_cast<int>(request.stripe_index), " relays from ", stripe_sender->getId(), " to ", stripe_receiver->getId());
+        }
+    }
+
     void finishSession(ConnectionPtr receiver)
     {
         ConnectionPtr sender = m_storage.getSenderByReceiver(receiver);
@@ -261,8 +590,9 @@ class FileServer : public Net::ServerBase<EMessageType>
         {
             DBG_LOG("Sending Success to the sender");
             Message success_msg = encode<EMessageType::Success>(Empty{});
-            sender->send(success_msg);
+            sender->send(std::move(success_msg));
 
+            m_storage.removeStripes(sender);
             m_storage.removePendingSender(sender);
             m_storage.removeSession(sender);
         }
@@ -276,50 +606,106 @@ class FileServer : public Net::ServerBase<EMessageType>
     {
         DBG_LOG("[", client->getId(), "]: error in send-session. Aborting");
 
-        ServerSession *session = m_storage.getSessionBySender(client);
+        // A failure on any stripe aborts the whole transfer
+        ConnectionPtr sender = m_storage.getPrimaryByStripe(client);
 
-        if (session)
+        std::vector<ConnectionPtr> senders{sender};
+        if (StripeSet *stripes = m_storage.getStripes(sender))
+            senders = stripes->senders;
+
+        for (ConnectionPtr stripe_sender : senders)
         {
-            Message abort_msg = encode<EMessageType::Abort>(Empty{});
-            session->onMessage(std::move(abort_msg));
+            ServerSession *session = stripe_sender ? m_storage.getSessionBySender(stripe_sender) : nullptr;
+
+            if (session)
+            {
+                Message abort_msg = encode<EMessageType::Abort>(Empty{});
+                session->onMessage(std::move(abort_msg));
+            }
         }
 
-        m_storage.removePendingSender(client);
-        m_storage.removeSession(client);
+        m_storage.removeStripes(sender);
+        m_storage.removePendingSender(sender);
+        m_storage.removeSession(sender);
     }
 
-    void onSessionedMessage(ConnectionPtr client, ServerSession *session, Message &&msg)
+    // True while a session still waits
+    bool pollSessions()
     {
-        DBG_LOG(__PRETTY_FUNCTION__);
+        bool waiting = false;
 
-        // FinalChunk: Success -> Sender , FinalChunk -> Receiver
-        if (msg.header.id == EMessageType::FinalChunk)
+        for (ConnectionPtr sender : m_storage.getWaitingSenders())
         {
-            session->onMessage(std::move(msg));
+            ServerSession *session = m_storage.getSessionBySender(sender);
+
+            // Gone with an earlier failure of its transfer
+            if (!session)
+                continue;
+
+            if (!session->poll())
+            {
+                DBG_LOG("[", sender->getId(), "]: cached blocks can't be relayed");
+                removeSessionAbruptly(sender);
+                continue;
+            }
+
+            waiting = waiting || session->isWaiting();
         }
-        // Chunk:
-        // good : Chunk -> Receiver
+
+        return waiting;
+    }
+
+    void onSessionedMessage(ConnectionPtr client, ServerSession *session, Message &&msg)
+    {
+        DBG_LOG(__PRETTY_FUNCTION__);
+
+        // good : the session passes the message on
         // bad  : Abort -> Sender, Abort -> Receiver
-        else if (msg.header.id == EMessageType::Chunk)
+        const auto relay = [&](Message &relayed, const bool well_formed)
         {
-            // Checking chunk's size
-            const auto offset = SHA256_DIGEST_LENGTH;
-            if (msg.size() - offset > m_max_chunk_size)
+            if (!well_formed)
             {
-                DBG_LOG("[", client->getId(), "]: exceeded max chunk size");
+                DBG_LOG("[", client->getId(), "]: malformed message. Type = ", static_cast<int>(relayed.header.id));
                 removeSessionAbruptly(client);
             }
-            else if (!session->onMessage(std::move(msg)))
+            else if (!session->onMessage(std::move(relayed)))
             {
                 DBG_LOG("[", client->getId(), "]: message handling went wrong");
                 removeSessionAbruptly(client);
             }
-        }
-        // Other: Abort -> Sender, Abort -> Receiver
-        else
-        {
-            removeSessionAbruptly(client);
-        }
+        };
+
+        auto handlers = MessageHandlers{
+            // FinalChunk: Success -> Sender , FinalChunk -> Receiver
+            [&](MessageTag<EMessageType::FinalChunk>, Message &final_chunk)
+            { session->onMessage(std::move(final_chunk)); },
+            // Resume: Resume -> Receiver
+            [&](MessageTag<EMessageType::Resume>, Message &resume)
+            { session->onMessage(std::move(resume)); },
+            // Chunk -> Receiver
+            [&](MessageTag<EMessageType::Chunk>, Message &chunk)
+            { relay(chunk, chunk.size() >= c_chunk_header_size && chunk.size() <= m_max_chunk_size + c_chunk_overhead); },
+            // CacheQuery: CacheReply -> Sender
+            [&](MessageTag<EMessageType::CacheQuery>, Message &query)
+            { onCacheQuery(client, std::move(query)); },
+            // Hole, Proof, Copy -> Receiver
+            [&](MessageTag<EMessageType::Hole>, Message &hole)
+            { relay(hole, hole.size() == sizeof(HoleData)); },
+            [&](MessageTag<EMessageType::Proof>, Message &proof)
+            { relay(proof, proof.size() <= c_max_proof_size); },
+            [&](MessageTag<EMessageType::Copy>, Message &copy)
+            { relay(copy, copy.size() == sizeof(CopyData)); },
+            // Cached -> Chunks from the cache -> Receiver
+            [&](MessageTag<EMessageType::Cached>, Message &cached)
+            { relay(cached, cached.size() == sizeof(CachedData)); },
+            // Refill: ends what the sender sent again for the cache
+            [&](MessageTag<EMessageType::Refill>, Message &refill)
+            { relay(refill, refill.size() == sizeof(CachedData)); },
+            // Other: Abort -> Sender, Abort -> Receiver
+            [&](Message &)
+            { removeSessionAbruptly(client); }};
+
+        dispatch(handlers, msg);
     }
 
     void onMessage(ConnectionPtr client, Message &&msg) override
@@ -335,59 +721,129 @@ class FileServer : public Net::ServerBase<EMessageType>
             return;
         }
 
-        if (msg.header.id == EMessageType::Send)
-        {
-            onSendEstablishment(client, std::move(msg));
-        }
-        else if (msg.header.id == EMessageType::RequestReceive)
-        {
-            onReceiveEstablishment(client, std::move(msg));
-        }
-        else if (msg.header.id == EMessageType::Receive)
-        {
-            establishTransmissionSession(client, std::move(msg));
-        }
-        else if (msg.header.id == EMessageType::FinishReceive)
-        {
-            DBG_LOG("on FinishReceive message");
-            finishSession(client);
-        }
-        else if (msg.header.id == EMessageType::FailedReceive)
-        {
-            DBG_LOG("on FailedReceive message");
-            DBG_LOG(msg);
-            ConnectionPtr sender = m_storage.getSenderByReceiver(client);
-
-            if (sender)
+        auto handlers = MessageHandlers{
+            [&](MessageTag<EMessageType::Send>, PreMetadata &&pre)
+            { onSendEstablishment(client, std::move(pre)); },
+            [&](MessageTag<EMessageType::Manifest>, ManifestData &&manifest)
+            { onManifest(client, std::move(manifest)); },
+            [&](MessageTag<EMessageType::RequestReceive>, PreMetadata &&request)
+            { onReceiveEstablishment(client, std::move(request)); },
+            [&](MessageTag<EMessageType::Receive>, ReceiveRequest &&request)
+            { establishTransmissionSession(client, std::move(request)); },
+            [&](MessageTag<EMessageType::Signatures>, Message &signatures)
+            { onSignatures(client, std::move(signatures)); },
+            [&](MessageTag<EMessageType::SendStripe>, StripeRequest &&request)
+            { onStripeEstablishment(client, std::move(request), true); },
+            [&](MessageTag<EMessageType::ReceiveStripe>, StripeRequest &&request)
+            { onStripeEstablishment(client, std::move(request), false); },
+            [&](MessageTag<EMessageType::FinishReceive>, Empty &&)
             {
-                removeSessionAbruptly(sender);
-            }
-        }
-        else
-        {
-            DBG_LOG("[", client->getId(), "]: unexpected message from a client. Type = ", static_cast<int>(msg.header.id));
-        }
+                DBG_LOG("on FinishReceive message");
+                finishSession(client);
+            },
+            [&](MessageTag<EMessageType::FailedReceive>, [[maybe_unused]] Message &failed)
+            {
+                DBG_LOG("on FailedReceive message");
+                DBG_LOG(failed);
+                ConnectionPtr sender = m_storage.getSenderByReceiver(client);
+
+                if (sender)
+                {
+                    removeSessionAbruptly(sender);
+                }
+            },
+            [&]([[maybe_unused]] Message &other)
+            { DBG_LOG("[", client->getId(), "]: unexpected message from a client. Type = ", static_cast<int>(other.header.id)); }};
+
+        dispatch(handlers, msg);
     }
 
   protected:
+    static constexpr std::chrono::milliseconds c_cache_poll_period{1};
+
+    // Blocks of earlier transfers, outlives the leases in m_storage and the jobs of the pools
+    ChunkCache m_cache;
+    WorkerPool m_cache_readers{WorkerPool::defaultThreadCount()};
+    WorkerPool m_cache_collectors{1}; // one thread keeps every stripe's chunks in order
     ClientStorage m_storage;
     uint64_t m_max_chunk_size = 512;
+    uint8_t m_max_stripe_count = c_max_stripe_count;
     DiscoveryServer m_discovery_server;
 };
 
 } // namespace PingPong
 
-int main()
+namespace
+{
+// $XDG_CACHE_HOME/pingpong/chunks, ~/.cache/pingpong/chunks without it, ./ppcache without a home
+std::filesystem::path defaultCacheDir()
+{
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return std::filesystem::path(xdg) / "pingpong" / "chunks";
+
+    if (const char *home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "pingpong" / "chunks";
+
+    return "ppcache";
+}
+
+// Nothing when the server is not to run
+std::optional<PingPong::ServerOptions> readArguments(int argc, char **argv)
+{
+    namespace po = boost::program_options;
+
+    PingPong::ServerOptions options;
+    options.cache_dir = defaultCacheDir();
+
+    po::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()
+        ("help", "Show the options")
+        ("cache-dir", po::value<std::filesystem::path>()->default_value(options.cache_dir), "Directory of the chunk cache, the blocks relayed for every sender")
+        ("cache-memory", po::value<uint64_t>()->default_value(options.cache_memory_limit / (1024 * 1024)), "MiB of cached blocks kept in memory")
+        ("cache-disk", po::value<uint64_t>()->default_value(options.cache_disk_limit / (1024 * 1024)), "MiB of cached blocks kept on disk, 0 turns the cache off");
+    // clang-format on
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return std::nullopt;
+    }
+
+    options.cache_dir = vm["cache-dir"].as<std::filesystem::path>();
+    options.cache_memory_limit = vm["cache-memory"].as<uint64_t>() * 1024 * 1024;
+    options.cache_disk_limit = vm["cache-disk"].as<uint64_t>() * 1024 * 1024;
+
+    return options;
+}
+} // namespace
+
+int main(int argc, char *argv[])
 {
     using namespace PingPong;
 
-    FileServer server(60009, 60010);
-    server.start();
+    std::optional<ServerOptions> options;
 
-    while (true)
+    try
+    {
+        options = readArguments(argc, argv);
+    }
+    catch (std::exception &e)
     {
-        server.update(true);
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
     }
 
+    if (!options)
+        return 0;
+
+    FileServer server(60009, 60010, *options);
+    server.start();
+    server.run();
+
     return 0;
 }
@@ -10,6 +10,13 @@ class ClientBase
 {
   public:
     ClientBase()
+        : m_incoming{m_messages_in}
+    {
+    }
+
+    // Lets several connections feed one shared incoming queue
+    explicit ClientBase(TSQueue<OwnedMessage<T>> &messages_in)
+        : m_incoming{messages_in}
     {
     }
 
@@ -26,7 +33,7 @@ class ClientBase
             boost::asio::ip::tcp::resolver resolver(m_context);
             boost::asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
-            m_connection = std::make_shared<Connection<T>>(Connection<T>::EOwner::Client, m_context, boost::asio::ip::tcp::socket(m_context), m_messages_in);
+            m_connection = std::make_shared<Connection<T>>(Connection<T>::EOwner::Client, m_context, boost::asio::ip::tcp::socket(m_context), m_incoming);
             m_connection->connectToServer(endpoints);
             m_context_thread = std::thread([this]()
                                            { m_context.run(); });
@@ -56,6 +63,12 @@ class ClientBase
         if (m_context_thread.joinable())
             m_context_thread.join();
 
+        // The posted close and the handlers it aborts still hold the connection. They run to completion here,
+        // so none is left behind for a later run of the context
+        m_context.restart();
+        m_context.run();
+        m_context.restart();
+
         m_connection.reset();
     }
 
@@ -86,15 +99,8 @@ class ClientBase
         return 0;
     }
 
-    bool send(const Message<T> &msg)
-    {
-        if (isConnected())
-            return m_connection->send(msg);
-        else
-            return false;
-    }
-
-    bool send(const Message<T> &&msg)
+    // Takes the message over. A message that is still needed is copied by the caller: send(Message<T>(msg))
+    bool send(Message<T> &&msg)
     {
         if (isConnected())
             return m_connection->send(std::move(msg));
@@ -104,7 +110,7 @@ class ClientBase
 
     TSQueue<OwnedMessage<T>> &incoming()
     {
-        return m_messages_in;
+        return m_incoming;
     }
 
   protected:
@@ -114,5 +120,6 @@ class ClientBase
 
   private:
     TSQueue<OwnedMessage<T>> m_messages_in;
+    TSQueue<OwnedMessage<T>> &m_incoming;
 };
 } // namespace Net
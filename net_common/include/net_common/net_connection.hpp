@@ -37,6 +37,9 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
 
     virtual ~Connection()
     {
+        // Messages still queued are dropped with the connection
+        if (m_queued_total)
+            m_queued_total->fetch_sub(m_queued_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
 
     uint32_t getId() const
@@ -63,12 +66,12 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
             boost::asio::async_connect(
                 m_socket,
                 endpoints,
-                [this](std::error_code ec, boost::asio::ip::tcp::endpoint endpoint)
+                [self = this->shared_from_this()](std::error_code ec, boost::asio::ip::tcp::endpoint endpoint)
                 {
                     if (!ec)
                     {
                         // readHeader();
-                        readValidation();
+                        self->readValidation();
                     }
                 });
         }
@@ -111,7 +114,8 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     }
 
   public:
-    bool send(const Message<T> msg)
+    // The message is moved through to m_messages_out, its body is never copied on the way
+    bool send(Message<T> &&msg)
     {
         if (!m_validated.load(std::memory_order_acquire))
             return false;
@@ -124,7 +128,9 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
             ++m_pending_writes;
         }
 
-        boost::asio::post(m_asio_context, [self = this->shared_from_this(), msg = std::move(msg)]()
+        addQueuedBytes(static_cast<int64_t>(c_frame_header_size + msg.body.size()));
+
+        boost::asio::post(m_asio_context, [self = this->shared_from_this(), msg = std::move(msg)]() mutable
                           {
                             bool already_writing = !self->m_messages_out.empty();
                             self->m_messages_out.push_back(std::move(msg));
@@ -141,6 +147,18 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
         return m_pending_writes;
     }
 
+    // Bytes sent but not yet written to the socket
+    uint64_t getQueuedBytes() const
+    {
+        return m_queued_bytes.load(std::memory_order_relaxed);
+    }
+
+    // Keeps the queued bytes of this connection counted in `total` as well
+    void countQueuedBytesIn(std::atomic<uint64_t> &total)
+    {
+        m_queued_total = &total;
+    }
+
     void waitForOutgoingQueueEmpty()
     {
         std::unique_lock<std::mutex> lk(m_flush_mutex);
@@ -160,40 +178,43 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     // ASYNC
     void writeHeader()
     {
-        boost::asio::async_write(m_socket, boost::asio::buffer(&m_messages_out.front().header, sizeof(MessageHeader<T>)),
-                                 [this](std::error_code ec, size_t length)
+        encode_frame_header(m_messages_out.front().header, m_frame_out);
+
+        boost::asio::async_write(m_socket, boost::asio::buffer(m_frame_out),
+                                 [self = this->shared_from_this()](std::error_code ec, size_t length)
                                  {
                                      if (!ec)
                                      {
-                                         if (m_messages_out.front().body.size() > 0)
+                                         if (self->m_messages_out.front().body.size() > 0)
                                          {
-                                             writeBody();
+                                             self->writeBody();
                                          }
                                          else
                                          {
-                                             m_messages_out.pop_front();
+                                             self->addQueuedBytes(-int64_t{c_frame_header_size});
+                                             self->m_messages_out.pop_front();
 
                                              {
-                                                 std::lock_guard<std::mutex> lk(m_flush_mutex);
-                                                 if (m_pending_writes > 0)
-                                                     --m_pending_writes;
-                                                 if (m_pending_writes == 0)
-                                                     m_flush_cv.notify_all();
+                                                 std::lock_guard<std::mutex> lk(self->m_flush_mutex);
+                                                 if (self->m_pending_writes > 0)
+                                                     --self->m_pending_writes;
+                                                 if (self->m_pending_writes == 0)
+                                                     self->m_flush_cv.notify_all();
                                              }
 
-                                             if (!m_messages_out.empty())
+                                             if (!self->m_messages_out.empty())
                                              {
-                                                 writeHeader();
+                                                 self->writeHeader();
                                              }
-                                             else if (m_close_after_flush)
+                                             else if (self->m_close_after_flush)
                                              {
-                                                 m_socket.close();
+                                                 self->m_socket.close();
                                              }
                                          }
                                      }
                                      else
                                      {
-                                         m_socket.close();
+                                         self->m_socket.close();
                                      }
                                  });
     }
@@ -202,32 +223,33 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     void writeBody()
     {
         boost::asio::async_write(m_socket, boost::asio::buffer(m_messages_out.front().body.data(), m_messages_out.front().body.size()),
-                                 [this](std::error_code ec, size_t length)
+                                 [self = this->shared_from_this()](std::error_code ec, size_t length)
                                  {
                                      if (!ec)
                                      {
-                                         m_messages_out.pop_front();
+                                         self->addQueuedBytes(-static_cast<int64_t>(c_frame_header_size + self->m_messages_out.front().body.size()));
+                                         self->m_messages_out.pop_front();
 
                                          {
-                                             std::lock_guard<std::mutex> lk(m_flush_mutex);
-                                             if (m_pending_writes > 0)
-                                                 --m_pending_writes;
-                                             if (m_pending_writes == 0)
-                                                 m_flush_cv.notify_all();
+                                             std::lock_guard<std::mutex> lk(self->m_flush_mutex);
+                                             if (self->m_pending_writes > 0)
+                                                 --self->m_pending_writes;
+                                             if (self->m_pending_writes == 0)
+                                                 self->m_flush_cv.notify_all();
                                          }
 
-                                         if (!m_messages_out.empty())
+                                         if (!self->m_messages_out.empty())
                                          {
-                                             writeHeader();
+                                             self->writeHeader();
                                          }
-                                         else if (m_close_after_flush)
+                                         else if (self->m_close_after_flush)
                                          {
-                                             m_socket.close();
+                                             self->m_socket.close();
                                          }
                                      }
                                      else
                                      {
-                                         m_socket.close();
+                                         self->m_socket.close();
                                      }
                                  });
     }
@@ -237,19 +259,19 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     {
         DBG_LOG((int)m_owner_type, " writeValidation. m_handshake_out = ", m_handshake_out);
         boost::asio::async_write(m_socket, boost::asio::buffer(&m_handshake_out, sizeof(uint64_t)),
-                                 [this](std::error_code ec, std::size_t length)
+                                 [self = this->shared_from_this()](std::error_code ec, std::size_t length)
                                  {
                                      if (!ec)
                                      {
-                                         if (m_owner_type == EOwner::Client)
+                                         if (self->m_owner_type == EOwner::Client)
                                          {
-                                             m_validated.store(true, std::memory_order_release);
-                                             readHeader();
+                                             self->m_validated.store(true, std::memory_order_release);
+                                             self->readHeader();
                                          }
                                      }
                                      else
                                      {
-                                         m_socket.close();
+                                         self->m_socket.close();
                                      }
                                  });
     }
@@ -258,38 +280,38 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     void readValidation(ServerBase<T> *server = nullptr)
     {
         boost::asio::async_read(m_socket, boost::asio::buffer(&m_handshake_in, sizeof(m_handshake_in)),
-                                [this, server](std::error_code ec, size_t length)
+                                [self = this->shared_from_this(), server](std::error_code ec, size_t length)
                                 {
-                                    DBG_LOG((int)m_owner_type, " readValidation result lambda. m_handshake_in = ", m_handshake_in);
+                                    DBG_LOG((int)self->m_owner_type, " readValidation result lambda. m_handshake_in = ", self->m_handshake_in);
                                     if (!ec)
                                     {
-                                        if (m_owner_type == EOwner::Server)
+                                        if (self->m_owner_type == EOwner::Server)
                                         {
-                                            if (m_handshake_in == m_handshake_crypted)
+                                            if (self->m_handshake_in == self->m_handshake_crypted)
                                             {
                                                 DBG_LOG("[SERVER]: client validated");
-                                                m_validated.store(true, std::memory_order_release);
-                                                server->onClientValidated(this->shared_from_this());
+                                                self->m_validated.store(true, std::memory_order_release);
+                                                server->onClientValidated(self);
 
-                                                readHeader();
+                                                self->readHeader();
                                             }
                                             else
                                             {
                                                 DBG_LOG("[SERVER]: client failed to be validated");
-                                                m_socket.close();
+                                                self->m_socket.close();
                                             }
                                         }
-                                        else if (m_owner_type == EOwner::Client)
+                                        else if (self->m_owner_type == EOwner::Client)
                                         {
-                                            m_handshake_out = obfuscate(m_handshake_in);
-                                            DBG_LOG((int)m_owner_type, " readValidation result lambda. m_handshake_out = ", m_handshake_out);
-                                            writeValidation();
+                                            self->m_handshake_out = self->obfuscate(self->m_handshake_in);
+                                            DBG_LOG((int)self->m_owner_type, " readValidation result lambda. m_handshake_out = ", self->m_handshake_out);
+                                            self->writeValidation();
                                         }
                                     }
                                     else
                                     {
                                         DBG_LOG("Client disconnected (on readValidation)");
-                                        m_socket.close();
+                                        self->m_socket.close();
                                     }
                                 });
     }
@@ -297,24 +319,29 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     // ASYNC
     void readHeader()
     {
-        boost::asio::async_read(m_socket, boost::asio::buffer(&m_forming_in_message.header, sizeof(MessageHeader<T>)),
-                                [this](std::error_code ec, size_t length)
+        boost::asio::async_read(m_socket, boost::asio::buffer(m_frame_in),
+                                [self = this->shared_from_this()](std::error_code ec, size_t length)
                                 {
                                     if (!ec)
                                     {
-                                        if (m_forming_in_message.header.size > 0)
+                                        if (!decode_frame_header(self->m_frame_in, self->m_forming_in_message.header))
                                         {
-                                            m_forming_in_message.body.resize(m_forming_in_message.header.size);
-                                            readBody();
+                                            DBG_LOG("Frame of wire version ", static_cast<int>(self->m_frame_in[0]), " instead of ", c_wire_version);
+                                            self->m_socket.close();
+                                        }
+                                        else if (self->m_forming_in_message.header.size > 0)
+                                        {
+                                            self->m_forming_in_message.body.resize(self->m_forming_in_message.header.size);
+                                            self->readBody();
                                         }
                                         else
                                         {
-                                            addToIncomingMessageQueue();
+                                            self->addToIncomingMessageQueue();
                                         }
                                     }
                                     else
                                     {
-                                        m_socket.close();
+                                        self->m_socket.close();
                                     }
                                 });
     }
@@ -323,15 +350,15 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     void readBody()
     {
         boost::asio::async_read(m_socket, boost::asio::buffer(m_forming_in_message.body.data(), m_forming_in_message.body.size()),
-                                [this](std::error_code ec, size_t length)
+                                [self = this->shared_from_this()](std::error_code ec, size_t length)
                                 {
                                     if (!ec)
                                     {
-                                        addToIncomingMessageQueue();
+                                        self->addToIncomingMessageQueue();
                                     }
                                     else
                                     {
-                                        m_socket.close();
+                                        self->m_socket.close();
                                     }
                                 });
     }
@@ -348,11 +375,19 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
         readHeader();
     }
 
+    void addQueuedBytes(const int64_t bytes)
+    {
+        m_queued_bytes.fetch_add(static_cast<uint64_t>(bytes), std::memory_order_relaxed);
+
+        if (m_queued_total)
+            m_queued_total->fetch_add(static_cast<uint64_t>(bytes), std::memory_order_relaxed);
+    }
+
     uint64_t obfuscate(uint64_t in)
     {
         uint64_t out = in ^ 0xBABA15ACAB0011FF;
         out = (out & 0xC0A0C0A0B0B0B0) >> 4 | (out & 0x0C0A0C0A0B0B0B), 4;
-        return out ^ 0xBABA15FACE1EE788;
+        return out ^ 0xBABA15FACE1EE788 ^ c_wire_version;
     }
 
   protected:
@@ -361,6 +396,8 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     TSQueue<Message<T>> m_messages_out;
     TSQueue<OwnedMessage<T>> &m_messages_in;
     Message<T> m_forming_in_message;
+    FrameHeader m_frame_in{};
+    FrameHeader m_frame_out{}; // of m_messages_out.front() while it is written
     EOwner m_owner_type = EOwner::Server;
     uint32_t m_id = 0;
 
@@ -371,6 +408,9 @@ class Connection : public std::enable_shared_from_this<Connection<T>>
     std::atomic_bool m_validated{false};
     bool m_close_after_flush{false};
 
+    std::atomic<uint64_t> m_queued_bytes{0};
+    std::atomic<uint64_t> *m_queued_total = nullptr; // owned by the server, outlives its connections
+
     // Handshake Validation
     uint64_t m_handshake_out = 0;
     uint64_t m_handshake_in = 0;
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <bitset>
+#include <cstring>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
 
 #include "net_common.hpp"
 
@@ -12,17 +18,460 @@ struct MessageHeader
 {
     T id{};
     uint32_t size = 0;
+    uint8_t flags = 0; // see c_frame_header_size
 };
 
+// Heap buffers of large message bodies, kept for reuse instead of being freed. Bounded in count and size
+class BodyPool
+{
+  public:
+    // Never destroyed, bodies may outlive static destructors
+    static BodyPool &instance()
+    {
+        static BodyPool *pool = new BodyPool;
+        return *pool;
+    }
+
+    std::vector<uint8_t> acquire()
+    {
+        std::scoped_lock lock(m_mutex);
+
+        if (m_free.empty())
+            return {};
+
+        std::vector<uint8_t> res = std::move(m_free.back());
+        m_free.pop_back();
+
+        return res;
+    }
+
+    void release(std::vector<uint8_t> &&buffer)
+    {
+        if (buffer.capacity() == 0 || buffer.capacity() > c_max_kept_capacity)
+            return;
+
+        buffer.clear();
+
+        std::scoped_lock lock(m_mutex);
+
+        if (m_free.size() < c_max_buffers)
+            m_free.push_back(std::move(buffer));
+    }
+
+  private:
+    static constexpr size_t c_max_buffers = 64;
+    static constexpr size_t c_max_kept_capacity = 1024 * 1024;
+
+    std::mutex m_mutex;
+    std::vector<std::vector<uint8_t>> m_free;
+};
+
+// Bytes of a message. Up to c_inline_capacity of them are stored in place, so control messages never
+// allocate. A body growing past that moves to a buffer from BodyPool and stays there.
+// share() freezes a body: copies of it then point to the same buffer instead of copying it. Changing
+// a shared body, or taking a writable pointer into it, first gives it a copy of its own
+class MessageBody
+{
+  public:
+    static constexpr size_t c_inline_capacity = 64;
+
+  public:
+    MessageBody() = default;
+
+    ~MessageBody()
+    {
+        releaseHeap();
+    }
+
+    MessageBody(const MessageBody &other)
+    {
+        copy(other);
+    }
+
+    MessageBody(MessageBody &&other) noexcept
+    {
+        take(other);
+    }
+
+    MessageBody &operator=(const MessageBody &other)
+    {
+        if (this != &other)
+        {
+            releaseHeap();
+            copy(other);
+        }
+
+        return *this;
+    }
+
+    MessageBody &operator=(MessageBody &&other) noexcept
+    {
+        if (this != &other)
+        {
+            releaseHeap();
+            take(other);
+        }
+
+        return *this;
+    }
+
+    uint8_t *data()
+    {
+        unshare();
+        return m_storage == EStorage::Heap ? m_heap.data() : m_inline.data();
+    }
+
+    const uint8_t *data() const
+    {
+        switch (m_storage)
+        {
+        case EStorage::Inline:
+            return m_inline.data();
+        case EStorage::Heap:
+            return m_heap.data();
+        case EStorage::Shared:
+            return m_shared->data();
+        }
+
+        return nullptr;
+    }
+
+    size_t size() const
+    {
+        switch (m_storage)
+        {
+        case EStorage::Inline:
+            return m_size;
+        case EStorage::Heap:
+            return m_heap.size();
+        case EStorage::Shared:
+            return m_shared->size();
+        }
+
+        return 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    bool isShared() const
+    {
+        return m_storage == EStorage::Shared;
+    }
+
+    uint8_t *begin()
+    {
+        return data();
+    }
+
+    uint8_t *end()
+    {
+        return data() + size();
+    }
+
+    const uint8_t *begin() const
+    {
+        return data();
+    }
+
+    const uint8_t *end() const
+    {
+        return data() + size();
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+    void reserve(const size_t capacity)
+    {
+        unshare();
+
+        if (m_storage == EStorage::Heap)
+            m_heap.reserve(capacity);
+        else if (capacity > c_inline_capacity)
+            spill(capacity);
+    }
+
+    // New bytes are zeroed, as with std::vector
+    void resize(const size_t size)
+    {
+        unshare();
+
+        if (m_storage == EStorage::Inline && size > c_inline_capacity)
+            spill(size);
+
+        if (m_storage == EStorage::Heap)
+        {
+            m_heap.resize(size);
+            return;
+        }
+
+        if (size > m_size)
+            std::memset(m_inline.data() + m_size, 0, size - m_size);
+
+        m_size = size;
+    }
+
+    void append(const uint8_t *data, const size_t size)
+    {
+        unshare();
+
+        if (m_storage == EStorage::Inline && m_size + size <= c_inline_capacity)
+        {
+            if (size > 0)
+                std::memcpy(m_inline.data() + m_size, data, size);
+
+            m_size += size;
+            return;
+        }
+
+        if (m_storage == EStorage::Inline)
+            spill(m_size + size);
+
+        m_heap.insert(m_heap.end(), data, data + size);
+    }
+
+    // Bodies whose bytes were copied so far, by copying a body that is not shared or by unsharing one.
+    // Lets a test tell that a path only moves
+    static uint64_t copyCount()
+    {
+        return s_copies.load(std::memory_order_relaxed);
+    }
+
+    // Inline bytes are small enough to copy, only a heap buffer becomes shared
+    void share()
+    {
+        if (m_storage != EStorage::Heap)
+            return;
+
+        m_shared = std::shared_ptr<const std::vector<uint8_t>>(new std::vector<uint8_t>(std::move(m_heap)), [](const std::vector<uint8_t> *buffer)
+                                                               {
+                                                                   BodyPool::instance().release(std::move(*const_cast<std::vector<uint8_t> *>(buffer)));
+                                                                   delete buffer; });
+        m_heap = std::vector<uint8_t>();
+        m_storage = EStorage::Shared;
+    }
+
+    // The bytes as a vector. A heap buffer is handed over as it is, the body is left empty
+    std::vector<uint8_t> takeBuffer()
+    {
+        unshare();
+
+        std::vector<uint8_t> res;
+
+        if (m_storage == EStorage::Heap)
+            res = std::move(m_heap);
+        else
+            res.assign(m_inline.begin(), m_inline.begin() + m_size);
+
+        m_heap = std::vector<uint8_t>();
+        m_storage = EStorage::Inline;
+        m_size = 0;
+
+        return res;
+    }
+
+  private:
+    enum class EStorage : uint8_t
+    {
+        Inline,
+        Heap,
+        Shared
+    };
+
+  private:
+    void spill(const size_t capacity)
+    {
+        m_heap = BodyPool::instance().acquire();
+        m_heap.reserve(capacity);
+        m_heap.assign(m_inline.begin(), m_inline.begin() + m_size);
+        m_storage = EStorage::Heap;
+    }
+
+    void unshare()
+    {
+        if (m_storage != EStorage::Shared)
+            return;
+
+        std::shared_ptr<const std::vector<uint8_t>> shared = std::move(m_shared);
+        s_copies.fetch_add(1, std::memory_order_relaxed);
+
+        m_storage = EStorage::Inline;
+        m_size = 0;
+        append(shared->data(), shared->size());
+    }
+
+    void releaseHeap()
+    {
+        if (m_storage == EStorage::Heap)
+            BodyPool::instance().release(std::move(m_heap));
+
+        m_heap = std::vector<uint8_t>();
+        m_shared.reset();
+        m_storage = EStorage::Inline;
+        m_size = 0;
+    }
+
+    void copy(const MessageBody &other)
+    {
+        if (other.m_storage == EStorage::Shared)
+        {
+            m_shared = other.m_shared;
+            m_storage = EStorage::Shared;
+            return;
+        }
+
+        s_copies.fetch_add(1, std::memory_order_relaxed);
+        append(other.data(), other.size());
+    }
+
+    void take(MessageBody &other)
+    {
+        m_storage = other.m_storage;
+        m_size = other.m_size;
+
+        if (m_storage == EStorage::Heap)
+            m_heap = std::move(other.m_heap);
+        else if (m_storage == EStorage::Shared)
+            m_shared = std::move(other.m_shared);
+        else
+            std::memcpy(m_inline.data(), other.m_inline.data(), m_size);
+
+        other.m_heap = std::vector<uint8_t>();
+        other.m_shared.reset();
+        other.m_storage = EStorage::Inline;
+        other.m_size = 0;
+    }
+
+  private:
+    std::array<uint8_t, c_inline_capacity> m_inline;
+    size_t m_size = 0; // inline bytes only
+    EStorage m_storage = EStorage::Inline;
+    std::vector<uint8_t> m_heap;
+    std::shared_ptr<const std::vector<uint8_t>> m_shared;
+
+    inline static std::atomic<uint64_t> s_copies{0};
+};
+
+// Layout of frames and message bodies. Mixed into the handshake and sent with every frame, peers that lay
+// them out differently fail validation instead of misreading each other.
+// 2: fields are read in the order they were written. 3: packed frame header
+constexpr uint64_t c_wire_version = 3;
+
+// Frame header on the wire, little-endian whatever the host:
+//   [0] wire version  [1] flags  [2..3] message type  [4..7] body length
+// Flags a receiver doesn't know are ignored, so they may only add to what a frame means
+constexpr size_t c_frame_header_size = 8;
+using FrameHeader = std::array<uint8_t, c_frame_header_size>;
+
+template <typename T>
+void encode_frame_header(const MessageHeader<T> &header, FrameHeader &out)
+{
+    const auto type = static_cast<uint32_t>(header.id);
+
+    out[0] = static_cast<uint8_t>(c_wire_version);
+    out[1] = header.flags;
+    out[2] = static_cast<uint8_t>(type);
+    out[3] = static_cast<uint8_t>(type >> 8);
+    out[4] = static_cast<uint8_t>(header.size);
+    out[5] = static_cast<uint8_t>(header.size >> 8);
+    out[6] = static_cast<uint8_t>(header.size >> 16);
+    out[7] = static_cast<uint8_t>(header.size >> 24);
+}
+
+// False when the frame is of another wire version
+template <typename T>
+bool decode_frame_header(const FrameHeader &in, MessageHeader<T> &header)
+{
+    header.flags = in[1];
+    header.id = static_cast<T>(uint32_t{in[2]} | uint32_t{in[3]} << 8);
+    header.size = uint32_t{in[4]} | uint32_t{in[5]} << 8 | uint32_t{in[6]} << 16 | uint32_t{in[7]} << 24;
+
+    return in[0] == static_cast<uint8_t>(c_wire_version);
+}
+
+// Read-only bytes inside a message body. Valid while the body is neither changed nor destroyed
+class ByteView
+{
+  public:
+    ByteView() = default;
+
+    ByteView(const uint8_t *data, const size_t size)
+        : m_data{data}, m_size{size}
+    {
+    }
+
+    // Not trivially copyable, so no struct holding a view is pushed raw, pointer and all
+    ByteView(const ByteView &other)
+        : m_data{other.m_data}, m_size{other.m_size}
+    {
+    }
+
+    ByteView &operator=(const ByteView &other)
+    {
+        m_data = other.m_data;
+        m_size = other.m_size;
+        return *this;
+    }
+
+    const uint8_t *data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    const uint8_t *begin() const
+    {
+        return m_data;
+    }
+
+    const uint8_t *end() const
+    {
+        return m_data + m_size;
+    }
+
+  private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+// Fields are appended with operator<< and read back in the same order with operator>>.
+// Reading moves a cursor and leaves the body as it is, so a read message can still be relayed
 template <typename T>
 struct Message
 {
     MessageHeader<T> header{};
-    std::vector<uint8_t> body;
+    MessageBody body;
+    size_t read_pos = 0; // not sent
 
+    // Bytes not read yet
     size_t size() const
     {
-        return body.size();
+        return body.size() - read_pos;
+    }
+
+    // Takes the next `size` bytes, or what is left of them, without copying
+    ByteView view(size_t size)
+    {
+        size = std::min(size, this->size());
+
+        const ByteView res(std::as_const(body).data() + read_pos, size);
+        read_pos += size;
+
+        return res;
     }
 
     friend std::ostream &operator<<(std::ostream &os, const Message<T> &msg)
@@ -45,11 +494,9 @@ struct Message
     {
         static_assert(std::is_trivially_copyable_v<DataType>, "Data is to complex to be pushed");
 
-        const size_t offset = msg.body.size();
-        msg.body.resize(msg.body.size() + sizeof(DataType));
-        std::memcpy(msg.body.data() + offset, &data, sizeof(DataType));
+        msg.body.append(reinterpret_cast<const uint8_t *>(&data), sizeof(DataType));
 
-        msg.header.size = msg.size();
+        msg.header.size = msg.body.size();
 
         return msg;
     }
@@ -72,14 +519,18 @@ struct Message
             return msg;
         }
 
-        const size_t bytes_to_copy = count * sizeof(Elem);
-        const size_t offset = msg.body.size();
+        msg.body.append(reinterpret_cast<const uint8_t *>(ptr), count * sizeof(Elem));
 
-        msg.body.resize(msg.body.size() + bytes_to_copy);
+        msg.header.size = msg.body.size();
 
-        std::memcpy(msg.body.data() + offset, reinterpret_cast<const uint8_t *>(ptr), bytes_to_copy);
+        return msg;
+    }
 
-        msg.header.size = msg.size();
+    // The bytes are copied, not the view
+    friend Message<T> &operator<<(Message<T> &msg, const ByteView &data)
+    {
+        msg.body.append(data.data(), data.size());
+        msg.header.size = msg.body.size();
 
         return msg;
     }
@@ -89,11 +540,10 @@ struct Message
     {
         static_assert(std::is_trivially_copyable_v<DataType>, "Data is to complex to be assigned to");
 
-        const size_t offset = msg.body.size() - sizeof(DataType);
-        std::memcpy(&data, msg.body.data() + offset, sizeof(DataType));
+        const size_t bytes_to_copy = std::min(sizeof(DataType), msg.size());
+        std::memcpy(&data, std::as_const(msg.body).data() + msg.read_pos, bytes_to_copy);
 
-        msg.body.resize(offset);
-        msg.header.size = msg.size();
+        msg.read_pos += bytes_to_copy;
 
         return msg;
     }
@@ -116,16 +566,17 @@ struct Message
             return msg;
         }
 
-        const size_t bytes_to_copy = std::min(count * sizeof(Elem), msg.body.size());
-        const size_t offset = msg.body.size() - bytes_to_copy;
+        const size_t bytes_to_copy = std::min(count * sizeof(Elem), msg.size());
 
-        std::memcpy(ptr, msg.body.data() + offset, bytes_to_copy);
+        std::memcpy(ptr, std::as_const(msg.body).data() + msg.read_pos, bytes_to_copy);
 
-        msg.body.resize(offset);
-        msg.header.size = msg.size();
+        msg.read_pos += bytes_to_copy;
 
         return msg;
     }
+
+    // Views are taken with view(), reading one as a value would copy a pointer off the wire
+    friend Message<T> &operator>>(Message<T> &msg, ByteView &data) = delete;
 };
 
 template <typename T>
@@ -69,6 +69,7 @@ class ServerBase
 
                     if (onClientConnect(new_conn))
                     {
+                        new_conn->countQueuedBytesIn(m_queued_bytes);
                         m_connections.push_back(new_conn);
                         m_connections.back()->connectToClient(*this, m_id_counter++);
 
@@ -107,11 +108,14 @@ class ServerBase
     {
         bool some_clients_disconnected = false;
 
+        // Every client's copy refers to the same body
+        msg.body.share();
+
         for (auto &client : m_connections)
         {
             if (client && client->isConnected() && client != ignore_client)
             {
-                client->send(std::move(msg));
+                client->send(Message<T>(msg));
             }
             else
             {
@@ -139,6 +143,12 @@ class ServerBase
         }
     }
 
+    // Bytes waiting to be written to any of the clients, safe to call from any thread
+    uint64_t getQueuedBytes() const
+    {
+        return m_queued_bytes.load(std::memory_order_relaxed);
+    }
+
   public:
     virtual void onClientValidated(std::shared_ptr<Connection<T>> client)
     {
@@ -161,6 +171,7 @@ class ServerBase
   protected:
     TSQueue<OwnedMessage<T>> m_messages_in;
 
+    std::atomic<uint64_t> m_queued_bytes{0}; // before m_connections, they count into it until destroyed
     std::deque<std::shared_ptr<Connection<T>>> m_connections;
 
     boost::asio::io_context m_asio_context;
@@ -5,6 +5,7 @@ pkgs.mkShell {
     pkgs.cmake
     pkgs.boost189
     pkgs.openssl
+    pkgs.zlib
     pkgs.gcc        # or clang, if you use clang
   ];
 }